@@ -0,0 +1,338 @@
+#!/usr/bin/env python3
+#
+# Gate di regressione delle prestazioni: esegue gli scenari a diversi numeri di rank locali, verifica il numero
+# di parole contate e confronta i tempi con bench/baseline.json. I numeri di rank oltre le CPU della macchina
+# si saltano: con più rank che core il tempo misura la contesa dello scheduler, non il programma.
+#
+DESCRIPTION = """Regression benchmark gate for the MPI word counter.
+
+Runs a fixed set of scenarios at several local rank counts, checks that every
+run counted the expected number of words and compares the timings with a stored
+baseline. Exits with status 1 if any measurement is slower than its baseline by
+more than the tolerance.
+
+The scenarios are:
+  many_small        MAX_FILES small files of English-like text
+  one_huge          a single large file
+  high_cardinality  mostly unique random tokens (large histograms, heavy merges)
+  zipfian           Zipf-distributed vocabulary, like natural text
+
+Corpora are generated deterministically and cached in --work-dir. Timings are
+the median of the "Total execution time" reported by the program over --repeat
+runs, so mpirun start-up time is not included.
+
+Rank counts above the number of CPUs are skipped (unless --oversubscribe is
+given), both when measuring and when comparing with the baseline. Record the
+baseline on a machine with at least as many cores as the largest rank count.
+
+Typical use:
+  python3 bench/run_bench.py                    # compare with bench/baseline.json
+  python3 bench/run_bench.py --update-baseline  # record a new baseline on this machine
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+CPUS = os.cpu_count() or 1
+
+SCENARIOS = ["many_small", "one_huge", "high_cardinality", "zipfian"]
+
+TIME_RE = re.compile(r"Total execution time: ([0-9.]+) seconds")
+
+
+def write_tokens(path, tokens, per_line=12):
+    """Scrive i token, per_line per riga."""
+    with open(path, "w") as f:
+        for i in range(0, len(tokens), per_line):
+            f.write(" ".join(tokens[i:i + per_line]))
+            f.write("\n")
+
+
+def zipf_vocabulary(rng, size):
+    """size parole distinte di 2-10 lettere, in ordine alfabetico."""
+    letters = "abcdefghijklmnopqrstuvwxyz"
+    words = set()
+    while len(words) < size:
+        words.add("".join(rng.choice(letters) for _ in range(rng.randint(2, 10))))
+    return sorted(words)
+
+
+def zipf_tokens(rng, vocabulary, count, exponent):
+    """count token estratti dal vocabolario con legge di Zipf di esponente exponent."""
+    weights = [1.0 / (rank + 1) ** exponent for rank in range(len(vocabulary))]
+    cum = []
+    total = 0.0
+    for w in weights:
+        total += w
+        cum.append(total)
+    return rng.choices(vocabulary, cum_weights=cum, k=count)
+
+
+def max_files():
+    """Limite MAX_FILES del filelist, letto da main.c perché i due valori non possano divergere."""
+    with open(os.path.join(REPO_DIR, "main.c")) as f:
+        match = re.search(r"^#define MAX_FILES (\d+)", f.read(), re.MULTILINE)
+    if not match:
+        raise RuntimeError("MAX_FILES not found in main.c")
+    return int(match.group(1))
+
+
+def generate_scenario(name, directory, scale):
+    """Scrive il corpus dello scenario; restituisce (percorsi dei file, token totali)."""
+    rng = random.Random(name)
+    os.makedirs(directory, exist_ok=True)
+    files = []
+    total = 0
+    if name == "many_small":
+        vocabulary = zipf_vocabulary(rng, 5000)
+        tokens_per_file = max(1, int(4000 * scale))
+        for i in range(max_files()):
+            tokens = zipf_tokens(rng, vocabulary, tokens_per_file, 1.0)
+            files.append(os.path.join(directory, "small%03d.txt" % i))
+            write_tokens(files[-1], tokens)
+            total += len(tokens)
+    elif name == "one_huge":
+        vocabulary = zipf_vocabulary(rng, 50000)
+        count = max(1, int(8000000 * scale))
+        files.append(os.path.join(directory, "huge.txt"))
+        with open(files[-1], "w") as f:
+            step = 1000000
+            for start in range(0, count, step):
+                tokens = zipf_tokens(rng, vocabulary, min(step, count - start), 1.0)
+                f.write("\n".join(" ".join(tokens[i:i + 12]) for i in range(0, len(tokens), 12)))
+                f.write("\n")
+        total = count
+    elif name == "high_cardinality":
+        tokens_per_file = max(1, int(500000 * scale))
+        for i in range(8):
+            tokens = ["t%x" % rng.getrandbits(40) for _ in range(tokens_per_file)]
+            files.append(os.path.join(directory, "unique%d.txt" % i))
+            write_tokens(files[-1], tokens)
+            total += len(tokens)
+    elif name == "zipfian":
+        vocabulary = zipf_vocabulary(rng, 200000)
+        tokens_per_file = max(1, int(1000000 * scale))
+        for i in range(8):
+            tokens = zipf_tokens(rng, vocabulary, tokens_per_file, 1.1)
+            files.append(os.path.join(directory, "zipf%d.txt" % i))
+            write_tokens(files[-1], tokens)
+            total += len(tokens)
+    else:
+        raise ValueError("unknown scenario " + name)
+    return files, total
+
+
+def prepare_scenario(name, work_dir, scale):
+    """Genera il corpus una sola volta per scala; restituisce (filelist, token totali)."""
+    directory = os.path.join(work_dir, "%s-x%g" % (name, scale))
+    meta_path = os.path.join(directory, "meta.json")
+    filelist = os.path.join(directory, "filelist.txt")
+    if os.path.exists(meta_path) and os.path.exists(filelist):
+        with open(meta_path) as f:
+            return filelist, json.load(f)["tokens"]
+    print("Generating %s corpus in %s" % (name, directory), flush=True)
+    files, total = generate_scenario(name, directory, scale)
+    with open(filelist, "w") as f:
+        f.write("\n".join(files) + "\n")
+    with open(meta_path, "w") as f:
+        json.dump({"tokens": total}, f)
+    return filelist, total
+
+
+def build_binary(work_dir):
+    """Compila main.c e wordcount.c con mpicc -O2 nella directory di lavoro."""
+    binary = os.path.join(work_dir, "wordcount")
+    sources = [os.path.join(REPO_DIR, name) for name in ("main.c", "wordcount.c")]
+    cmd = ["mpicc", "-O2"] + sources + ["-o", binary, "-lm"]
+    print("Building: " + " ".join(cmd), flush=True)
+    subprocess.run(cmd, check=True)
+    return binary
+
+
+def mpirun_command(args, ranks):
+    """Prefisso mpirun per lanciare ranks processi locali."""
+    cmd = [args.mpirun, "-np", str(ranks), "--oversubscribe"]
+    if hasattr(os, "geteuid") and os.geteuid() == 0:
+        cmd.append("--allow-run-as-root")
+    cmd.extend(args.mpirun_args.split())
+    return cmd
+
+
+def counted_words(csv_path):
+    """Somma delle frequenze di un word_frequencies.csv."""
+    total = 0
+    with open(csv_path) as f:
+        next(f)
+        for line in f:
+            total += int(line.rsplit(",", 1)[1])
+    return total
+
+
+def run_once(args, binary, filelist, ranks, output_dir):
+    """Un'esecuzione; restituisce il "Total execution time" stampato dal programma."""
+    cmd = mpirun_command(args, ranks) + [binary, "--filelist=" + filelist, "--output-dir=" + output_dir]
+    cmd.extend(args.program_args.split())
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True,
+                          timeout=args.timeout)
+    match = TIME_RE.search(proc.stdout)
+    if proc.returncode != 0 or not match:
+        raise RuntimeError("run failed (%s):\n%s" % (" ".join(cmd), proc.stdout[-2000:]))
+    return float(match.group(1))
+
+
+def measure(args, binary, scenarios):
+    """Misura ogni scenario a ogni numero di rank; restituisce (risultati, errori)."""
+    results = {}
+    failures = []
+    for name in scenarios:
+        filelist, tokens = prepare_scenario(name, args.work_dir, args.scale)
+        for ranks in args.ranks:
+            key = "%s/np%d" % (name, ranks)
+            output_dir = os.path.join(args.work_dir, "out", name, "np%d" % ranks)
+            os.makedirs(output_dir, exist_ok=True)
+            try:
+                times = [run_once(args, binary, filelist, ranks, output_dir) for _ in range(args.repeat)]
+            except (RuntimeError, subprocess.TimeoutExpired) as err:
+                failures.append("%s: %s" % (key, err))
+                print("%-28s FAILED" % key, flush=True)
+                continue
+            words = counted_words(os.path.join(output_dir, "word_frequencies.csv"))
+            if words != tokens:
+                failures.append("%s: counted %d words, expected %d" % (key, words, tokens))
+            results[key] = {"seconds": round(statistics.median(times), 4), "min": round(min(times), 4),
+                            "max": round(max(times), 4)}
+            print("%-28s %8.4f s  (min %.4f, max %.4f)" % (key, results[key]["seconds"], min(times), max(times)),
+                  flush=True)
+    return results, failures
+
+
+def compare(results, baseline, tolerance, min_delta):
+    """Stampa una riga per misura e restituisce l'elenco delle regressioni."""
+    regressions = []
+    # Le misure registrate con più rank che CPU non sono un riferimento valido
+    base_cpus = baseline.get("cpus")
+    base_results = {k: v for k, v in baseline.get("results", {}).items()
+                    if base_cpus is None or ranks_of(k) <= base_cpus}
+    print("\n%-28s %10s %10s %8s" % ("scenario", "baseline", "current", "change"))
+    for key in sorted(results):
+        current = results[key]["seconds"]
+        if key not in base_results:
+            print("%-28s %10s %10.4f %8s" % (key, "-", current, "new"))
+            continue
+        base = base_results[key]["seconds"]
+        change = (current - base) / base if base > 0 else 0.0
+        # Tempi molto brevi sono dominati dal rumore: serve anche un peggioramento assoluto minimo
+        slower = current > base * (1.0 + tolerance) and current - base > min_delta
+        print("%-28s %10.4f %10.4f %+7.1f%%%s" % (key, base, current, 100.0 * change, "  REGRESSION" if slower else ""))
+        if slower:
+            regressions.append("%s: %.4f s vs baseline %.4f s (%+.1f%%)" % (key, current, base, 100.0 * change))
+    return regressions
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=DESCRIPTION, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--baseline", default=os.path.join(BENCH_DIR, "baseline.json"))
+    parser.add_argument("--update-baseline", action="store_true", help="write the measurements as the new baseline")
+    parser.add_argument("--binary",
+                        help="word counter to benchmark (default: build main.c and wordcount.c with mpicc -O2)")
+    parser.add_argument("--scenarios", default=",".join(SCENARIOS))
+    parser.add_argument("--ranks", default="1,2,4", help="comma-separated rank counts")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--scale", type=float, default=1.0, help="corpus size multiplier")
+    parser.add_argument("--tolerance", type=float, help="allowed slowdown (default: the baseline's, else 0.15)")
+    parser.add_argument("--min-delta", type=float, default=0.05, help="ignore slowdowns below this many seconds")
+    parser.add_argument("--work-dir", default=os.path.join(tempfile.gettempdir(), "wordcount-bench"))
+    parser.add_argument("--mpirun", default="mpirun")
+    parser.add_argument("--mpirun-args", default="", help="extra arguments for mpirun")
+    parser.add_argument("--program-args", default="", help="extra options for the word counter")
+    parser.add_argument("--timeout", type=float, default=600.0, help="seconds allowed for a single run")
+    parser.add_argument("--oversubscribe", action="store_true",
+                        help="also run rank counts above the %d CPUs of this machine" % CPUS)
+    args = parser.parse_args()
+    args.ranks = [int(r) for r in args.ranks.split(",")]
+    scenarios = [s for s in args.scenarios.split(",") if s]
+    for s in scenarios:
+        if s not in SCENARIOS:
+            parser.error("unknown scenario %s (expected one of %s)" % (s, ", ".join(SCENARIOS)))
+    if args.repeat < 1 or any(r < 1 for r in args.ranks) or args.scale <= 0:
+        parser.error("--repeat, --ranks and --scale must be positive")
+    if (args.tolerance is not None and args.tolerance < 0) or args.min_delta < 0:
+        parser.error("--tolerance and --min-delta cannot be negative")
+    if not args.oversubscribe:
+        skipped = [r for r in args.ranks if r > CPUS]
+        if skipped:
+            print("Skipping %s ranks: only %d CPUs on this machine" % (",".join(map(str, skipped)), CPUS))
+        args.ranks = [r for r in args.ranks if r <= CPUS]
+    return args, scenarios
+
+
+def ranks_of(key):
+    """Numero di rank di una chiave "scenario/npN"."""
+    return int(key.rsplit("/np", 1)[1])
+
+
+def main():
+    args, scenarios = parse_args()
+    os.makedirs(args.work_dir, exist_ok=True)
+    binary = args.binary or build_binary(args.work_dir)
+    results, failures = measure(args, binary, scenarios)
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    tolerance = args.tolerance if args.tolerance is not None else baseline.get("tolerance", 0.15)
+
+    if args.update_baseline:
+        if failures:
+            print("\nNot updating the baseline, some runs failed:\n  " + "\n  ".join(failures))
+            return 1
+        merged = dict(baseline.get("results", {}))
+        merged.update(results)
+        if not args.oversubscribe:
+            merged = {k: v for k, v in merged.items() if ranks_of(k) <= CPUS}
+        baseline = {
+            "machine": "%s, %d CPUs" % (platform.machine(), CPUS),
+            "cpus": CPUS,
+            "scale": args.scale,
+            "repeat": args.repeat,
+            "program_args": args.program_args,
+            "tolerance": tolerance,
+            "results": merged,
+        }
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("\nBaseline written to " + args.baseline)
+        return 0
+
+    if not baseline:
+        print("\nNo baseline at %s: run with --update-baseline first" % args.baseline)
+        return 1
+    if not results and not failures:
+        print("\nNothing to measure: no rank count fits in the %d CPUs of this machine" % CPUS)
+        return 1
+    if baseline.get("scale") != args.scale or baseline.get("program_args", "") != args.program_args:
+        print("\nWarning: baseline recorded with scale %s and program args '%s'" %
+              (baseline.get("scale"), baseline.get("program_args", "")))
+    regressions = compare(results, baseline, tolerance, args.min_delta)
+    problems = failures + regressions
+    if problems:
+        print("\nFAILED (tolerance %.0f%%):\n  %s" % (100.0 * tolerance, "\n  ".join(problems)))
+        return 1
+    print("\nOK: no regressions beyond %.0f%%" % (100.0 * tolerance))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
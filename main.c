@@ -1,52 +1,786 @@
+// Compilazione: make, oppure mpicc -O2 main.c wordcount.c -o wordcount -lm
+#define _GNU_SOURCE
 #include <mpi.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <time.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "wordcount.h"
 
 #define MAX_FILENAME_LEN 256
 #define MAX_FILES 100
-#define MAX_WORD_LEN 100
+#define MAX_WORD_LEN WC_MAX_WORD_LEN
+#define MAX_GROUP_NAME_LEN 64
 #define INITIAL_HIST_CAPACITY 64 
+#define HIST_INDEX_MIN_SLOTS 128
+#define HIST_MAX_PROBE 64          // sonda più lunga tollerata prima di ricostruire l'indice con una nuova chiave
+#define READ_BLOCK_SIZE (1 << 20)
+#define ARENA_INITIAL_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 16
+#define DIRECT_IO_ALIGNMENT 4096
+#define LARGE_MESSAGE_CHUNK (1 << 28)  // segmenti da 256 MB, ben sotto il limite INT_MAX di MPI_Send
+#define COMM_POOL_SLOTS 16
+#define COMM_POOL_MIN_BUFFER (1 << 16)
+#define COMM_POOL_MAX_CACHED (1 << 26)  // oltre 64 MB di buffer liberi si restituiscono a MPI
+#define COMM_BUFFER_HEADER 64           // la capacità sta prima del buffer, che resta allineato alla linea di cache
 
 
 #define TAG_TASK 0
 #define TAG_PROCESSED_FILE_ACK 1
 #define TAG_END_OF_TASKS_SEND_HISTOGRAM 2
-#define TAG_HISTOGRAM_DATA_COUNT 3
-#define TAG_HISTOGRAM_DATA_WORD 4
-#define TAG_HISTOGRAM_DATA_FREQ 5
+#define TAG_HISTOGRAM_DATA_SIZE 3
+#define TAG_HISTOGRAM_DATA 4
+#define TAG_PARTIAL_HISTOGRAM_SIZE 5
+#define TAG_PASS_TASK 6
+#define TAG_PASS_ACK 7
+#define TAG_PASS_DONE 8
+#define TAG_MERGE_HISTOGRAM_SIZE 9
+#define TAG_WORKER_STATS 10
+
+#define MAX_JOB_ARGS 64
+
+#define ELASTIC_POLL_INTERVAL_US 200  // attesa del master tra due giri di MPI_Iprobe quando ci sono worker aggiunti
+#define PROGRESS_POLL_INTERVAL_US 50  // pausa del progress thread tra due chiamate nel motore di progresso MPI
+#define TASK_PREFETCH_DEPTH 2         // task in coda a ogni worker con il progress thread: quello in corso e il prossimo
+
+#define BLOOM_NUM_HASHES 3
+#define DEFAULT_BLOOM_COUNTERS (1 << 24)
+#define BLOOM_COUNTER_MAX 255
+
+#define FREQ_DIRECT_BUCKETS 65536  // frequenze sotto questa soglia hanno un bucket dedicato
+#define FREQ_NUM_BUCKETS (FREQ_DIRECT_BUCKETS + 1)  // più il bucket di overflow
+
+#define AC_ALPHABET 37          // separatore, a-z, 0-9
+#define AC_SEPARATOR 0
+#define MAX_TERM_LEN 1024
+
+#define PAIR_TABLE_INITIAL_CAPACITY 1024
+#define PAIR_EMPTY_KEY UINT64_MAX
+
+#define BYTE_VALUES 256
+#define BYTE_COUNT_TABLES 4
+#define UNICODE_CODEPOINTS 0x110000
+
+#define MPHF_INDEX_MAGIC "WCMPHF03"
+#define MPHF_MAX_LEVELS 64
+#define MPHF_MAX_ATTEMPTS 4          // semi provati prima di rinunciare all'indice (hash delle parole duplicati)
+#define MPHF_GAMMA 1.0            // bit per chiave ancora da piazzare a ogni livello (~3 bit/chiave per la funzione hash)
+#define MPHF_RANK_STRIDE 8        // un campione di rank ogni 8 parole da 64 bit
+
+#define DIFF_SMOOTHING 0.5
+
+#define SAMPLE_CHUNK_SIZE (1 << 16)       // unità di campionamento: blocchi da 64 KB di ciascun file
+#define SAMPLE_MIN_CHUNKS 2               // chunk minimi per file e per round, per poter stimare la varianza
+#define SAMPLE_TAIL_BLOCK 256             // lettura oltre la fine del chunk per completare l'ultima parola
+#define SAMPLE_COMPACT_MIN 65536          // voci in coda prima di riordinare l'accumulatore
+#define SAMPLE_Z_95 1.959963984540054     // quantile della normale per intervalli di confidenza al 95%
+
+#define MINHASH_NUM_HASHES 128
+#define MINHASH_BANDS 16                  // LSH: 16 bande da 8 righe, soglia della curva a S intorno a 0.7
+#define MINHASH_ROWS (MINHASH_NUM_HASHES / MINHASH_BANDS)
+#define DEDUP_SHINGLE_WORDS 3             // i documenti si confrontano sui trigrammi di parole
+#define DEFAULT_DEDUP_THRESHOLD 0.8
 
 typedef struct {
     char word[MAX_WORD_LEN];
     int frequency;
+    int group;          // gruppo del filelist a cui appartiene il conteggio (0 senza gruppi)
 } WordFreq;
 
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;        // byte utilizzabili dopo l'intestazione
+} ArenaChunk;
+
+/*
+ * Allocatore a puntatore crescente per lo stato temporaneo di un task: le allocazioni non si liberano
+ * una per una, arena_reset restituisce tutto insieme. head è il blocco corrente, i precedenti seguono in next.
+ */
+typedef struct {
+    ArenaChunk* head;
+    size_t used;        // byte occupati in head
+} Arena;
+
+/*
+ * Le voci stanno in items; slots è un indice a indirizzamento aperto (scansione lineare) sulle posizioni
+ * in items, costruito al primo inserimento. Riordinare o compattare items richiede histogram_drop_index.
+ */
 typedef struct {
     WordFreq* items;
     int count;      
     int capacity; 
+    int32_t* slots;     // posizione della voce in items, -1 se lo slot è libero; NULL se l'indice non esiste
+    int slot_mask;      // numero di slot - 1 (potenza di 2)
+    int indexed;        // le voci items[0..indexed) sono nell'indice; le successive vi entrano al prossimo inserimento
+    uint64_t salt;      // cambia la chiave dell'indice a ogni ricostruzione per sonde troppo lunghe
+    Arena* arena;       // se non NULL items e slots stanno nell'arena e si liberano con arena_reset
 } Histogram;
 
+typedef enum {
+    READ_MODE_BUFFERED,  // read() a blocchi attraverso la page cache
+    READ_MODE_DIRECT,    // O_DIRECT con buffer allineati, bypassa la page cache
+    READ_MODE_NOCACHE    // read() + posix_fadvise(DONTNEED) dopo ogni blocco
+} ReadMode;
+
+typedef enum {
+    SORT_BY_WORD,
+    SORT_BY_FREQUENCY  // frequenza decrescente, a parità di frequenza ordine alfabetico
+} SortOrder;
+
+typedef enum {
+    CHAR_HISTOGRAM_NONE,
+    CHAR_HISTOGRAM_BYTES,   // solo i 256 valori di byte
+    CHAR_HISTOGRAM_UTF8     // byte e code point UTF-8
+} CharHistogramMode;
+
+typedef struct {
+    ReadMode read_mode;
+    SortOrder sort_order;
+    int flush_threshold;  // parole uniche oltre le quali il worker invia un parziale (0 = mai)
+    int min_count;        // soglia minima di frequenza in output (0 = tutte le parole)
+    int bloom_counters;   // contatori del Bloom filter usato con min_count
+    char dictionary_path[MAX_FILENAME_LEN];  // lista di termini da contare; vuoto = conta tutte le parole
+    int cooccurrence_window;  // parole precedenti con cui ogni parola fa coppia (0 = modalità disattiva)
+    CharHistogramMode char_histogram;
+    int binary_output;        // scrive anche l'istogramma in formato binario (.bin) accanto al CSV
+    int merge_saved;          // il filelist elenca istogrammi salvati (CSV o binari) da fondere
+    char diff_filelist[MAX_FILENAME_LEN];  // secondo corpus da confrontare con filelist.txt; vuoto = nessun confronto
+    int mphf_index;           // aggiunge al file binario un indice a hash perfetto minimale
+    const char* lookup_words; // parole (separate da virgole) da cercare nell'indice di word_frequencies.bin
+    double sample_fraction;   // frazione dei chunk di ogni file da campionare per round (0 = conteggio esatto)
+    uint64_t sample_seed;
+    int stable_top_k;         // campiona altri round finché le prime K parole non cambiano (0 = un solo round)
+    int spawn_workers;        // worker aggiunti a run in corso con MPI_Comm_spawn (0 = pool fisso)
+    double spawn_after;       // secondi di conteggio dopo cui il master li lancia, se restano file da assegnare
+    const char* program_path; // eseguibile da lanciare per i worker aggiunti (argv[0])
+    char output_dir[MAX_FILENAME_LEN];  // directory dei file di output; vuoto = directory corrente
+    char jobs_path[MAX_FILENAME_LEN];   // file dei job da eseguire in sequenza nella stessa sessione MPI
+    char filelist_path[MAX_FILENAME_LEN];  // elenco dei file del corpus (nei job lo dà la riga del job)
+    double dedup_threshold;   // salta i file con somiglianza di Jaccard stimata almeno pari a questa (0 = nessuna dedup)
+    uint64_t hash_seed;       // seme fisso dell'hash delle parole, se hash_seed_set (altrimenti casuale per run)
+    int hash_seed_set;
+    int progress_thread;      // i worker avanzano le comunicazioni in un thread dedicato (MPI_THREAD_MULTIPLE)
+} Options;
+
+/*
+ * Thread che entra periodicamente nel motore di progresso di MPI mentre il worker conta, così i trasferimenti
+ * non bloccanti (parziali in uscita, task ricevuti in anticipo) avanzano davvero in parallelo al calcolo.
+ */
+typedef struct {
+    pthread_t thread;
+    MPI_Comm comm;      // duplicato di MPI_COMM_SELF su cui non viaggia nulla: serve solo a entrare in MPI
+    int stop;
+} ProgressThread;
+
+typedef void (*WordHandler)(void* ctx, const char* word);
+
+// Statistiche in stile wc di un file: righe (caratteri '\n'), parole (token) e byte
+typedef struct {
+    uint64_t lines;
+    uint64_t words;
+    uint64_t bytes;
+} FileStats;
+
+// Totali del corpus e distribuzione delle lunghezze dei token (l'ultimo bucket raccoglie i token troncati)
+typedef struct {
+    FileStats totals;
+    uint64_t token_lengths[MAX_WORD_LEN];
+} TextStats;
+
+#define TEXT_STATS_FIELDS (sizeof(TextStats) / sizeof(uint64_t))
+#define FILE_STATS_FIELDS (sizeof(FileStats) / sizeof(uint64_t))
+
+// Il tokenizer è quello di wordcount.c, così il programma e la libreria contano le stesse parole
+typedef struct {
+    WcTokenizer base;
+    WordHandler on_word;
+    void* word_ctx;
+    FileStats* stats;           // NULL se le statistiche non servono
+    uint64_t* token_lengths;
+} Tokenizer;
+
+// Counting Bloom filter a contatori saturanti da 8 bit
+typedef struct {
+    uint8_t* counters;
+    size_t num_counters;
+} CountingBloom;
+
+// Destinazione delle parole di un file: istogramma, gruppo del file ed eventuale filtro min-count
+typedef struct {
+    Histogram* hist;
+    int group;
+    const CountingBloom* filter;   // se presente, entrano solo le parole stimate frequenti almeno min_count
+    int min_count;
+} HistogramSink;
+
+// Etichette dei gruppi del filelist; count == 0 se nessuna riga ha un'etichetta
+typedef struct {
+    int file_group[MAX_FILES];
+    char names[MAX_FILES][MAX_GROUP_NAME_LEN];
+    int count;
+} CorpusGroups;
+
+// Messaggio TAG_TASK del conteggio parole
+typedef struct {
+    int32_t group;
+    char filename[MAX_FILENAME_LEN];
+} WordCountTask;
+
+/*
+ * Worker lanciati dal master a run in corso: si raggiungono tramite l'intercomunicatore restituito da
+ * MPI_Comm_spawn, dove il rank r del gruppo remoto è il worker aggiunto r.
+ */
+typedef struct {
+    MPI_Comm intercomm;     // MPI_COMM_NULL finché non sono stati lanciati
+    int num_workers;
+    int* assigned_file;     // file in corso su ciascun worker aggiunto
+    int pending;            // lancio richiesto ma non ancora avvenuto
+} ElasticPool;
+
+typedef struct {
+    CountingBloom* bloom;
+    const Options* opts;
+} BloomPass;
+
+typedef void (*FileTask)(const char* filename, void* ctx);
+
+/*
+ * Automa di Aho-Corasick completo (DFA) su un alfabeto normalizzato come il tokenizer: i caratteri
+ * alfanumerici minuscoli più un separatore che sostituisce qualsiasi sequenza di altri byte.
+ * Ogni termine è inserito come " parola1 parola2 ", così le corrispondenze rispettano i confini di parola.
+ */
+typedef struct {
+    int32_t* delta;        // num_states * AC_ALPHABET transizioni
+    int32_t* output;       // termine riconosciuto nello stato, -1 se nessuno
+    int32_t* output_link;  // stato più vicino lungo i fail link con un output, 0 se nessuno
+    int num_states;
+    int num_terms;
+} AhoCorasick;
+
+typedef struct {
+    const AhoCorasick* ac;
+    uint64_t* counts;
+    int32_t state;
+    int prev_separator;
+} AcScanner;
+
+typedef struct {
+    const AhoCorasick* ac;
+    uint64_t* counts;
+    const Options* opts;
+} DictionaryPass;
+
+// Coppia di ID (riga << 32 | colonna, con riga >= colonna) e relativo conteggio
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} PairCount;
+
+// Tabella hash a indirizzamento aperto per le coppie di parole
+typedef struct {
+    PairCount* slots;
+    size_t capacity;
+    size_t count;
+} PairTable;
+
+typedef struct {
+    const Histogram* vocabulary;
+    const int* sorted_ids;   // ID del vocabolario in ordine alfabetico, per la ricerca binaria
+    PairTable* pairs;
+    int window;
+    int* recent;             // buffer circolare degli ultimi window ID visti
+    int recent_count;
+    int recent_pos;
+    const Options* opts;
+} CooccurrencePass;
+
+/*
+ * Hash perfetto minimale in stile BBHash: al livello l ogni chiave ancora libera cade in un bit;
+ * le chiavi che non collidono restano lì, le altre passano al livello successivo.
+ * Lo slot di una chiave è il rank del suo bit nei livelli concatenati.
+ */
+typedef struct {
+    int num_levels;
+    uint64_t level_words[MPHF_MAX_LEVELS];  // dimensione di ogni livello in parole da 64 bit
+    uint64_t* bits;                         // bit di tutti i livelli concatenati
+    uint64_t total_words;
+    uint64_t* rank_samples;                 // bit a 1 prima di ogni blocco di MPHF_RANK_STRIDE parole
+    uint64_t num_keys;
+    uint32_t* slots;                        // solo sul master: slot di ogni voce, nell'ordine dell'istogramma
+    uint64_t hash_seed;                     // seme della chiave con cui sono state calcolate le hash delle parole
+} Mphf;
+
+// Confronto tra corpora: voci con gruppo 0 per il corpus A (filelist.txt) e 1 per il corpus B
+typedef struct {
+    Histogram* hist;
+    int corpus;
+    const Options* opts;
+    Arena scratch;
+} DiffPass;
+
+typedef struct {
+    char word[MAX_WORD_LEN];
+    uint64_t count_a;
+    uint64_t count_b;
+    double log2_ratio;       // log2 del rapporto tra frequenze relative B/A, con smoothing
+    double log_likelihood;   // G2 di Dunning, usato per l'ordinamento per significatività
+} DiffEntry;
+
+// Chunk da campionare: strato (indice del file) e posizione del blocco di SAMPLE_CHUNK_SIZE byte
+typedef struct {
+    int32_t file_idx;
+    int32_t chunk_idx;
+} SampleChunk;
+
+// Somme delle occorrenze di una parola nei chunk campionati di uno strato: sum e sumsq danno media e varianza
+typedef struct {
+    char word[MAX_WORD_LEN];
+    int32_t stratum;
+    uint64_t sum;
+    uint64_t sumsq;
+} SampleEntry;
+
+// Le prime sorted voci sono ordinate per (parola, strato) e senza duplicati; le altre sono in coda
+typedef struct {
+    SampleEntry* items;
+    int count;
+    int capacity;
+    int sorted;
+} SampleAccumulator;
+
+typedef struct {
+    char (*file_list)[MAX_FILENAME_LEN];
+    SampleAccumulator* acc;
+    char* buffer;    // SAMPLE_CHUNK_SIZE byte
+} SamplePass;
+
+typedef struct {
+    char word[MAX_WORD_LEN];
+    double estimate;
+    double ci_low;
+    double ci_high;
+} SampleEstimate;
+
+// Firma MinHash di un file: per ogni funzione hash il minimo sugli shingle (ultime DEDUP_SHINGLE_WORDS parole)
+typedef struct {
+    uint64_t* signature;
+    uint64_t recent[DEDUP_SHINGLE_WORDS];  // hash delle ultime parole, in buffer circolare
+    int recent_count;
+    uint64_t words;
+} MinHashScanner;
+
+typedef struct {
+    char (*file_list)[MAX_FILENAME_LEN];
+    int total_files;
+    uint64_t* signatures;   // total_files * MINHASH_NUM_HASHES; UINT64_MAX per i file non elaborati da questo rank
+    const Options* opts;
+} DedupPass;
+
+// Voce di un bucket LSH: hash delle righe di una banda della firma e file a cui appartiene
+typedef struct {
+    uint64_t bucket;
+    int32_t band;
+    int32_t file_idx;
+} LshEntry;
+
+typedef struct {
+    int32_t file_a;
+    int32_t file_b;
+} DuplicatePair;
+
+typedef struct {
+    uint64_t* byte_counts;       // BYTE_VALUES contatori
+    uint64_t* codepoint_counts;  // UNICODE_CODEPOINTS contatori + 1 per le sequenze non valide; NULL senza UTF-8
+    uint32_t codepoint;          // code point in corso di decodifica
+    uint32_t min_codepoint;      // valore minimo ammesso per la lunghezza della sequenza (scarta le forme overlong)
+    int pending;                 // byte di continuazione ancora attesi
+    const Options* opts;
+} CharScanner;
+
+typedef void (*BlockHandler)(void* ctx, const char* block, size_t len);
+
+// Trasferimento di un buffer di dimensione arbitraria, eventualmente spezzato in più messaggi
+typedef struct {
+    MPI_Request* requests;
+    int num_requests;
+} LargeTransfer;
+
+// Istogramma serializzato in volo verso un altro rank; buf == NULL se non c'è nulla in corso
+typedef struct {
+    char* buf;
+    size_t len;
+    LargeTransfer xfer;
+} PendingHistogramSend;
+
+typedef enum {
+    MEM_HISTOGRAM,
+    MEM_IO_BUFFER,
+    MEM_MPI_BUFFER,
+    MEM_ARENA,
+    MEM_NUM_CATEGORIES
+} MemCategory;
+
+/*
+ * Buffer di comunicazione liberi, allocati con MPI_Alloc_mem (memoria già registrata con la rete sulle
+ * interconnessioni RDMA) e riusati fra task e riduzioni invece di allocarne uno nuovo per ogni messaggio.
+ */
+typedef struct {
+    char* buffers[COMM_POOL_SLOTS];
+    size_t capacities[COMM_POOL_SLOTS];
+    int num_free;
+    size_t cached_bytes;
+} CommBufferPool;
+
+static const char* mem_category_names[MEM_NUM_CATEGORIES] = {
+    "histogram tables", "I/O buffers", "MPI buffers", "scratch arenas"
+};
+
+// Byte allocati (correnti e di picco) per categoria su questo rank
+static size_t mem_current[MEM_NUM_CATEGORIES];
+static size_t mem_peak[MEM_NUM_CATEGORIES];
+static size_t mem_current_total;
+static size_t mem_peak_total;
+
+static CommBufferPool comm_pool;
+
+// Directory degli output del job corrente (vuota = directory corrente)
+static char output_dir[MAX_FILENAME_LEN];
+
+// Chiave SipHash della run: derivata da un seme che il master estrae e trasmette, uguale su tutti i rank
+static uint64_t hash_seed;
+static uint64_t hash_key[2];
+
+// MPI è stato inizializzato con MPI_THREAD_MULTIPLE: solo allora si può usare il progress thread
+static int mpi_thread_multiple;
+
+// Tutti i rank interpretano le stesse opzioni: gli errori li stampa solo il master
+static int options_quiet;
+
+void mem_track_alloc(MemCategory category, size_t bytes);
+void mem_track_free(MemCategory category, size_t bytes);
+void report_memory_usage(int rank, int size);
+char* comm_buffer_acquire(size_t len);
+void comm_buffer_release(char* buf);
+void comm_pool_drain(void);
+void arena_init(Arena* arena);
+void* arena_alloc(Arena* arena, size_t bytes);
+void* arena_grow(Arena* arena, void* ptr, size_t old_bytes, size_t new_bytes);
+void arena_reset(Arena* arena);
+void arena_destroy(Arena* arena);
 void init_histogram(Histogram* hist);
-void add_word_to_histogram(Histogram* hist, const char* word_str);
+void init_histogram_in_arena(Histogram* hist, Arena* arena);
+void histogram_drop_index(Histogram* hist);
+uint64_t histogram_slot_hash(const Histogram* hist, int group, const char* word);
+int histogram_index_insert(Histogram* hist, int idx);
+int histogram_rebuild_index(Histogram* hist, int num_slots);
+void histogram_rekey(Histogram* hist, int probe);
+WordFreq* histogram_find_or_insert(Histogram* hist, int group, const char* word);
+void add_word_to_histogram(Histogram* hist, int group, const char* word_str);
 void merge_histograms(Histogram* dest_hist, const Histogram* source_hist);
 void free_histogram_content(Histogram* hist);
 int compare_wordfreq(const void* a, const void* b);
+int compare_wordfreq_by_frequency(const void* a, const void* b);
 void sort_histogram_by_word(Histogram* hist);
+int frequency_bucket(int frequency);
+int histogram_is_sorted_by_word(const Histogram* hist);
+void frequency_sort_positions(const int* freqs, int n, int* positions, int* bucket_totals);
+void sort_histogram_by_frequency(Histogram* hist, int rank, int size);
 void write_histogram_to_csv(const Histogram* hist, const char* csv_filename);
-Histogram* count_words_in_file(const char* filename);  
+char* serialize_histogram(const Histogram* hist, size_t* out_len);
+void deserialize_histogram(const char* buf, size_t len, Histogram* hist);
+void start_large_send(const char* buf, size_t len, int dest, int tag, MPI_Comm comm, LargeTransfer* xfer);
+void start_large_recv(char* buf, size_t len, int source, int tag, MPI_Comm comm, LargeTransfer* xfer);
+void wait_large_transfer(LargeTransfer* xfer);
+void start_histogram_send(const Histogram* hist, int dest, int size_tag, MPI_Comm comm, PendingHistogramSend* pending);
+void finish_histogram_send(PendingHistogramSend* pending);
+void send_histogram(const Histogram* hist, int dest, MPI_Comm comm);
+void recv_histogram(Histogram* hist, int source, int size_tag, MPI_Comm comm);
+int scan_file(const char* filename, ReadMode read_mode, BlockHandler handler, void* ctx);
+void tokenizer_init(Tokenizer* tok, WordHandler on_word, void* word_ctx);
+void tokenizer_emit(void* ctx, const char* word, size_t len);
+void tokenize_block(void* ctx, const char* block, size_t len);
+void tokenizer_finish(Tokenizer* tok);
+void histogram_word_handler(void* ctx, const char* word);
+void filtered_histogram_word_handler(void* ctx, const char* word);
+void tokenizer_collect_stats(Tokenizer* tok, FileStats* stats, uint64_t* token_lengths);
+uint64_t count_newlines(const char* block, size_t len);
+Histogram* count_words_in_file(const char* filename, int group, const Options* opts, const CountingBloom* filter,
+                               FileStats* file_stats, uint64_t* token_lengths, Arena* scratch);
+void write_file_stats(char file_list[][MAX_FILENAME_LEN], int total_files, const FileStats* file_stats,
+                      const TextStats* stats);
+void init_hash_key(uint64_t seed);
+uint64_t hash_word_keyed(const char* word, const uint64_t key[2]);
+uint64_t hash_word(const char* word);
+uint64_t hash_pair(uint64_t key);
+void init_bloom(CountingBloom* bloom, size_t num_counters);
+void free_bloom(CountingBloom* bloom);
+void bloom_add_word(void* ctx, const char* word);
+int bloom_estimate(const CountingBloom* bloom, const char* word);
+void bloom_saturating_sum(void* in, void* inout, int* len, MPI_Datatype* datatype);
+void bloom_count_file(const char* filename, void* ctx);
+void build_min_count_filter(CountingBloom* bloom, char file_list[][MAX_FILENAME_LEN], int total_files,
+                            const Options* opts, int rank, int size);
+void drop_rare_words(Histogram* hist, int min_count);
+int read_file_list(const char* path, char file_list[][MAX_FILENAME_LEN], CorpusGroups* groups);
+int find_or_add_group(CorpusGroups* groups, const char* name);
+Histogram* split_histogram_by_group(Histogram* hist, int num_groups);
+void run_file_tasks(char file_list[][MAX_FILENAME_LEN], int total_files, int rank, int size, FileTask task, void* ctx);
+void run_word_count(char file_list[][MAX_FILENAME_LEN], int total_files, const CorpusGroups* groups,
+                    const Options* opts, int rank, int size, Histogram* vocabulary, TextStats* stats);
+void send_word_count_task(char file_list[][MAX_FILENAME_LEN], const CorpusGroups* groups, int file_idx, int dest,
+                          MPI_Comm comm);
+void spawn_elastic_workers(ElasticPool* pool, const Options* opts, char file_list[][MAX_FILENAME_LEN],
+                           const CorpusGroups* groups, int total_files, int* next_file_idx);
+void run_elastic_worker(const Options* opts, MPI_Comm parent);
+void print_text_stats(const TextStats* stats);
+void run_master_word_count(char file_list[][MAX_FILENAME_LEN], int total_files, const CorpusGroups* groups,
+                           const Options* opts, const CountingBloom* word_filter, int size, Histogram* global_histogram,
+                           FileStats* file_stats, TextStats* local_stats);
+void run_worker_word_count(const Options* opts, const CountingBloom* word_filter, TextStats* local_stats, MPI_Comm comm);
+void init_ac_symbols(void);
+int normalize_term(const char* line, char* term, uint8_t* symbols, int max_symbols);
+int ac_add_state(AhoCorasick* ac, int* capacity);
+int build_aho_corasick(AhoCorasick* ac, const char* dictionary_path, char*** terms_out);
+void broadcast_aho_corasick(AhoCorasick* ac, int rank);
+void free_aho_corasick(AhoCorasick* ac);
+void ac_feed_symbol(AcScanner* scanner, int symbol);
+void ac_scan_block(void* ctx, const char* block, size_t len);
+void dictionary_count_file(const char* filename, void* ctx);
+void run_dictionary_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size);
+void init_pair_table(PairTable* table, size_t capacity);
+void free_pair_table(PairTable* table);
+void pair_table_add(PairTable* table, uint64_t key, uint64_t count);
+void broadcast_histogram(Histogram* hist, int rank);
+int* sort_vocabulary_ids(const Histogram* vocabulary);
+int vocabulary_lookup(const Histogram* vocabulary, const int* sorted_ids, const char* word);
+void cooccurrence_word_handler(void* ctx, const char* word);
+void cooccurrence_count_file(const char* filename, void* ctx);
+void reduce_pair_tables(const PairTable* local, PairTable* owned, int size);
+int compare_pair_keys(const void* a, const void* b);
+void write_cooccurrence_matrix(const PairTable* owned, int vocabulary_size, const char* path, int rank, int size);
+void run_cooccurrence_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size,
+                            TextStats* stats);
+void count_bytes_block(uint64_t* byte_counts, const unsigned char* data, size_t len);
+void utf8_feed_byte(CharScanner* scanner, unsigned char c);
+void char_scan_block(void* ctx, const char* block, size_t len);
+void char_count_file(const char* filename, void* ctx);
+void write_char_histograms(const uint64_t* byte_counts, const uint64_t* codepoint_counts);
+void run_char_histogram(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size);
+void write_histogram_to_binary(const Histogram* hist, const char* path, const Mphf* index);
+int load_saved_histogram(const char* path, Histogram* hist);
+void merge_sorted_histograms(Histogram* dest, const Histogram* src);
+void merge_saved_file(const char* filename, void* ctx);
+void tree_reduce_sorted_histograms(Histogram* hist, int rank, int size);
+void write_word_histogram(Histogram* hist, const Options* opts, const char* base_name, int rank, int size);
+void run_merge_saved(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size);
+void diff_load_file(const char* filename, void* ctx);
+void* alltoall_by_owner(const void* items, int count, size_t item_size, const int* owner, int size, int* out_count);
+void exchange_by_word_owner(const Histogram* local, Histogram* owned, int size);
+double log_likelihood(uint64_t a, uint64_t b, uint64_t total_a, uint64_t total_b);
+int compare_diff_entries(const void* a, const void* b);
+DiffEntry* join_corpus_counts(const Histogram* owned, const uint64_t* totals, int min_count, int* out_count);
+void merge_sorted_diff_runs(DiffEntry* items, const int* displs, int runs, int total);
+void write_diff_csv(const DiffEntry* entries, int count, const char* path);
+void run_corpus_diff(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size);
+uint64_t mphf_level_hash(uint64_t key_hash, int level, uint64_t level_bits);
+void mphf_bits_union(void* in, void* inout, int* len, MPI_Datatype* datatype);
+uint64_t mphf_rank(const uint64_t* bits, const uint64_t* rank_samples, uint64_t bit);
+int mphf_build_levels(Mphf* mphf, const uint64_t* hashes, int local_n, uint64_t n, uint64_t* key_bit);
+int build_mphf(const Histogram* hist, int rank, int size, Mphf* mphf);
+void free_mphf(Mphf* mphf);
+uint64_t read_u64(const char* p);
+void run_index_lookup(const char* index_path, const char* words);
+uint64_t sample_next_random(uint64_t* state);
+int compare_sample_entries(const void* a, const void* b);
+void init_sample_accumulator(SampleAccumulator* acc);
+void sample_accumulator_push(SampleAccumulator* acc, const SampleEntry* entry);
+void sample_accumulator_compact(SampleAccumulator* acc);
+void free_sample_accumulator(SampleAccumulator* acc);
+ssize_t pread_full(int fd, char* buf, size_t len, off_t offset);
+void sample_chunk(const SampleChunk* chunk, SamplePass* pass);
+void run_sample_chunks(const SampleChunk* chunks, int num_chunks, int rank, int size, SamplePass* pass);
+int64_t sampled_chunks_target(int64_t chunks, double fraction, int round);
+SampleEstimate* estimate_sampled_words(const SampleAccumulator* owned, const int64_t* file_chunks,
+                                       const int64_t* sampled, int* out_count);
+int compare_sample_estimates(const void* a, const void* b);
+int compare_sample_estimates_by_word(const void* a, const void* b);
+void write_sample_estimates(const SampleEstimate* estimates, int count, const char* path);
+void run_sampled_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size);
+uint64_t minhash_function_seed(int i);
+void minhash_word_handler(void* ctx, const char* word);
+void minhash_add_shingle(MinHashScanner* scanner);
+void minhash_file(const char* filename, void* ctx);
+double signature_similarity(const uint64_t* a, const uint64_t* b);
+int compare_lsh_entries(const void* a, const void* b);
+int run_dedup(char file_list[][MAX_FILENAME_LEN], int total_files, CorpusGroups* groups, const Options* opts,
+              int rank, int size);
+const char* output_path(const char* name);
+void run_job(const Options* opts, const char* filelist_path, int rank, int size);
+void run_job_batch(const char* jobs_path, int argc, char* argv[], int rank, int size);
+void option_error(const char* format, ...);
+int parse_int_value(const char* name, const char* value, int min_value, int* out);
+int parse_options(int argc, char* argv[], Options* opts);
+int progress_thread_enabled(const Options* opts);
+void* progress_thread_main(void* arg);
+void progress_thread_start(ProgressThread* progress);
+void progress_thread_stop(ProgressThread* progress);
+void print_usage(const char* prog);
+
+void mem_track_alloc(MemCategory category, size_t bytes) {
+    mem_current[category] += bytes;
+    if (mem_current[category] > mem_peak[category]) {
+        mem_peak[category] = mem_current[category];
+    }
+    mem_current_total += bytes;
+    if (mem_current_total > mem_peak_total) {
+        mem_peak_total = mem_current_total;
+    }
+}
+
+void mem_track_free(MemCategory category, size_t bytes) {
+    mem_current[category] -= bytes;
+    mem_current_total -= bytes;
+}
+
+// Collettiva: ogni rank contribuisce i propri picchi, il master stampa massimo e media
+void report_memory_usage(int rank, int size) {
+    double local[MEM_NUM_CATEGORIES + 2];
+    double max_vals[MEM_NUM_CATEGORIES + 2];
+    double sum_vals[MEM_NUM_CATEGORIES + 2];
+
+    for (int i = 0; i < MEM_NUM_CATEGORIES; ++i) {
+        local[i] = (double)mem_peak[i];
+    }
+    local[MEM_NUM_CATEGORIES] = (double)mem_peak_total;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    local[MEM_NUM_CATEGORIES + 1] = (double)usage.ru_maxrss * 1024.0;  // ru_maxrss è in KB su Linux
+
+    MPI_Reduce(local, max_vals, MEM_NUM_CATEGORIES + 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(local, sum_vals, MEM_NUM_CATEGORIES + 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        const double mb = 1024.0 * 1024.0;
+        printf("Peak memory per rank (max / avg over %d ranks):\n", size);
+        for (int i = 0; i < MEM_NUM_CATEGORIES; ++i) {
+            printf("  %-18s %10.2f MB / %10.2f MB\n", mem_category_names[i], max_vals[i] / mb, sum_vals[i] / size / mb);
+        }
+        printf("  %-18s %10.2f MB / %10.2f MB\n", "tracked total",
+               max_vals[MEM_NUM_CATEGORIES] / mb, sum_vals[MEM_NUM_CATEGORIES] / size / mb);
+        printf("  %-18s %10.2f MB / %10.2f MB\n", "peak RSS",
+               max_vals[MEM_NUM_CATEGORIES + 1] / mb, sum_vals[MEM_NUM_CATEGORIES + 1] / size / mb);
+    }
+}
+
+void arena_init(Arena* arena) {
+    arena->head = NULL;
+    arena->used = 0;
+}
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (!arena->head || arena->used + bytes > arena->head->size) {
+        // Blocchi di dimensione doppia: il più recente è più grande di tutti i precedenti messi insieme
+        size_t size = arena->head ? arena->head->size * 2 : ARENA_INITIAL_SIZE;
+        while (size < bytes) {
+            size *= 2;
+        }
+        ArenaChunk* chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + size);
+        if (!chunk) {
+            perror("Failed to allocate arena block");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_ARENA, size);
+        chunk->next = arena->head;
+        chunk->size = size;
+        arena->head = chunk;
+        arena->used = 0;
+    }
+    void* ptr = (char*)(arena->head + 1) + arena->used;
+    arena->used += bytes;
+    return ptr;
+}
+
+// Se ptr è l'ultima allocazione del blocco corrente si estende sul posto, altrimenti si copia
+void* arena_grow(Arena* arena, void* ptr, size_t old_bytes, size_t new_bytes) {
+    size_t old_aligned = (old_bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t new_aligned = (new_bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (arena->head && (char*)ptr + old_aligned == (char*)(arena->head + 1) + arena->used &&
+        arena->used - old_aligned + new_aligned <= arena->head->size) {
+        arena->used = arena->used - old_aligned + new_aligned;
+        return ptr;
+    }
+    void* grown = arena_alloc(arena, new_bytes);
+    memcpy(grown, ptr, old_bytes);
+    return grown;
+}
+
+/*
+ * Rilascia tutte le allocazioni. Di norma costa O(1); se il task ha dovuto aggiungere blocchi si tiene
+ * solo l'ultimo, il più grande, così i task successivi di dimensione simile restano in un solo blocco.
+ */
+void arena_reset(Arena* arena) {
+    if (arena->head) {
+        ArenaChunk* chunk = arena->head->next;
+        while (chunk) {
+            ArenaChunk* next = chunk->next;
+            mem_track_free(MEM_ARENA, chunk->size);
+            free(chunk);
+            chunk = next;
+        }
+        arena->head->next = NULL;
+    }
+    arena->used = 0;
+}
+
+void arena_destroy(Arena* arena) {
+    arena_reset(arena);
+    if (arena->head) {
+        mem_track_free(MEM_ARENA, arena->head->size);
+        free(arena->head);
+    }
+    arena->head = NULL;
+}
 
 void init_histogram(Histogram* hist) {
-    hist->items = (WordFreq*)malloc(INITIAL_HIST_CAPACITY * sizeof(WordFreq));
-    if (!hist->items) {
-        perror("Failed to allocate histogram items");
-        MPI_Abort(MPI_COMM_WORLD, 1);
+    init_histogram_in_arena(hist, NULL);
+}
+
+// Con un'arena le tabelle non vanno liberate una per una: free_histogram_content le abbandona all'arena
+void init_histogram_in_arena(Histogram* hist, Arena* arena) {
+    hist->arena = arena;
+    if (arena) {
+        hist->items = (WordFreq*)arena_alloc(arena, INITIAL_HIST_CAPACITY * sizeof(WordFreq));
+    } else {
+        hist->items = (WordFreq*)malloc(INITIAL_HIST_CAPACITY * sizeof(WordFreq));
+        if (!hist->items) {
+            perror("Failed to allocate histogram items");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_HISTOGRAM, INITIAL_HIST_CAPACITY * sizeof(WordFreq));
     }
     hist->count = 0;
     hist->capacity = INITIAL_HIST_CAPACITY;
+    hist->slots = NULL;
+    hist->slot_mask = 0;
+    hist->indexed = 0;
+    hist->salt = 0;
 }
 
 void ensure_capacity(Histogram* hist, int min_capacity) {
@@ -55,59 +789,152 @@ void ensure_capacity(Histogram* hist, int min_capacity) {
         if (new_capacity < min_capacity) {
             new_capacity = min_capacity;
         }
+        if (hist->arena) {
+            hist->items = (WordFreq*)arena_grow(hist->arena, hist->items, (size_t)hist->capacity * sizeof(WordFreq),
+                                                (size_t)new_capacity * sizeof(WordFreq));
+            hist->capacity = new_capacity;
+            return;
+        }
         WordFreq* new_items = (WordFreq*)realloc(hist->items, new_capacity * sizeof(WordFreq));
         if (!new_items) {
             perror("Failed to reallocate histogram items");
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        mem_track_free(MEM_HISTOGRAM, (size_t)hist->capacity * sizeof(WordFreq));
+        mem_track_alloc(MEM_HISTOGRAM, (size_t)new_capacity * sizeof(WordFreq));
         hist->items = new_items;
         hist->capacity = new_capacity;
     }
 }
 
-void add_word_to_histogram(Histogram* hist, const char* word_str) {
+void histogram_drop_index(Histogram* hist) {
+    if (hist->slots && !hist->arena) {
+        mem_track_free(MEM_HISTOGRAM, (size_t)(hist->slot_mask + 1) * sizeof(int32_t));
+        free(hist->slots);
+    }
+    hist->slots = NULL;
+    hist->slot_mask = 0;
+    hist->indexed = 0;
+}
+
+// Slot di partenza: SipHash con la chiave della run alterata dal sale dell'indice e dal gruppo
+uint64_t histogram_slot_hash(const Histogram* hist, int group, const char* word) {
+    return wc_siphash13(word, strnlen(word, MAX_WORD_LEN), hash_key[0] ^ hist->salt, hash_key[1] + (uint64_t)group);
+}
+
+// Inserisce items[idx] nel primo slot libero; restituisce la lunghezza della sonda
+int histogram_index_insert(Histogram* hist, int idx) {
+    size_t mask = (size_t)hist->slot_mask;
+    size_t i = histogram_slot_hash(hist, hist->items[idx].group, hist->items[idx].word) & mask;
+    int probe = 0;
+    while (hist->slots[i] != -1) {
+        i = (i + 1) & mask;
+        probe++;
+    }
+    hist->slots[i] = idx;
+    return probe;
+}
+
+// Ricostruisce l'indice su tutte le voci con num_slots slot; restituisce la sonda più lunga
+int histogram_rebuild_index(Histogram* hist, int num_slots) {
+    histogram_drop_index(hist);
+    if (hist->arena) {
+        hist->slots = (int32_t*)arena_alloc(hist->arena, (size_t)num_slots * sizeof(int32_t));
+    } else {
+        hist->slots = (int32_t*)malloc((size_t)num_slots * sizeof(int32_t));
+        if (!hist->slots) {
+            perror("Failed to allocate histogram index");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_HISTOGRAM, (size_t)num_slots * sizeof(int32_t));
+    }
+    memset(hist->slots, 0xff, (size_t)num_slots * sizeof(int32_t));
+    hist->slot_mask = num_slots - 1;
+    int longest = 0;
     for (int i = 0; i < hist->count; ++i) {
-        if (strncmp(hist->items[i].word, word_str, MAX_WORD_LEN) == 0) {
-            hist->items[i].frequency++;
-            return;
+        int probe = histogram_index_insert(hist, i);
+        if (probe > longest) {
+            longest = probe;
+        }
+    }
+    hist->indexed = hist->count;
+    return longest;
+}
+
+/*
+ * Con una chiave segreta le sonde lunghe non dovrebbero capitare: se succede si cambia il sale e si
+ * ricostruisce l'indice; se anche la nuova chiave produce sonde lunghe si raddoppiano pure gli slot.
+ */
+void histogram_rekey(Histogram* hist, int probe) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    fprintf(stderr, "Rank %d: histogram probe of %d slots exceeds %d, rebuilding the index with a new key\n",
+            rank, probe, HIST_MAX_PROBE);
+    int num_slots = hist->slot_mask + 1;
+    do {
+        hist->salt = wc_mix64(hist->salt + hash_key[1] + 0x9e3779b97f4a7c15ULL);
+        probe = histogram_rebuild_index(hist, num_slots);
+        num_slots *= 2;
+    } while (probe > HIST_MAX_PROBE);
+}
+
+// Voce (gruppo, parola) dell'istogramma; se manca viene aggiunta con frequenza 0
+WordFreq* histogram_find_or_insert(Histogram* hist, int group, const char* word) {
+    // Fattore di carico al massimo 1/2; le voci accodate direttamente in items entrano qui nell'indice
+    if (!hist->slots || (size_t)(hist->count + 1) * 2 > (size_t)hist->slot_mask + 1) {
+        int num_slots = hist->slots ? hist->slot_mask + 1 : HIST_INDEX_MIN_SLOTS;
+        while ((size_t)(hist->count + 1) * 2 > (size_t)num_slots) {
+            num_slots *= 2;
+        }
+        histogram_rebuild_index(hist, num_slots);
+    }
+    while (hist->indexed < hist->count) {
+        histogram_index_insert(hist, hist->indexed++);
+    }
+
+    size_t mask = (size_t)hist->slot_mask;
+    size_t i = histogram_slot_hash(hist, group, word) & mask;
+    int probe = 0;
+    while (hist->slots[i] != -1) {
+        WordFreq* item = &hist->items[hist->slots[i]];
+        if (item->group == group && strncmp(item->word, word, MAX_WORD_LEN) == 0) {
+            return item;
         }
+        i = (i + 1) & mask;
+        probe++;
     }
     ensure_capacity(hist, hist->count + 1);
-    strncpy(hist->items[hist->count].word, word_str, MAX_WORD_LEN - 1);
-    hist->items[hist->count].word[MAX_WORD_LEN - 1] = '\0';
-    hist->items[hist->count].frequency = 1;
-    hist->count++;
+    WordFreq* item = &hist->items[hist->count];
+    strncpy(item->word, word, MAX_WORD_LEN - 1);
+    item->word[MAX_WORD_LEN - 1] = '\0';
+    item->frequency = 0;
+    item->group = group;
+    hist->slots[i] = hist->count++;
+    hist->indexed = hist->count;
+    if (probe > HIST_MAX_PROBE) {
+        histogram_rekey(hist, probe);
+    }
+    return item;
+}
+
+void add_word_to_histogram(Histogram* hist, int group, const char* word_str) {
+    histogram_find_or_insert(hist, group, word_str)->frequency++;
 }
 
 void merge_histograms(Histogram* dest_hist, const Histogram* source_hist) {
     for (int i = 0; i < source_hist->count; ++i) {
-        const char* word = source_hist->items[i].word;
-        int freq_to_add = source_hist->items[i].frequency;
-        
-        // Cerca se la parola esiste già nell'istogramma di destinazione
-        int found = 0;
-        for (int j = 0; j < dest_hist->count; ++j) {
-            if (strncmp(dest_hist->items[j].word, word, MAX_WORD_LEN) == 0) {
-                dest_hist->items[j].frequency += freq_to_add;  // Aggiungi direttamente la frequenza
-                found = 1;
-                break;
-            }
-        }
-        
-        // Se la parola non è stata trovata, aggiungila come nuova entry
-        if (!found) {
-            ensure_capacity(dest_hist, dest_hist->count + 1);
-            strncpy(dest_hist->items[dest_hist->count].word, word, MAX_WORD_LEN - 1);
-            dest_hist->items[dest_hist->count].word[MAX_WORD_LEN - 1] = '\0';
-            dest_hist->items[dest_hist->count].frequency = freq_to_add;
-            dest_hist->count++;
-        }
+        const WordFreq* src = &source_hist->items[i];
+        histogram_find_or_insert(dest_hist, src->group, src->word)->frequency += src->frequency;
     }
 }
 
 void free_histogram_content(Histogram* hist) {
     if (hist && hist->items) {
-        free(hist->items);
+        histogram_drop_index(hist);
+        if (!hist->arena) {
+            mem_track_free(MEM_HISTOGRAM, (size_t)hist->capacity * sizeof(WordFreq));
+            free(hist->items);
+        }
         hist->items = NULL;
         hist->count = 0;
         hist->capacity = 0;
@@ -117,17 +944,166 @@ void free_histogram_content(Histogram* hist) {
 int compare_wordfreq(const void* a, const void* b) {
     WordFreq* wfA = (WordFreq*)a;
     WordFreq* wfB = (WordFreq*)b;
+    if (wfA->group != wfB->group) {
+        return wfA->group < wfB->group ? -1 : 1;
+    }
     return strncmp(wfA->word, wfB->word, MAX_WORD_LEN);
 }
 
 void sort_histogram_by_word(Histogram* hist) {
     if (hist && hist->count > 0) {
+        histogram_drop_index(hist);
         qsort(hist->items, hist->count, sizeof(WordFreq), compare_wordfreq);
     }
 }
 
+int compare_wordfreq_by_frequency(const void* a, const void* b) {
+    const WordFreq* wfA = (const WordFreq*)a;
+    const WordFreq* wfB = (const WordFreq*)b;
+    if (wfA->frequency != wfB->frequency) {
+        return wfA->frequency > wfB->frequency ? -1 : 1;
+    }
+    return strncmp(wfA->word, wfB->word, MAX_WORD_LEN);
+}
+
+// Bucket 0 = overflow per le frequenze da FREQ_DIRECT_BUCKETS in su; poi frequenze decrescenti fino a 0
+int frequency_bucket(int frequency) {
+    if (frequency >= FREQ_DIRECT_BUCKETS) {
+        return 0;
+    }
+    return FREQ_DIRECT_BUCKETS - (frequency > 0 ? frequency : 0);
+}
+
+int histogram_is_sorted_by_word(const Histogram* hist) {
+    for (int i = 1; i < hist->count; ++i) {
+        if (compare_wordfreq(&hist->items[i - 1], &hist->items[i]) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Collettiva. Posizione finale di ogni voce della fetta locale in un counting sort stabile per frequenza
+ * dell'intero array: le fette sono consecutive in ordine di rank, quindi in ogni bucket precedono le voci
+ * dei rank più bassi (MPI_Exscan dei conteggi) e dentro la fetta l'ordine d'ingresso si conserva.
+ * bucket_totals riceve su ogni rank i conteggi globali dei FREQ_NUM_BUCKETS bucket.
+ */
+void frequency_sort_positions(const int* freqs, int n, int* positions, int* bucket_totals) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int* counts = (int*)calloc(FREQ_NUM_BUCKETS, sizeof(int));
+    int* next = (int*)calloc(FREQ_NUM_BUCKETS, sizeof(int));
+    if (!counts || !next) {
+        perror("Failed to allocate frequency buckets");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < n; ++i) {
+        counts[frequency_bucket(freqs[i])]++;
+    }
+    MPI_Allreduce(counts, bucket_totals, FREQ_NUM_BUCKETS, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Exscan(counts, next, FREQ_NUM_BUCKETS, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        memset(next, 0, FREQ_NUM_BUCKETS * sizeof(int));  // MPI_Exscan lascia indefinito il risultato del rank 0
+    }
+    int bucket_start = 0;
+    for (int b = 0; b < FREQ_NUM_BUCKETS; ++b) {
+        next[b] += bucket_start;
+        bucket_start += bucket_totals[b];
+    }
+    for (int i = 0; i < n; ++i) {
+        positions[i] = next[frequency_bucket(freqs[i])]++;
+    }
+    free(counts);
+    free(next);
+}
+
+/*
+ * Collettiva. Con le parole in ordine alfabetico un counting sort stabile per frequenza decrescente lascia
+ * già in ordine alfabetico le parole di pari frequenza, senza confronti. Il master divide soltanto le
+ * frequenze in fette uguali, ogni rank calcola dove finiscono le proprie voci e il master sposta i record
+ * nella posizione ricevuta: non resta nulla da fondere. Solo il bucket di overflow, con le poche parole
+ * da FREQ_DIRECT_BUCKETS occorrenze in su, si ordina per confronto.
+ */
+void sort_histogram_by_frequency(Histogram* hist, int rank, int size) {
+    int* counts = NULL;
+    int* displs = NULL;
+    int* freqs = NULL;
+    int* positions = NULL;
+    int total = 0;
+    if (rank == 0) {
+        // Le fusioni ordinate producono già l'ordine alfabetico; l'istogramma del conteggio va ordinato qui
+        if (!histogram_is_sorted_by_word(hist)) {
+            sort_histogram_by_word(hist);
+        }
+        histogram_drop_index(hist);
+        total = hist->count;
+        counts = (int*)malloc(size * sizeof(int));
+        displs = (int*)malloc(size * sizeof(int));
+        freqs = (int*)malloc((total > 0 ? total : 1) * sizeof(int));
+        positions = (int*)malloc((total > 0 ? total : 1) * sizeof(int));
+        if (!counts || !displs || !freqs || !positions) {
+            perror("Failed to allocate sort partition");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_MPI_BUFFER, 2 * (size_t)(total > 0 ? total : 1) * sizeof(int));
+        for (int i = 0; i < total; ++i) {
+            freqs[i] = hist->items[i].frequency;
+        }
+        int offset = 0;
+        for (int r = 0; r < size; ++r) {
+            counts[r] = total / size + (r < total % size ? 1 : 0);
+            displs[r] = offset;
+            offset += counts[r];
+        }
+    }
+
+    int slice_count;
+    MPI_Scatter(counts, 1, MPI_INT, &slice_count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    size_t slice_bytes = (size_t)(slice_count > 0 ? slice_count : 1) * sizeof(int);
+    int* slice_freqs = (int*)malloc(slice_bytes);
+    int* slice_positions = (int*)malloc(slice_bytes);
+    int* bucket_totals = (int*)malloc(FREQ_NUM_BUCKETS * sizeof(int));
+    if (!slice_freqs || !slice_positions || !bucket_totals) {
+        perror("Failed to allocate sort slice");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_MPI_BUFFER, 2 * slice_bytes);
+    MPI_Scatterv(freqs, counts, displs, MPI_INT, slice_freqs, slice_count, MPI_INT, 0, MPI_COMM_WORLD);
+    frequency_sort_positions(slice_freqs, slice_count, slice_positions, bucket_totals);
+    MPI_Gatherv(slice_positions, slice_count, MPI_INT, positions, counts, displs, MPI_INT, 0, MPI_COMM_WORLD);
+    mem_track_free(MEM_MPI_BUFFER, 2 * slice_bytes);
+    free(slice_freqs);
+    free(slice_positions);
+
+    if (rank == 0) {
+        WordFreq* sorted = (WordFreq*)malloc((total > 0 ? total : 1) * sizeof(WordFreq));
+        if (!sorted) {
+            perror("Failed to allocate sorted histogram");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_HISTOGRAM, (size_t)(total > 0 ? total : 1) * sizeof(WordFreq));
+        for (int i = 0; i < total; ++i) {
+            sorted[positions[i]] = hist->items[i];
+        }
+        if (bucket_totals[0] > 1) {
+            qsort(sorted, bucket_totals[0], sizeof(WordFreq), compare_wordfreq_by_frequency);
+        }
+        mem_track_free(MEM_HISTOGRAM, (size_t)hist->capacity * sizeof(WordFreq));
+        free(hist->items);
+        hist->items = sorted;
+        hist->capacity = total > 0 ? total : 1;
+        mem_track_free(MEM_MPI_BUFFER, 2 * (size_t)(total > 0 ? total : 1) * sizeof(int));
+        free(counts);
+        free(displs);
+        free(freqs);
+        free(positions);
+    }
+    free(bucket_totals);
+}
+
 void write_histogram_to_csv(const Histogram* hist, const char* csv_filename) {
-    FILE* fp = fopen(csv_filename, "w");
+    FILE* fp = fopen(output_path(csv_filename), "w");
     if (!fp) {
         perror("Errore nell'apertura del file CSV per la scrittura");
         return;
@@ -139,153 +1115,4390 @@ void write_histogram_to_csv(const Histogram* hist, const char* csv_filename) {
     fclose(fp);
 }
 
-Histogram* count_words_in_file(const char* filename) {
-    FILE* fp = fopen(filename, "r");
-    if (!fp) {
-        return NULL;
+// Buffer di almeno len byte: il più piccolo fra quelli liberi che basta, altrimenti uno nuovo
+char* comm_buffer_acquire(size_t len) {
+    int best = -1;
+    for (int i = 0; i < comm_pool.num_free; ++i) {
+        if (comm_pool.capacities[i] >= len && (best < 0 || comm_pool.capacities[i] < comm_pool.capacities[best])) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        char* base = comm_pool.buffers[best];
+        comm_pool.cached_bytes -= comm_pool.capacities[best];
+        comm_pool.num_free--;
+        comm_pool.buffers[best] = comm_pool.buffers[comm_pool.num_free];
+        comm_pool.capacities[best] = comm_pool.capacities[comm_pool.num_free];
+        return base + COMM_BUFFER_HEADER;
     }
 
-    Histogram* hist = (Histogram*)malloc(sizeof(Histogram));
-    if (!hist) {
-        perror("Failed to allocate histogram for file");
-        fclose(fp);
+    // Capacità arrotondate a potenze di due, così un buffer serve anche a messaggi di poco più grandi
+    size_t capacity = len;
+    if (len <= COMM_POOL_MAX_CACHED) {
+        capacity = COMM_POOL_MIN_BUFFER;
+        while (capacity < len) {
+            capacity *= 2;
+        }
+    }
+    char* base;
+    if (MPI_Alloc_mem((MPI_Aint)(capacity + COMM_BUFFER_HEADER), MPI_INFO_NULL, &base) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to allocate communication buffer\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    init_histogram(hist);
-
-    char current_word[MAX_WORD_LEN];
-    int char_idx = 0;
-    int c;
+    memcpy(base, &capacity, sizeof(size_t));
+    mem_track_alloc(MEM_MPI_BUFFER, capacity);
+    return base + COMM_BUFFER_HEADER;
+}
 
-    while ((c = fgetc(fp)) != EOF) {
-        if (isalnum(c)) { 
-            if (char_idx < MAX_WORD_LEN - 1) {
-                current_word[char_idx++] = tolower(c); 
-            }
-        } else { 
-            if (char_idx > 0) { 
-                current_word[char_idx] = '\0';
-                add_word_to_histogram(hist, current_word);
-                char_idx = 0;
-            }
-        }
+void comm_buffer_release(char* buf) {
+    if (!buf) {
+        return;
     }
-    if (char_idx > 0) {
-        current_word[char_idx] = '\0';
-        add_word_to_histogram(hist, current_word);
+    char* base = buf - COMM_BUFFER_HEADER;
+    size_t capacity;
+    memcpy(&capacity, base, sizeof(size_t));
+    if (comm_pool.num_free < COMM_POOL_SLOTS && comm_pool.cached_bytes + capacity <= COMM_POOL_MAX_CACHED) {
+        comm_pool.buffers[comm_pool.num_free] = base;
+        comm_pool.capacities[comm_pool.num_free] = capacity;
+        comm_pool.num_free++;
+        comm_pool.cached_bytes += capacity;
+        return;
     }
-    fclose(fp);
-    return hist;
+    mem_track_free(MEM_MPI_BUFFER, capacity);
+    MPI_Free_mem(base);
 }
 
-int main(int argc, char *argv[]) {
-    MPI_Init(&argc, &argv);
+// Da chiamare prima di MPI_Finalize
+void comm_pool_drain(void) {
+    for (int i = 0; i < comm_pool.num_free; ++i) {
+        mem_track_free(MEM_MPI_BUFFER, comm_pool.capacities[i]);
+        MPI_Free_mem(comm_pool.buffers[i]);
+    }
+    comm_pool.num_free = 0;
+    comm_pool.cached_bytes = 0;
+}
 
-    int rank, size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
+/*
+ * Formato serializzato di wordcount.h (wc_serial_*), lo stesso che legge e scrive la libreria.
+ * Il buffer restituito viene dal pool di comunicazione: va reso con comm_buffer_release.
+ */
+char* serialize_histogram(const Histogram* hist, size_t* out_len) {
+    int32_t has_groups = 0;
+    for (int i = 0; i < hist->count && !has_groups; ++i) {
+        has_groups = hist->items[i].group != 0;
+    }
+    size_t len = WC_SERIAL_HEADER_LEN;
+    for (int i = 0; i < hist->count; ++i) {
+        len += wc_serial_record_len(strlen(hist->items[i].word), has_groups);
+    }
 
+    char* buf = comm_buffer_acquire(len);
+    char* p = wc_serial_put_header(buf, hist->count, has_groups);
+    for (int i = 0; i < hist->count; ++i) {
+        const WordFreq* item = &hist->items[i];
+        p = wc_serial_put_record(p, has_groups, item->frequency, item->group, item->word, strlen(item->word));
+    }
+    *out_len = len;
+    return buf;
+}
 
-    double start_time, end_time, total_time;
-    start_time = MPI_Wtime();
+void deserialize_histogram(const char* buf, size_t len, Histogram* hist) {
+    const char* end = buf + len;
+    int32_t count, has_groups;
 
-    if (rank == 0) {
-        printf("MPI Word Count Scalability Test\n");
-        printf("Number of processes: %d\n", size);
-        char file_list[MAX_FILES][MAX_FILENAME_LEN];
-        int total_files = 0;
+    init_histogram(hist);
+    if (wc_serial_get_header(buf, len, &count, &has_groups) != WC_OK) {
+        fprintf(stderr, "Invalid serialized histogram\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    ensure_capacity(hist, count);
 
-        FILE* fileListFile = fopen("filelist.txt", "r");
-        if (fileListFile == NULL) {
-            printf("Errore nell'apertura di filelist.txt\n");
+    // Le voci di un istogramma serializzato sono già uniche: si accodano senza ricerca
+    const char* p = buf + WC_SERIAL_HEADER_LEN;
+    for (int i = 0; i < count; ++i) {
+        int32_t freq, group;
+        const char* word;
+        size_t word_len;
+        p = wc_serial_get_record(p, end, has_groups, &freq, &group, &word, &word_len);
+        if (!p) {
+            fprintf(stderr, "Truncated serialized histogram\n");
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        while (fgets(file_list[total_files], MAX_FILENAME_LEN, fileListFile) && total_files < MAX_FILES) {
-            file_list[total_files][strcspn(file_list[total_files], "\n")] = '\0';
-            file_list[total_files][strcspn(file_list[total_files], "\r")] = '\0';
-            if (strlen(file_list[total_files]) > 0) {
-                total_files++;
-            }
-        }
-        fclose(fileListFile);
-
+        WordFreq* item = &hist->items[hist->count++];
+        memcpy(item->word, word, word_len + 1);
+        item->frequency = freq;
+        item->group = group;
+    }
+}
+
+void start_large_send(const char* buf, size_t len, int dest, int tag, MPI_Comm comm, LargeTransfer* xfer) {
+#if MPI_VERSION >= 4
+    // MPI-4: un solo messaggio con conteggio a 64 bit
+    xfer->num_requests = 1;
+    xfer->requests = (MPI_Request*)malloc(sizeof(MPI_Request));
+    if (!xfer->requests) {
+        perror("Failed to allocate MPI requests");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Isend_c(buf, (MPI_Count)len, MPI_BYTE, dest, tag, comm, &xfer->requests[0]);
+#else
+    // Segmenti non bloccanti inviati tutti insieme, così la rete li trasferisce in pipeline
+    xfer->num_requests = (int)((len + LARGE_MESSAGE_CHUNK - 1) / LARGE_MESSAGE_CHUNK);
+    xfer->requests = (MPI_Request*)malloc((xfer->num_requests > 0 ? xfer->num_requests : 1) * sizeof(MPI_Request));
+    if (!xfer->requests) {
+        perror("Failed to allocate MPI requests");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < xfer->num_requests; ++i) {
+        size_t offset = (size_t)i * LARGE_MESSAGE_CHUNK;
+        size_t chunk = len - offset < LARGE_MESSAGE_CHUNK ? len - offset : LARGE_MESSAGE_CHUNK;
+        MPI_Isend(buf + offset, (int)chunk, MPI_BYTE, dest, tag, comm, &xfer->requests[i]);
+    }
+#endif
+}
+
+void start_large_recv(char* buf, size_t len, int source, int tag, MPI_Comm comm, LargeTransfer* xfer) {
+#if MPI_VERSION >= 4
+    xfer->num_requests = 1;
+    xfer->requests = (MPI_Request*)malloc(sizeof(MPI_Request));
+    if (!xfer->requests) {
+        perror("Failed to allocate MPI requests");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Irecv_c(buf, (MPI_Count)len, MPI_BYTE, source, tag, comm, &xfer->requests[0]);
+#else
+    // I segmenti dallo stesso mittente e con lo stesso tag arrivano in ordine
+    xfer->num_requests = (int)((len + LARGE_MESSAGE_CHUNK - 1) / LARGE_MESSAGE_CHUNK);
+    xfer->requests = (MPI_Request*)malloc((xfer->num_requests > 0 ? xfer->num_requests : 1) * sizeof(MPI_Request));
+    if (!xfer->requests) {
+        perror("Failed to allocate MPI requests");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < xfer->num_requests; ++i) {
+        size_t offset = (size_t)i * LARGE_MESSAGE_CHUNK;
+        size_t chunk = len - offset < LARGE_MESSAGE_CHUNK ? len - offset : LARGE_MESSAGE_CHUNK;
+        MPI_Irecv(buf + offset, (int)chunk, MPI_BYTE, source, tag, comm, &xfer->requests[i]);
+    }
+#endif
+}
+
+void wait_large_transfer(LargeTransfer* xfer) {
+    if (xfer->num_requests > 0) {
+        MPI_Waitall(xfer->num_requests, xfer->requests, MPI_STATUSES_IGNORE);
+    }
+    free(xfer->requests);
+    xfer->requests = NULL;
+    xfer->num_requests = 0;
+}
+
+// La dimensione viaggia con size_tag, il contenuto sempre con TAG_HISTOGRAM_DATA
+void start_histogram_send(const Histogram* hist, int dest, int size_tag, MPI_Comm comm, PendingHistogramSend* pending) {
+    pending->buf = serialize_histogram(hist, &pending->len);
+    uint64_t len64 = pending->len;
+    MPI_Send(&len64, 1, MPI_UINT64_T, dest, size_tag, comm);
+    start_large_send(pending->buf, pending->len, dest, TAG_HISTOGRAM_DATA, comm, &pending->xfer);
+}
+
+void finish_histogram_send(PendingHistogramSend* pending) {
+    if (!pending->buf) {
+        return;
+    }
+    wait_large_transfer(&pending->xfer);
+    comm_buffer_release(pending->buf);
+    pending->buf = NULL;
+    pending->len = 0;
+}
+
+void send_histogram(const Histogram* hist, int dest, MPI_Comm comm) {
+    PendingHistogramSend pending;
+    start_histogram_send(hist, dest, TAG_HISTOGRAM_DATA_SIZE, comm, &pending);
+    finish_histogram_send(&pending);
+}
+
+void recv_histogram(Histogram* hist, int source, int size_tag, MPI_Comm comm) {
+    uint64_t len64;
+    MPI_Recv(&len64, 1, MPI_UINT64_T, source, size_tag, comm, MPI_STATUS_IGNORE);
+    size_t len = (size_t)len64;
+
+    char* buf = comm_buffer_acquire(len);
+    LargeTransfer xfer;
+    start_large_recv(buf, len, source, TAG_HISTOGRAM_DATA, comm, &xfer);
+    wait_large_transfer(&xfer);
+    deserialize_histogram(buf, len, hist);
+    comm_buffer_release(buf);
+}
+
+int scan_file(const char* filename, ReadMode read_mode, BlockHandler handler, void* ctx) {
+    int open_flags = O_RDONLY;
+    if (read_mode == READ_MODE_DIRECT) {
+        open_flags |= O_DIRECT;
+    }
+    int fd = open(filename, open_flags);
+    if (fd < 0 && read_mode == READ_MODE_DIRECT && errno == EINVAL) {
+        // Il filesystem non supporta O_DIRECT (es. tmpfs): si ripiega su fadvise
+        read_mode = READ_MODE_NOCACHE;
+        fd = open(filename, O_RDONLY);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (read_mode == READ_MODE_NOCACHE) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // O_DIRECT richiede indirizzo, dimensione e offset allineati al blocco del device
+    char* buffer = NULL;
+    if (posix_memalign((void**)&buffer, DIRECT_IO_ALIGNMENT, READ_BLOCK_SIZE) != 0) {
+        perror("Failed to allocate read buffer");
+        close(fd);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_IO_BUFFER, READ_BLOCK_SIZE);
+
+    // Un errore di lettura a metà file restituisce -1 come un'apertura fallita: i conteggi parziali vanno scartati
+    int result = 0;
+    off_t offset = 0;
+    while (1) {
+        ssize_t n = read(fd, buffer, READ_BLOCK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (read_mode == READ_MODE_DIRECT && errno == EINVAL) {
+                // Dopo una lettura corta l'offset non è più allineato: si prosegue senza O_DIRECT
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                read_mode = READ_MODE_NOCACHE;
+                continue;
+            }
+            perror("Errore nella lettura del file");
+            result = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        handler(ctx, buffer, (size_t)n);
+        if (read_mode == READ_MODE_NOCACHE) {
+            posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+        }
+        offset += n;
+    }
+
+    mem_track_free(MEM_IO_BUFFER, READ_BLOCK_SIZE);
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+void tokenizer_init(Tokenizer* tok, WordHandler on_word, void* word_ctx) {
+    tok->on_word = on_word;
+    tok->word_ctx = word_ctx;
+    wc_tokenizer_init(&tok->base);
+    tok->stats = NULL;
+    tok->token_lengths = NULL;
+}
+
+void tokenizer_collect_stats(Tokenizer* tok, FileStats* stats, uint64_t* token_lengths) {
+    tok->stats = stats;
+    tok->token_lengths = token_lengths;
+}
+
+// Conta i '\n' di un blocco: 16 byte per confronto con SSE2, altrimenti 8 byte alla volta (SWAR)
+uint64_t count_newlines(const char* block, size_t len) {
+    uint64_t lines = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(block + i));
+        lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+#else
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, block + i, sizeof(w));
+        w ^= 0x0a0a0a0a0a0a0a0aULL;
+        // Il bit alto di ogni byte resta a zero solo dove il byte era '\n'
+        uint64_t nonzero = ((w & low7) + low7) | w;
+        lines += __builtin_popcountll(~nonzero & ~low7);
+    }
+#endif
+    for (; i < len; ++i) {
+        lines += (block[i] == '\n');
+    }
+    return lines;
+}
+
+void tokenizer_emit(void* ctx, const char* word, size_t len) {
+    Tokenizer* tok = (Tokenizer*)ctx;
+    if (tok->stats) {
+        tok->stats->words++;
+        tok->token_lengths[len]++;
+    }
+    tok->on_word(tok->word_ctx, word);
+}
+
+void tokenize_block(void* ctx, const char* block, size_t len) {
+    Tokenizer* tok = (Tokenizer*)ctx;
+    if (tok->stats) {
+        tok->stats->bytes += len;
+        tok->stats->lines += count_newlines(block, len);
+    }
+    wc_tokenizer_feed(&tok->base, block, len, tokenizer_emit, tok);
+}
+
+// La parola finale non è seguita da un separatore
+void tokenizer_finish(Tokenizer* tok) {
+    wc_tokenizer_finish(&tok->base, tokenizer_emit, tok);
+}
+
+void histogram_word_handler(void* ctx, const char* word) {
+    HistogramSink* sink = (HistogramSink*)ctx;
+    add_word_to_histogram(sink->hist, sink->group, word);
+}
+
+void filtered_histogram_word_handler(void* ctx, const char* word) {
+    HistogramSink* sink = (HistogramSink*)ctx;
+    if (bloom_estimate(sink->filter, word) >= sink->min_count) {
+        add_word_to_histogram(sink->hist, sink->group, word);
+    }
+}
+
+/*
+ * Le statistiche del file finiscono in file_stats (se non NULL); le lunghezze dei token si accumulano in token_lengths.
+ * Con scratch l'istogramma sta tutto nell'arena e il chiamante lo rilascia con arena_reset invece di liberarlo.
+ * Se il file non si legge per intero restituisce NULL, con file_stats azzerato e token_lengths invariato.
+ */
+Histogram* count_words_in_file(const char* filename, int group, const Options* opts, const CountingBloom* filter,
+                               FileStats* file_stats, uint64_t* token_lengths, Arena* scratch) {
+    Histogram* hist;
+    if (scratch) {
+        hist = (Histogram*)arena_alloc(scratch, sizeof(Histogram));
+    } else {
+        hist = (Histogram*)malloc(sizeof(Histogram));
+        if (!hist) {
+            perror("Failed to allocate histogram for file");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    init_histogram_in_arena(hist, scratch);
+
+    Tokenizer tok;
+    // I contatori saturano a BLOOM_COUNTER_MAX: sopra quella soglia decide il drop_rare_words esatto finale
+    int filter_min = opts->min_count < BLOOM_COUNTER_MAX ? opts->min_count : BLOOM_COUNTER_MAX;
+    HistogramSink sink = { hist, group, filter, filter_min };
+    if (filter) {
+        tokenizer_init(&tok, filtered_histogram_word_handler, &sink);
+    } else {
+        tokenizer_init(&tok, histogram_word_handler, &sink);
+    }
+    uint64_t file_token_lengths[MAX_WORD_LEN] = { 0 };
+    if (file_stats) {
+        memset(file_stats, 0, sizeof(FileStats));
+        tokenizer_collect_stats(&tok, file_stats, file_token_lengths);
+    }
+
+    if (scan_file(filename, opts->read_mode, tokenize_block, &tok) != 0) {
+        if (file_stats) {
+            memset(file_stats, 0, sizeof(FileStats));
+        }
+        free_histogram_content(hist);
+        if (!scratch) {
+            free(hist);
+        }
+        return NULL;
+    }
+    tokenizer_finish(&tok);
+    if (file_stats) {
+        for (int i = 0; i < MAX_WORD_LEN; ++i) {
+            token_lengths[i] += file_token_lengths[i];
+        }
+    }
+    return hist;
+}
+
+void init_hash_key(uint64_t seed) {
+    hash_seed = seed;
+    wc_derive_key(seed, hash_key);
+}
+
+uint64_t hash_word_keyed(const char* word, const uint64_t key[2]) {
+    return wc_siphash13(word, strlen(word), key[0], key[1]);
+}
+
+// Hash della parola con la chiave della run: usato per Bloom filter, partizioni tra rank e indice MPHF
+uint64_t hash_word(const char* word) {
+    return hash_word_keyed(word, hash_key);
+}
+
+// Hash di una coppia di ID del vocabolario, anch'esso legato alla chiave della run
+uint64_t hash_pair(uint64_t key) {
+    return wc_mix64(key ^ hash_key[0]);
+}
+
+void init_bloom(CountingBloom* bloom, size_t num_counters) {
+    bloom->counters = (uint8_t*)calloc(num_counters, sizeof(uint8_t));
+    if (!bloom->counters) {
+        perror("Failed to allocate Bloom filter");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_HISTOGRAM, num_counters);
+    bloom->num_counters = num_counters;
+}
+
+void free_bloom(CountingBloom* bloom) {
+    if (bloom->counters) {
+        mem_track_free(MEM_HISTOGRAM, bloom->num_counters);
+        free(bloom->counters);
+        bloom->counters = NULL;
+        bloom->num_counters = 0;
+    }
+}
+
+// Double hashing: le BLOOM_NUM_HASHES posizioni derivano dalle due metà di un solo hash
+void bloom_add_word(void* ctx, const char* word) {
+    CountingBloom* bloom = (CountingBloom*)ctx;
+    uint64_t h = hash_word(word);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    for (int i = 0; i < BLOOM_NUM_HASHES; ++i) {
+        uint8_t* counter = &bloom->counters[(h1 + (uint64_t)i * h2) % bloom->num_counters];
+        if (*counter < BLOOM_COUNTER_MAX) {
+            (*counter)++;
+        }
+    }
+}
+
+int bloom_estimate(const CountingBloom* bloom, const char* word) {
+    uint64_t h = hash_word(word);
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    int estimate = BLOOM_COUNTER_MAX;
+    for (int i = 0; i < BLOOM_NUM_HASHES; ++i) {
+        int value = bloom->counters[(h1 + (uint64_t)i * h2) % bloom->num_counters];
+        if (value < estimate) {
+            estimate = value;
+        }
+    }
+    return estimate;
+}
+
+// Operazione di riduzione MPI: somma di contatori uint8 che satura invece di traboccare
+void bloom_saturating_sum(void* in, void* inout, int* len, MPI_Datatype* datatype) {
+    (void)datatype;
+    const uint8_t* a = (const uint8_t*)in;
+    uint8_t* b = (uint8_t*)inout;
+    for (int i = 0; i < *len; ++i) {
+        int sum = a[i] + b[i];
+        b[i] = (uint8_t)(sum > BLOOM_COUNTER_MAX ? BLOOM_COUNTER_MAX : sum);
+    }
+}
+
+void bloom_count_file(const char* filename, void* ctx) {
+    BloomPass* pass = (BloomPass*)ctx;
+    Tokenizer tok;
+    tokenizer_init(&tok, bloom_add_word, pass->bloom);
+    if (scan_file(filename, pass->opts->read_mode, tokenize_block, &tok) == 0) {
+        tokenizer_finish(&tok);
+    }
+}
+
+/*
+ * Primo passo della modalità min-count: ogni rank conta nel proprio filtro le parole dei file
+ * assegnati, poi i filtri vengono sommati su tutti i rank così che ognuno abbia la stima globale.
+ */
+void build_min_count_filter(CountingBloom* bloom, char file_list[][MAX_FILENAME_LEN], int total_files,
+                            const Options* opts, int rank, int size) {
+    init_bloom(bloom, (size_t)opts->bloom_counters);
+    BloomPass pass = { bloom, opts };
+    run_file_tasks(file_list, total_files, rank, size, bloom_count_file, &pass);
+
+    MPI_Op saturating_sum;
+    MPI_Op_create(bloom_saturating_sum, 1, &saturating_sum);
+    MPI_Allreduce(MPI_IN_PLACE, bloom->counters, opts->bloom_counters, MPI_UINT8_T, saturating_sum, MPI_COMM_WORLD);
+    MPI_Op_free(&saturating_sum);
+}
+
+// Il filtro sovrastima: le parole che lo superano hanno però conteggi esatti e si scartano qui
+void drop_rare_words(Histogram* hist, int min_count) {
+    histogram_drop_index(hist);
+    int kept = 0;
+    for (int i = 0; i < hist->count; ++i) {
+        if (hist->items[i].frequency >= min_count) {
+            if (kept != i) {
+                hist->items[kept] = hist->items[i];
+            }
+            kept++;
+        }
+    }
+    hist->count = kept;
+}
+
+int find_or_add_group(CorpusGroups* groups, const char* name) {
+    for (int g = 0; g < groups->count; ++g) {
+        if (strcmp(groups->names[g], name) == 0) {
+            return g;
+        }
+    }
+    strcpy(groups->names[groups->count], name);
+    return groups->count++;
+}
+
+/*
+ * Ogni riga è un percorso, eventualmente preceduto da un'etichetta di gruppo e da un TAB
+ * ("etichetta<TAB>percorso"). Se nessuna riga ha un'etichetta, groups->count resta 0.
+ */
+int read_file_list(const char* path, char file_list[][MAX_FILENAME_LEN], CorpusGroups* groups) {
+    FILE* fileListFile = fopen(path, "r");
+    if (fileListFile == NULL) {
+        printf("Errore nell'apertura di %s\n", path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    groups->count = 0;
+    int labeled = 0;
+    int total_files = 0;
+    char line[MAX_GROUP_NAME_LEN + MAX_FILENAME_LEN];
+    while (total_files < MAX_FILES && fgets(line, sizeof(line), fileListFile)) {
+        line[strcspn(line, "\n")] = '\0';
+        line[strcspn(line, "\r")] = '\0';
+        const char* file_path = line;
+        const char* label = "unlabeled";
+        char* tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            label = line;
+            file_path = tab + 1;
+            labeled = 1;
+            // L'etichetta finisce nel nome del file di output
+            if (strlen(label) == 0 || strlen(label) >= MAX_GROUP_NAME_LEN || strspn(label,
+                "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-") != strlen(label)) {
+                fprintf(stderr, "Invalid group label '%s' in %s (use letters, digits, '.', '_' or '-')\n", label, path);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        if (strlen(file_path) == 0) {
+            continue;
+        }
+        if (strlen(file_path) >= MAX_FILENAME_LEN) {
+            fprintf(stderr, "File path too long in %s: %s\n", path, file_path);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        strcpy(file_list[total_files], file_path);
+        groups->file_group[total_files] = find_or_add_group(groups, label);
+        total_files++;
+    }
+    fclose(fileListFile);
+    if (!labeled) {
+        groups->count = 0;
+    }
+    return total_files;
+}
+
+// Divide un istogramma con chiave (gruppo, parola) in un istogramma per gruppo; hist viene svuotato
+Histogram* split_histogram_by_group(Histogram* hist, int num_groups) {
+    Histogram* per_group = (Histogram*)malloc(num_groups * sizeof(Histogram));
+    int* group_counts = (int*)calloc(num_groups, sizeof(int));
+    if (!per_group || !group_counts) {
+        perror("Failed to allocate group histograms");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < hist->count; ++i) {
+        group_counts[hist->items[i].group]++;
+    }
+    for (int g = 0; g < num_groups; ++g) {
+        init_histogram(&per_group[g]);
+        ensure_capacity(&per_group[g], group_counts[g]);
+    }
+    for (int i = 0; i < hist->count; ++i) {
+        Histogram* dest = &per_group[hist->items[i].group];
+        dest->items[dest->count++] = hist->items[i];
+    }
+    free(group_counts);
+    free_histogram_content(hist);
+    return per_group;
+}
+
+/*
+ * Scheduler generico per i passi ausiliari: il master distribuisce i file ai worker su richiesta,
+ * i worker eseguono task su ciascuno. Con un solo processo il master esegue tutto da sé.
+ * Il risultato resta nel ctx di ogni rank; la riduzione spetta al chiamante.
+ */
+void run_file_tasks(char file_list[][MAX_FILENAME_LEN], int total_files, int rank, int size, FileTask task, void* ctx) {
+    MPI_Status status;
+
+    if (rank == 0) {
+        if (size == 1) {
+            for (int i = 0; i < total_files; ++i) {
+                task(file_list[i], ctx);
+            }
+            return;
+        }
+        int next_file_idx = 0;
+        int active_workers = 0;
+        for (int worker_rank = 1; worker_rank < size; ++worker_rank) {
+            if (next_file_idx < total_files) {
+                MPI_Send(file_list[next_file_idx], MAX_FILENAME_LEN, MPI_CHAR, worker_rank, TAG_PASS_TASK, MPI_COMM_WORLD);
+                next_file_idx++;
+                active_workers++;
+            } else {
+                MPI_Send("", 1, MPI_CHAR, worker_rank, TAG_PASS_DONE, MPI_COMM_WORLD);
+            }
+        }
+        while (active_workers > 0) {
+            int dummy_ack;
+            MPI_Recv(&dummy_ack, 1, MPI_INT, MPI_ANY_SOURCE, TAG_PASS_ACK, MPI_COMM_WORLD, &status);
+            if (next_file_idx < total_files) {
+                MPI_Send(file_list[next_file_idx], MAX_FILENAME_LEN, MPI_CHAR, status.MPI_SOURCE, TAG_PASS_TASK, MPI_COMM_WORLD);
+                next_file_idx++;
+            } else {
+                MPI_Send("", 1, MPI_CHAR, status.MPI_SOURCE, TAG_PASS_DONE, MPI_COMM_WORLD);
+                active_workers--;
+            }
+        }
+    } else {
+        while (1) {
+            char task_filename[MAX_FILENAME_LEN];
+            MPI_Recv(task_filename, MAX_FILENAME_LEN, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            if (status.MPI_TAG == TAG_PASS_DONE) {
+                break;
+            }
+            task(task_filename, ctx);
+            int dummy_ack = rank;
+            MPI_Send(&dummy_ack, 1, MPI_INT, 0, TAG_PASS_ACK, MPI_COMM_WORLD);
+        }
+    }
+}
+
+static uint8_t ac_symbol_of[256];
+
+void init_ac_symbols(void) {
+    for (int c = 0; c < 256; ++c) {
+        ac_symbol_of[c] = AC_SEPARATOR;
+        if (wc_is_word_char((unsigned char)c)) {
+            int lower = wc_fold((unsigned char)c);
+            if (lower >= 'a' && lower <= 'z') {
+                ac_symbol_of[c] = (uint8_t)(1 + lower - 'a');
+            } else if (lower >= '0' && lower <= '9') {
+                ac_symbol_of[c] = (uint8_t)(27 + lower - '0');
+            }
+        }
+    }
+}
+
+/*
+ * Riduce una riga della lista alla forma usata dallo scanner: parole minuscole separate da un solo spazio.
+ * In symbols scrive la sequenza da inserire nell'automa, separatori iniziale e finale compresi.
+ * Restituisce il numero di simboli, 0 se la riga non contiene parole.
+ */
+int normalize_term(const char* line, char* term, uint8_t* symbols, int max_symbols) {
+    int n = 0;
+    int term_len = 0;
+    symbols[n++] = AC_SEPARATOR;
+    for (const unsigned char* p = (const unsigned char*)line; *p && n < max_symbols - 1; ++p) {
+        int symbol = ac_symbol_of[*p];
+        if (symbol == AC_SEPARATOR) {
+            if (symbols[n - 1] != AC_SEPARATOR) {
+                symbols[n++] = AC_SEPARATOR;
+                term[term_len++] = ' ';
+            }
+        } else {
+            symbols[n++] = (uint8_t)symbol;
+            term[term_len++] = wc_fold(*p);
+        }
+    }
+    if (symbols[n - 1] != AC_SEPARATOR) {
+        symbols[n++] = AC_SEPARATOR;
+    } else if (term_len > 0) {
+        term_len--;  // spazio finale
+    }
+    term[term_len] = '\0';
+    return term_len > 0 ? n : 0;
+}
+
+int ac_add_state(AhoCorasick* ac, int* capacity) {
+    if (ac->num_states == *capacity) {
+        int new_capacity = *capacity * 2;
+        int32_t* new_delta = (int32_t*)realloc(ac->delta, (size_t)new_capacity * AC_ALPHABET * sizeof(int32_t));
+        int32_t* new_output = (int32_t*)realloc(ac->output, (size_t)new_capacity * sizeof(int32_t));
+        if (!new_delta || !new_output) {
+            perror("Failed to grow Aho-Corasick automaton");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        ac->delta = new_delta;
+        ac->output = new_output;
+        *capacity = new_capacity;
+    }
+    int state = ac->num_states++;
+    for (int c = 0; c < AC_ALPHABET; ++c) {
+        ac->delta[(size_t)state * AC_ALPHABET + c] = -1;
+    }
+    ac->output[state] = -1;
+    return state;
+}
+
+// Solo sul master: legge la lista, costruisce il trie e lo completa in un DFA con una visita in ampiezza
+int build_aho_corasick(AhoCorasick* ac, const char* dictionary_path, char*** terms_out) {
+    FILE* fp = fopen(dictionary_path, "r");
+    if (!fp) {
+        printf("Errore nell'apertura di %s\n", dictionary_path);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int capacity = 1024;
+    ac->delta = (int32_t*)malloc((size_t)capacity * AC_ALPHABET * sizeof(int32_t));
+    ac->output = (int32_t*)malloc((size_t)capacity * sizeof(int32_t));
+    if (!ac->delta || !ac->output) {
+        perror("Failed to allocate Aho-Corasick automaton");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    ac->num_states = 0;
+    ac->num_terms = 0;
+    ac_add_state(ac, &capacity);
+
+    int terms_capacity = 1024;
+    char** terms = (char**)malloc(terms_capacity * sizeof(char*));
+    if (!terms) {
+        perror("Failed to allocate term list");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int duplicates = 0;
+    char line[MAX_TERM_LEN];
+    char term[MAX_TERM_LEN];
+    uint8_t symbols[MAX_TERM_LEN + 2];
+
+    while (fgets(line, sizeof(line), fp)) {
+        int num_symbols = normalize_term(line, term, symbols, (int)sizeof(symbols));
+        if (num_symbols == 0) {
+            continue;
+        }
+        int state = 0;
+        for (int i = 0; i < num_symbols; ++i) {
+            size_t edge = (size_t)state * AC_ALPHABET + symbols[i];
+            if (ac->delta[edge] < 0) {
+                int next = ac_add_state(ac, &capacity);
+                ac->delta[edge] = next;  // ac_add_state può aver riallocato delta
+            }
+            state = ac->delta[(size_t)state * AC_ALPHABET + symbols[i]];
+        }
+        if (ac->output[state] >= 0) {
+            duplicates++;
+            continue;
+        }
+        if (ac->num_terms == terms_capacity) {
+            terms_capacity *= 2;
+            char** new_terms = (char**)realloc(terms, terms_capacity * sizeof(char*));
+            if (!new_terms) {
+                perror("Failed to grow term list");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            terms = new_terms;
+        }
+        terms[ac->num_terms] = strdup(term);
+        ac->output[state] = ac->num_terms++;
+    }
+    fclose(fp);
+    if (duplicates > 0) {
+        printf("Master: Skipped %d duplicate dictionary terms.\n", duplicates);
+    }
+
+    ac->output_link = (int32_t*)calloc(ac->num_states, sizeof(int32_t));
+    int32_t* fail = (int32_t*)calloc(ac->num_states, sizeof(int32_t));
+    int32_t* queue = (int32_t*)malloc((size_t)ac->num_states * sizeof(int32_t));
+    if (!ac->output_link || !fail || !queue) {
+        perror("Failed to allocate Aho-Corasick links");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int head = 0, tail = 0;
+    for (int c = 0; c < AC_ALPHABET; ++c) {
+        int32_t child = ac->delta[c];
+        if (child < 0) {
+            ac->delta[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int32_t s = queue[head++];
+        for (int c = 0; c < AC_ALPHABET; ++c) {
+            size_t edge = (size_t)s * AC_ALPHABET + c;
+            int32_t child = ac->delta[edge];
+            int32_t fallback = ac->delta[(size_t)fail[s] * AC_ALPHABET + c];
+            if (child < 0) {
+                ac->delta[edge] = fallback;
+            } else {
+                fail[child] = fallback;
+                ac->output_link[child] = ac->output[fallback] >= 0 ? fallback : ac->output_link[fallback];
+                queue[tail++] = child;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    *terms_out = terms;
+    return ac->num_terms;
+}
+
+// L'automa viene costruito una volta sul master e trasmesso a tutti i rank
+void broadcast_aho_corasick(AhoCorasick* ac, int rank) {
+    int header[2] = { ac->num_states, ac->num_terms };
+    MPI_Bcast(header, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    if ((size_t)header[0] * AC_ALPHABET > (size_t)INT32_MAX) {
+        if (rank == 0) {
+            fprintf(stderr, "Dictionary automaton too large to broadcast (%d states)\n", header[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (rank != 0) {
+        ac->num_states = header[0];
+        ac->num_terms = header[1];
+        ac->delta = (int32_t*)malloc((size_t)ac->num_states * AC_ALPHABET * sizeof(int32_t));
+        ac->output = (int32_t*)malloc((size_t)ac->num_states * sizeof(int32_t));
+        ac->output_link = (int32_t*)malloc((size_t)ac->num_states * sizeof(int32_t));
+        if (!ac->delta || !ac->output || !ac->output_link) {
+            perror("Failed to allocate Aho-Corasick automaton");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    mem_track_alloc(MEM_HISTOGRAM, (size_t)ac->num_states * (AC_ALPHABET + 2) * sizeof(int32_t));
+    MPI_Bcast(ac->delta, ac->num_states * AC_ALPHABET, MPI_INT32_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(ac->output, ac->num_states, MPI_INT32_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(ac->output_link, ac->num_states, MPI_INT32_T, 0, MPI_COMM_WORLD);
+}
+
+void free_aho_corasick(AhoCorasick* ac) {
+    mem_track_free(MEM_HISTOGRAM, (size_t)ac->num_states * (AC_ALPHABET + 2) * sizeof(int32_t));
+    free(ac->delta);
+    free(ac->output);
+    free(ac->output_link);
+    ac->delta = ac->output = ac->output_link = NULL;
+    ac->num_states = 0;
+}
+
+// Le sequenze di separatori collassano in uno; le corrispondenze terminano sempre su un separatore
+void ac_feed_symbol(AcScanner* scanner, int symbol) {
+    if (symbol == AC_SEPARATOR) {
+        if (scanner->prev_separator) {
+            return;
+        }
+        scanner->prev_separator = 1;
+    } else {
+        scanner->prev_separator = 0;
+    }
+    const AhoCorasick* ac = scanner->ac;
+    int32_t state = ac->delta[(size_t)scanner->state * AC_ALPHABET + symbol];
+    scanner->state = state;
+    if (symbol == AC_SEPARATOR) {
+        int32_t match = ac->output[state] >= 0 ? state : ac->output_link[state];
+        while (match > 0) {
+            scanner->counts[ac->output[match]]++;
+            match = ac->output_link[match];
+        }
+    }
+}
+
+void ac_scan_block(void* ctx, const char* block, size_t len) {
+    AcScanner* scanner = (AcScanner*)ctx;
+    for (size_t i = 0; i < len; ++i) {
+        ac_feed_symbol(scanner, ac_symbol_of[(unsigned char)block[i]]);
+    }
+}
+
+void dictionary_count_file(const char* filename, void* ctx) {
+    DictionaryPass* pass = (DictionaryPass*)ctx;
+    AcScanner scanner = { pass->ac, pass->counts, 0, 0 };
+    // Il file inizia e finisce con un confine di parola
+    ac_feed_symbol(&scanner, AC_SEPARATOR);
+    if (scan_file(filename, pass->opts->read_mode, ac_scan_block, &scanner) == 0) {
+        ac_feed_symbol(&scanner, AC_SEPARATOR);
+    }
+}
+
+/*
+ * Modalità dizionario: conta solo i termini (anche di più parole) della lista, in un solo passaggio
+ * per file. I conteggi sono un array denso indicizzato per termine, sommato con un'unica MPI_Reduce.
+ */
+void run_dictionary_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size) {
+    AhoCorasick ac = { NULL, NULL, NULL, 0, 0 };
+    char** terms = NULL;
+    init_ac_symbols();
+    if (rank == 0) {
+        build_aho_corasick(&ac, opts->dictionary_path, &terms);
+        printf("Master: Dictionary has %d terms (%d automaton states).\n", ac.num_terms, ac.num_states);
+    }
+    broadcast_aho_corasick(&ac, rank);
+
+    uint64_t* counts = (uint64_t*)calloc(ac.num_terms > 0 ? ac.num_terms : 1, sizeof(uint64_t));
+    if (!counts) {
+        perror("Failed to allocate term counts");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    DictionaryPass pass = { &ac, counts, opts };
+    run_file_tasks(file_list, total_files, rank, size, dictionary_count_file, &pass);
+
+    if (rank == 0) {
+        MPI_Reduce(MPI_IN_PLACE, counts, ac.num_terms, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        FILE* fp = fopen(output_path("term_frequencies.csv"), "w");
+        if (!fp) {
+            perror("Errore nell'apertura del file CSV per la scrittura");
+        } else {
+            fprintf(fp, "term,frequency\n");
+            for (int i = 0; i < ac.num_terms; ++i) {
+                fprintf(fp, "%s,%" PRIu64 "\n", terms[i], counts[i]);
+            }
+            fclose(fp);
+            printf("Master: Output written to term_frequencies.csv\n");
+        }
+        for (int i = 0; i < ac.num_terms; ++i) {
+            free(terms[i]);
+        }
+        free(terms);
+    } else {
+        MPI_Reduce(counts, NULL, ac.num_terms, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+    free(counts);
+    free_aho_corasick(&ac);
+}
+
+void init_pair_table(PairTable* table, size_t capacity) {
+    table->slots = (PairCount*)malloc(capacity * sizeof(PairCount));
+    if (!table->slots) {
+        perror("Failed to allocate pair table");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_HISTOGRAM, capacity * sizeof(PairCount));
+    for (size_t i = 0; i < capacity; ++i) {
+        table->slots[i].key = PAIR_EMPTY_KEY;
+    }
+    table->capacity = capacity;
+    table->count = 0;
+}
+
+void free_pair_table(PairTable* table) {
+    if (table->slots) {
+        mem_track_free(MEM_HISTOGRAM, table->capacity * sizeof(PairCount));
+        free(table->slots);
+        table->slots = NULL;
+        table->capacity = 0;
+        table->count = 0;
+    }
+}
+
+void pair_table_add(PairTable* table, uint64_t key, uint64_t count) {
+    if ((table->count + 1) * 10 > table->capacity * 7) {
+        PairTable grown;
+        init_pair_table(&grown, table->capacity * 2);
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (table->slots[i].key != PAIR_EMPTY_KEY) {
+                pair_table_add(&grown, table->slots[i].key, table->slots[i].count);
+            }
+        }
+        free_pair_table(table);
+        *table = grown;
+    }
+    size_t mask = table->capacity - 1;
+    size_t i = hash_pair(key) & mask;
+    while (table->slots[i].key != PAIR_EMPTY_KEY && table->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i].key == PAIR_EMPTY_KEY) {
+        table->slots[i].key = key;
+        table->slots[i].count = 0;
+        table->count++;
+    }
+    table->slots[i].count += count;
+}
+
+// Il master trasmette il proprio istogramma a tutti; gli altri rank ne ricevono una copia
+void broadcast_histogram(Histogram* hist, int rank) {
+    size_t len = 0;
+    char* buf = NULL;
+    if (rank == 0) {
+        buf = serialize_histogram(hist, &len);
+    }
+    uint64_t len64 = len;
+    MPI_Bcast(&len64, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    len = (size_t)len64;
+    if (rank != 0) {
+        buf = comm_buffer_acquire(len);
+    }
+    for (size_t offset = 0; offset < len; offset += LARGE_MESSAGE_CHUNK) {
+        size_t chunk = len - offset < LARGE_MESSAGE_CHUNK ? len - offset : LARGE_MESSAGE_CHUNK;
+        MPI_Bcast(buf + offset, (int)chunk, MPI_BYTE, 0, MPI_COMM_WORLD);
+    }
+    if (rank != 0) {
+        deserialize_histogram(buf, len, hist);
+    }
+    comm_buffer_release(buf);
+}
+
+static const Histogram* sort_ids_vocabulary;
+
+static int compare_vocabulary_ids(const void* a, const void* b) {
+    return strcmp(sort_ids_vocabulary->items[*(const int*)a].word, sort_ids_vocabulary->items[*(const int*)b].word);
+}
+
+int* sort_vocabulary_ids(const Histogram* vocabulary) {
+    int* ids = (int*)malloc((vocabulary->count > 0 ? vocabulary->count : 1) * sizeof(int));
+    if (!ids) {
+        perror("Failed to allocate vocabulary index");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < vocabulary->count; ++i) {
+        ids[i] = i;
+    }
+    sort_ids_vocabulary = vocabulary;
+    qsort(ids, vocabulary->count, sizeof(int), compare_vocabulary_ids);
+    return ids;
+}
+
+int vocabulary_lookup(const Histogram* vocabulary, const int* sorted_ids, const char* word) {
+    int lo = 0, hi = vocabulary->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(vocabulary->items[sorted_ids[mid]].word, word);
+        if (cmp == 0) {
+            return sorted_ids[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+// Ogni parola fa coppia con le window parole che la precedono; le parole fuori vocabolario si saltano
+void cooccurrence_word_handler(void* ctx, const char* word) {
+    CooccurrencePass* pass = (CooccurrencePass*)ctx;
+    int id = vocabulary_lookup(pass->vocabulary, pass->sorted_ids, word);
+    if (id < 0) {
+        return;
+    }
+    for (int i = 0; i < pass->recent_count; ++i) {
+        int other = pass->recent[i];
+        uint64_t row = (uint64_t)(id > other ? id : other);
+        uint64_t col = (uint64_t)(id > other ? other : id);
+        pair_table_add(pass->pairs, (row << 32) | col, 1);
+    }
+    pass->recent[pass->recent_pos] = id;
+    pass->recent_pos = (pass->recent_pos + 1) % pass->window;
+    if (pass->recent_count < pass->window) {
+        pass->recent_count++;
+    }
+}
+
+void cooccurrence_count_file(const char* filename, void* ctx) {
+    CooccurrencePass* pass = (CooccurrencePass*)ctx;
+    pass->recent_count = 0;
+    pass->recent_pos = 0;
+    Tokenizer tok;
+    tokenizer_init(&tok, cooccurrence_word_handler, pass);
+    if (scan_file(filename, pass->opts->read_mode, tokenize_block, &tok) == 0) {
+        tokenizer_finish(&tok);
+    }
+}
+
+/*
+ * Riduzione distribuita partizionata per hash: ogni coppia appartiene al rank hash_pair(key) % size.
+ * Con un MPI_Alltoallv ogni rank riceve tutte le coppie che possiede e le somma nella propria tabella.
+ */
+void reduce_pair_tables(const PairTable* local, PairTable* owned, int size) {
+    int* send_counts = (int*)calloc(size, sizeof(int));
+    int* recv_counts = (int*)malloc(size * sizeof(int));
+    int* send_displs = (int*)malloc(size * sizeof(int));
+    int* recv_displs = (int*)malloc(size * sizeof(int));
+    int* fill = (int*)malloc(size * sizeof(int));
+    if (!send_counts || !recv_counts || !send_displs || !recv_displs || !fill) {
+        perror("Failed to allocate pair exchange counts");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (size_t i = 0; i < local->capacity; ++i) {
+        if (local->slots[i].key != PAIR_EMPTY_KEY) {
+            send_counts[hash_pair(local->slots[i].key) % size]++;
+        }
+    }
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    int total_send = 0, total_recv = 0;
+    for (int r = 0; r < size; ++r) {
+        send_displs[r] = total_send;
+        recv_displs[r] = total_recv;
+        fill[r] = total_send;
+        total_send += send_counts[r];
+        total_recv += recv_counts[r];
+    }
+    PairCount* send_buf = (PairCount*)comm_buffer_acquire((size_t)total_send * sizeof(PairCount));
+    PairCount* recv_buf = (PairCount*)comm_buffer_acquire((size_t)total_recv * sizeof(PairCount));
+    for (size_t i = 0; i < local->capacity; ++i) {
+        if (local->slots[i].key != PAIR_EMPTY_KEY) {
+            send_buf[fill[hash_pair(local->slots[i].key) % size]++] = local->slots[i];
+        }
+    }
+
+    MPI_Datatype pair_type;
+    MPI_Type_contiguous(sizeof(PairCount), MPI_BYTE, &pair_type);
+    MPI_Type_commit(&pair_type);
+    MPI_Alltoallv(send_buf, send_counts, send_displs, pair_type, recv_buf, recv_counts, recv_displs, pair_type, MPI_COMM_WORLD);
+    MPI_Type_free(&pair_type);
+
+    init_pair_table(owned, PAIR_TABLE_INITIAL_CAPACITY);
+    for (int i = 0; i < total_recv; ++i) {
+        pair_table_add(owned, recv_buf[i].key, recv_buf[i].count);
+    }
+
+    comm_buffer_release((char*)send_buf);
+    comm_buffer_release((char*)recv_buf);
+    free(send_counts);
+    free(recv_counts);
+    free(send_displs);
+    free(recv_displs);
+    free(fill);
+}
+
+int compare_pair_keys(const void* a, const void* b) {
+    uint64_t ka = ((const PairCount*)a)->key;
+    uint64_t kb = ((const PairCount*)b)->key;
+    return ka < kb ? -1 : (ka > kb ? 1 : 0);
+}
+
+/*
+ * Collettiva: le partizioni vengono raccolte sul master e scritte in formato Matrix Market
+ * (coordinate, simmetrica, indici 1-based). L'indice i corrisponde alla i-esima parola di word_frequencies.csv.
+ */
+void write_cooccurrence_matrix(const PairTable* owned, int vocabulary_size, const char* path, int rank, int size) {
+    int local_count = (int)owned->count;
+    PairCount* local = (PairCount*)malloc((local_count > 0 ? local_count : 1) * sizeof(PairCount));
+    if (!local) {
+        perror("Failed to allocate pair gather buffer");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int n = 0;
+    for (size_t i = 0; i < owned->capacity; ++i) {
+        if (owned->slots[i].key != PAIR_EMPTY_KEY) {
+            local[n++] = owned->slots[i];
+        }
+    }
+
+    int* counts = NULL;
+    int* displs = NULL;
+    PairCount* all = NULL;
+    int total = 0;
+    if (rank == 0) {
+        counts = (int*)malloc(size * sizeof(int));
+        displs = (int*)malloc(size * sizeof(int));
+        if (!counts || !displs) {
+            perror("Failed to allocate pair gather counts");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Gather(&local_count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < size; ++r) {
+            displs[r] = total;
+            total += counts[r];
+        }
+        all = (PairCount*)malloc((total > 0 ? total : 1) * sizeof(PairCount));
+        if (!all) {
+            perror("Failed to allocate co-occurrence matrix");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_MPI_BUFFER, (size_t)total * sizeof(PairCount));
+    }
+
+    MPI_Datatype pair_type;
+    MPI_Type_contiguous(sizeof(PairCount), MPI_BYTE, &pair_type);
+    MPI_Type_commit(&pair_type);
+    MPI_Gatherv(local, local_count, pair_type, all, counts, displs, pair_type, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&pair_type);
+    free(local);
+
+    if (rank == 0) {
+        qsort(all, total, sizeof(PairCount), compare_pair_keys);
+        FILE* fp = fopen(output_path(path), "w");
+        if (!fp) {
+            perror("Errore nell'apertura del file della matrice per la scrittura");
+        } else {
+            fprintf(fp, "%%%%MatrixMarket matrix coordinate integer symmetric\n");
+            fprintf(fp, "%% row/column i is the i-th word of word_frequencies.csv\n");
+            fprintf(fp, "%d %d %d\n", vocabulary_size, vocabulary_size, total);
+            for (int i = 0; i < total; ++i) {
+                fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                        (all[i].key >> 32) + 1, (all[i].key & UINT32_MAX) + 1, all[i].count);
+            }
+            fclose(fp);
+            printf("Master: Co-occurrence matrix with %d non-zero pairs written to %s\n", total, path);
+        }
+        mem_track_free(MEM_MPI_BUFFER, (size_t)total * sizeof(PairCount));
+        free(all);
+        free(counts);
+        free(displs);
+    }
+}
+
+/*
+ * Modalità co-occorrenza: il primo passo è il normale conteggio, che fissa il vocabolario e i suoi ID
+ * (l'ordine di word_frequencies.csv). Il vocabolario viene trasmesso a tutti, il secondo passo accumula
+ * le coppie in tabelle sparse locali, ridotte poi con una partizione per hash tra i rank.
+ */
+void run_cooccurrence_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size,
+                            TextStats* stats) {
+    Histogram vocabulary;
+    run_word_count(file_list, total_files, NULL, opts, rank, size, &vocabulary, stats);
+    broadcast_histogram(&vocabulary, rank);
+    int* sorted_ids = sort_vocabulary_ids(&vocabulary);
+
+    double pass_start = MPI_Wtime();
+    PairTable local_pairs;
+    init_pair_table(&local_pairs, PAIR_TABLE_INITIAL_CAPACITY);
+    int* recent = (int*)malloc(opts->cooccurrence_window * sizeof(int));
+    if (!recent) {
+        perror("Failed to allocate co-occurrence window");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    CooccurrencePass pass = { &vocabulary, sorted_ids, &local_pairs, opts->cooccurrence_window, recent, 0, 0, opts };
+    run_file_tasks(file_list, total_files, rank, size, cooccurrence_count_file, &pass);
+    free(recent);
+
+    PairTable owned_pairs;
+    reduce_pair_tables(&local_pairs, &owned_pairs, size);
+    free_pair_table(&local_pairs);
+    write_cooccurrence_matrix(&owned_pairs, vocabulary.count, "cooccurrence.mtx", rank, size);
+    if (rank == 0) {
+        printf("Master: Co-occurrence pass took %.4f seconds.\n", MPI_Wtime() - pass_start);
+    }
+
+    free_pair_table(&owned_pairs);
+    free(sorted_ids);
+    free_histogram_content(&vocabulary);
+}
+
+/*
+ * Conteggio dei byte con più tabelle: byte consecutivi vanno su tabelle diverse, così incrementi
+ * dello stesso contatore non si serializzano sulla dipendenza store-load. Contatori a 32 bit
+ * (un blocco è al massimo READ_BLOCK_SIZE) sommati alla fine nei totali a 64 bit.
+ */
+void count_bytes_block(uint64_t* byte_counts, const unsigned char* data, size_t len) {
+    uint32_t tables[BYTE_COUNT_TABLES][BYTE_VALUES];
+    memset(tables, 0, sizeof(tables));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        tables[0][w & 0xff]++;
+        tables[1][(w >> 8) & 0xff]++;
+        tables[2][(w >> 16) & 0xff]++;
+        tables[3][(w >> 24) & 0xff]++;
+        tables[0][(w >> 32) & 0xff]++;
+        tables[1][(w >> 40) & 0xff]++;
+        tables[2][(w >> 48) & 0xff]++;
+        tables[3][w >> 56]++;
+    }
+    for (; i < len; ++i) {
+        tables[0][data[i]]++;
+    }
+    for (int b = 0; b < BYTE_VALUES; ++b) {
+        byte_counts[b] += (uint64_t)tables[0][b] + tables[1][b] + tables[2][b] + tables[3][b];
+    }
+}
+
+// Decodifica UTF-8 incrementale: lo stato sopravvive tra un blocco e il successivo
+void utf8_feed_byte(CharScanner* scanner, unsigned char c) {
+    uint64_t* invalid = &scanner->codepoint_counts[UNICODE_CODEPOINTS];
+    if (scanner->pending > 0) {
+        if ((c & 0xC0) == 0x80) {
+            scanner->codepoint = (scanner->codepoint << 6) | (c & 0x3F);
+            if (--scanner->pending == 0) {
+                uint32_t cp = scanner->codepoint;
+                if (cp < scanner->min_codepoint || cp >= UNICODE_CODEPOINTS || (cp >= 0xD800 && cp <= 0xDFFF)) {
+                    (*invalid)++;
+                } else {
+                    scanner->codepoint_counts[cp]++;
+                }
+            }
+            return;
+        }
+        // Sequenza troncata: conta come non valida e riparte da questo byte
+        (*invalid)++;
+        scanner->pending = 0;
+    }
+    if (c < 0x80) {
+        scanner->codepoint_counts[c]++;
+    } else if ((c & 0xE0) == 0xC0) {
+        scanner->codepoint = c & 0x1F;
+        scanner->min_codepoint = 0x80;
+        scanner->pending = 1;
+    } else if ((c & 0xF0) == 0xE0) {
+        scanner->codepoint = c & 0x0F;
+        scanner->min_codepoint = 0x800;
+        scanner->pending = 2;
+    } else if ((c & 0xF8) == 0xF0) {
+        scanner->codepoint = c & 0x07;
+        scanner->min_codepoint = 0x10000;
+        scanner->pending = 3;
+    } else {
+        (*invalid)++;
+    }
+}
+
+void char_scan_block(void* ctx, const char* block, size_t len) {
+    CharScanner* scanner = (CharScanner*)ctx;
+    const unsigned char* data = (const unsigned char*)block;
+    count_bytes_block(scanner->byte_counts, data, len);
+    if (scanner->codepoint_counts) {
+        for (size_t i = 0; i < len; ++i) {
+            utf8_feed_byte(scanner, data[i]);
+        }
+    }
+}
+
+void char_count_file(const char* filename, void* ctx) {
+    CharScanner* scanner = (CharScanner*)ctx;
+    scanner->pending = 0;
+    scan_file(filename, scanner->opts->read_mode, char_scan_block, scanner);
+    if (scanner->codepoint_counts && scanner->pending > 0) {
+        scanner->codepoint_counts[UNICODE_CODEPOINTS]++;
+    }
+}
+
+void write_char_histograms(const uint64_t* byte_counts, const uint64_t* codepoint_counts) {
+    uint64_t total_bytes = 0;
+    FILE* fp = fopen(output_path("byte_frequencies.csv"), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+    } else {
+        fprintf(fp, "byte,frequency\n");
+        for (int b = 0; b < BYTE_VALUES; ++b) {
+            fprintf(fp, "%d,%" PRIu64 "\n", b, byte_counts[b]);
+            total_bytes += byte_counts[b];
+        }
+        fclose(fp);
+        printf("Master: %" PRIu64 " bytes counted, output written to byte_frequencies.csv\n", total_bytes);
+    }
+    if (!codepoint_counts) {
+        return;
+    }
+    fp = fopen(output_path("codepoint_frequencies.csv"), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+        return;
+    }
+    int distinct = 0;
+    fprintf(fp, "codepoint,frequency\n");
+    for (uint32_t cp = 0; cp < UNICODE_CODEPOINTS; ++cp) {
+        if (codepoint_counts[cp] > 0) {
+            fprintf(fp, "U+%04" PRIX32 ",%" PRIu64 "\n", cp, codepoint_counts[cp]);
+            distinct++;
+        }
+    }
+    if (codepoint_counts[UNICODE_CODEPOINTS] > 0) {
+        fprintf(fp, "invalid,%" PRIu64 "\n", codepoint_counts[UNICODE_CODEPOINTS]);
+    }
+    fclose(fp);
+    printf("Master: %d distinct code points (%" PRIu64 " invalid sequences), output written to codepoint_frequencies.csv\n",
+           distinct, codepoint_counts[UNICODE_CODEPOINTS]);
+}
+
+/*
+ * Modalità istogramma di caratteri: nessuna tokenizzazione, solo conteggi per byte (e per code point).
+ * Tutti i contatori stanno in un unico array di dimensione fissa, sommato con una sola MPI_Reduce.
+ */
+void run_char_histogram(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size) {
+    size_t num_counters = BYTE_VALUES;
+    if (opts->char_histogram == CHAR_HISTOGRAM_UTF8) {
+        num_counters += UNICODE_CODEPOINTS + 1;
+    }
+    uint64_t* counts = (uint64_t*)calloc(num_counters, sizeof(uint64_t));
+    if (!counts) {
+        perror("Failed to allocate character counts");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_HISTOGRAM, num_counters * sizeof(uint64_t));
+
+    CharScanner scanner = { counts, NULL, 0, 0, 0, opts };
+    if (opts->char_histogram == CHAR_HISTOGRAM_UTF8) {
+        scanner.codepoint_counts = counts + BYTE_VALUES;
+    }
+    run_file_tasks(file_list, total_files, rank, size, char_count_file, &scanner);
+
+    if (rank == 0) {
+        MPI_Reduce(MPI_IN_PLACE, counts, (int)num_counters, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        write_char_histograms(counts, scanner.codepoint_counts);
+    } else {
+        MPI_Reduce(counts, NULL, (int)num_counters, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+    mem_track_free(MEM_HISTOGRAM, num_counters * sizeof(uint64_t));
+    free(counts);
+}
+
+/*
+ * Formato binario di un istogramma salvato: WC_FILE_MAGIC, lunghezza del payload (uint64)
+ * e payload nel formato di serialize_histogram.
+ */
+void write_histogram_to_binary(const Histogram* hist, const char* path, const Mphf* index) {
+    FILE* fp = fopen(output_path(path), "wb");
+    if (!fp) {
+        perror("Errore nell'apertura del file binario per la scrittura");
+        return;
+    }
+    size_t len;
+    char* buf = serialize_histogram(hist, &len);
+    uint64_t len64 = len;
+    int write_failed = fwrite(WC_FILE_MAGIC, 1, WC_FILE_MAGIC_LEN, fp) != WC_FILE_MAGIC_LEN ||
+                       fwrite(&len64, sizeof(len64), 1, fp) != 1 || fwrite(buf, 1, len, fp) != len;
+
+    /*
+     * Indice opzionale dopo il payload (chi legge solo l'istogramma lo ignora): magic, numero di chiavi,
+     * numero di livelli, larghezza degli offset (4 o 8 byte), seme dell'hash delle parole, dimensioni dei
+     * livelli, bit, campioni di rank e, per ogni slot, l'offset della voce nel payload. L'indice inizia a un
+     * offset multiplo di 8 del file, così chi lo mappa in memoria usa bit e campioni senza copiarli.
+     */
+    if (index && !write_failed) {
+        static const char padding[8];
+        size_t pad = (8 - (WC_FILE_MAGIC_LEN + sizeof(len64) + len) % 8) % 8;
+        uint64_t offset_width = len64 <= UINT32_MAX ? 4 : 8;
+        uint64_t header[4] = { index->num_keys, (uint64_t)index->num_levels, offset_width, index->hash_seed };
+        uint64_t num_samples = (index->total_words + MPHF_RANK_STRIDE - 1) / MPHF_RANK_STRIDE;
+        char* offsets = (char*)malloc(index->num_keys > 0 ? index->num_keys * offset_width : 1);
+        if (!offsets) {
+            perror("Failed to allocate index offsets");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        // Le voci serializzate si percorrono nello stesso ordine dell'istogramma
+        int32_t count, has_groups, freq, group;
+        wc_serial_get_header(buf, len, &count, &has_groups);
+        const char* p = buf + WC_SERIAL_HEADER_LEN;
+        for (int i = 0; i < hist->count; ++i) {
+            uint64_t off = (uint64_t)(p - buf);
+            if (offset_width == 4) {
+                uint32_t off32 = (uint32_t)off;
+                memcpy(offsets + (size_t)index->slots[i] * 4, &off32, 4);
+            } else {
+                memcpy(offsets + (size_t)index->slots[i] * 8, &off, 8);
+            }
+            const char* word;
+            size_t word_len;
+            p = wc_serial_get_record(p, buf + len, has_groups, &freq, &group, &word, &word_len);
+        }
+        write_failed = fwrite(padding, 1, pad, fp) != pad ||
+                       fwrite(MPHF_INDEX_MAGIC, 1, 8, fp) != 8 ||
+                       fwrite(header, sizeof(uint64_t), 4, fp) != 4 ||
+                       fwrite(index->level_words, sizeof(uint64_t), index->num_levels, fp) != (size_t)index->num_levels ||
+                       fwrite(index->bits, sizeof(uint64_t), index->total_words, fp) != index->total_words ||
+                       fwrite(index->rank_samples, sizeof(uint64_t), num_samples, fp) != num_samples ||
+                       fwrite(offsets, offset_width, index->num_keys, fp) != index->num_keys;
+        free(offsets);
+        if (!write_failed) {
+            uint64_t function_bytes = (index->total_words + num_samples) * sizeof(uint64_t);
+            uint64_t index_bytes = 8 + sizeof(header) + index->num_levels * sizeof(uint64_t) + function_bytes +
+                                   index->num_keys * offset_width;
+            double per_key = index->num_keys > 0 ? 8.0 / index->num_keys : 0.0;
+            printf("Master: Perfect hash index in %s: %" PRIu64 " bytes, %.2f bits/key "
+                   "(%.2f for the hash function, %.2f for the entry offsets).\n", path, index_bytes,
+                   per_key * index_bytes, per_key * function_bytes, per_key * index->num_keys * offset_width);
+        }
+    }
+    if (write_failed) {
+        perror("Errore nella scrittura del file binario");
+    }
+    fclose(fp);
+    comm_buffer_release(buf);
+}
+
+// Carica un istogramma salvato (binario o CSV "word,frequency") e lo restituisce ordinato per parola
+int load_saved_histogram(const char* path, Histogram* hist) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+    char magic[WC_FILE_MAGIC_LEN];
+    size_t got = fread(magic, 1, WC_FILE_MAGIC_LEN, fp);
+    if (got == WC_FILE_MAGIC_LEN && memcmp(magic, WC_FILE_MAGIC, WC_FILE_MAGIC_LEN) == 0) {
+        uint64_t len64;
+        if (fread(&len64, sizeof(len64), 1, fp) != 1) {
+            fclose(fp);
+            return -1;
+        }
+        char* buf = (char*)malloc(len64 > 0 ? len64 : 1);
+        if (!buf) {
+            perror("Failed to allocate saved histogram buffer");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_IO_BUFFER, len64);
+        if (fread(buf, 1, len64, fp) != len64) {
+            mem_track_free(MEM_IO_BUFFER, len64);
+            free(buf);
+            fclose(fp);
+            return -1;
+        }
+        deserialize_histogram(buf, len64, hist);
+        mem_track_free(MEM_IO_BUFFER, len64);
+        free(buf);
+        // I file di un run con gruppi portano l'ID del gruppo, che qui non ha più significato
+        for (int i = 0; i < hist->count; ++i) {
+            hist->items[i].group = 0;
+        }
+    } else {
+        rewind(fp);
+        init_histogram(hist);
+        char line[MAX_WORD_LEN + 32];
+        int line_no = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            line_no++;
+            line[strcspn(line, "\r\n")] = '\0';
+            char* comma = strrchr(line, ',');
+            if (line_no == 1 && strcmp(line, "word,frequency") == 0) {
+                continue;
+            }
+            char* end = NULL;
+            long freq = comma ? strtol(comma + 1, &end, 10) : 0;
+            if (!comma || comma == line || *end != '\0' || freq < 0 || freq > INT32_MAX) {
+                fprintf(stderr, "Skipping malformed line %d in %s\n", line_no, path);
+                continue;
+            }
+            *comma = '\0';
+            ensure_capacity(hist, hist->count + 1);
+            WordFreq* item = &hist->items[hist->count++];
+            strncpy(item->word, line, MAX_WORD_LEN - 1);
+            item->word[MAX_WORD_LEN - 1] = '\0';
+            item->frequency = (int)freq;
+            item->group = 0;
+        }
+    }
+    fclose(fp);
+
+    // Un CSV può essere in ordine di frequenza: si riordina e si compattano i duplicati, anche tra gruppi diversi
+    sort_histogram_by_word(hist);
+    int unique = 0;
+    for (int i = 0; i < hist->count; ++i) {
+        if (unique > 0 && compare_wordfreq(&hist->items[unique - 1], &hist->items[i]) == 0) {
+            hist->items[unique - 1].frequency += hist->items[i].frequency;
+        } else {
+            hist->items[unique++] = hist->items[i];
+        }
+    }
+    hist->count = unique;
+    return 0;
+}
+
+// Fusione lineare di due istogrammi ordinati per parola; dest resta ordinato
+void merge_sorted_histograms(Histogram* dest, const Histogram* src) {
+    Histogram merged;
+    init_histogram(&merged);
+    ensure_capacity(&merged, dest->count + src->count);
+    int i = 0, j = 0;
+    while (i < dest->count && j < src->count) {
+        int cmp = compare_wordfreq(&dest->items[i], &src->items[j]);
+        if (cmp < 0) {
+            merged.items[merged.count++] = dest->items[i++];
+        } else if (cmp > 0) {
+            merged.items[merged.count++] = src->items[j++];
+        } else {
+            merged.items[merged.count] = dest->items[i++];
+            merged.items[merged.count++].frequency += src->items[j++].frequency;
+        }
+    }
+    while (i < dest->count) {
+        merged.items[merged.count++] = dest->items[i++];
+    }
+    while (j < src->count) {
+        merged.items[merged.count++] = src->items[j++];
+    }
+    free_histogram_content(dest);
+    *dest = merged;
+}
+
+void merge_saved_file(const char* filename, void* ctx) {
+    Histogram* merged = (Histogram*)ctx;
+    Histogram loaded;
+    if (load_saved_histogram(filename, &loaded) != 0) {
+        fprintf(stderr, "Could not load saved histogram %s\n", filename);
+        return;
+    }
+    merge_sorted_histograms(merged, &loaded);
+    free_histogram_content(&loaded);
+}
+
+/*
+ * Riduzione ad albero binomiale di istogrammi ordinati: a ogni passo metà dei rank ancora attivi
+ * invia il proprio istogramma al partner, che lo fonde linearmente. Il risultato finisce sul rank 0.
+ */
+void tree_reduce_sorted_histograms(Histogram* hist, int rank, int size) {
+    for (int step = 1; step < size; step <<= 1) {
+        if (rank % (2 * step) == 0) {
+            int source = rank + step;
+            if (source < size) {
+                Histogram received;
+                recv_histogram(&received, source, TAG_MERGE_HISTOGRAM_SIZE, MPI_COMM_WORLD);
+                merge_sorted_histograms(hist, &received);
+                free_histogram_content(&received);
+            }
+        } else {
+            PendingHistogramSend pending;
+            start_histogram_send(hist, rank - step, TAG_MERGE_HISTOGRAM_SIZE, MPI_COMM_WORLD, &pending);
+            finish_histogram_send(&pending);
+            free_histogram_content(hist);
+            break;
+        }
+    }
+}
+
+/*
+ * Collettiva se l'ordine è per frequenza: i worker la chiamano con hist NULL per partecipare all'ordinamento.
+ * Il master scrive base_name.csv e, se richiesto, base_name.bin.
+ */
+void write_word_histogram(Histogram* hist, const Options* opts, const char* base_name, int rank, int size) {
+    if (opts->sort_order == SORT_BY_FREQUENCY) {
+        sort_histogram_by_frequency(hist, rank, size);
+    } else if (hist) {
+        sort_histogram_by_word(hist);
+    }
+    // Anche la costruzione dell'indice è collettiva; se fallisce si scrive comunque l'istogramma
+    Mphf index;
+    int has_index = 0;
+    if (opts->mphf_index) {
+        double index_start = MPI_Wtime();
+        has_index = build_mphf(hist, rank, size, &index) == 0;
+        if (rank == 0 && has_index) {
+            printf("Master: Perfect hash over %" PRIu64 " words: %d levels, built in %.4f seconds.\n",
+                   index.num_keys, index.num_levels, MPI_Wtime() - index_start);
+        }
+    }
+    if (rank == 0) {
+        char path[MAX_FILENAME_LEN];
+        snprintf(path, sizeof(path), "%s.csv", base_name);
+        write_histogram_to_csv(hist, path);
+        if (opts->binary_output) {
+            snprintf(path, sizeof(path), "%s.bin", base_name);
+            write_histogram_to_binary(hist, path, has_index ? &index : NULL);
+        }
+    }
+    if (has_index) {
+        free_mphf(&index);
+    }
+}
+
+/*
+ * Modalità merge: i file del filelist sono istogrammi salvati da esecuzioni precedenti.
+ * Ogni rank fonde i propri con merge lineari di run ordinate, poi una riduzione ad albero li combina.
+ */
+void run_merge_saved(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size) {
+    Histogram merged;
+    init_histogram(&merged);
+    run_file_tasks(file_list, total_files, rank, size, merge_saved_file, &merged);
+    tree_reduce_sorted_histograms(&merged, rank, size);
+
+    if (rank == 0) {
+        if (opts->min_count > 1) {
+            drop_rare_words(&merged, opts->min_count);
+        }
+        printf("Master: Merged %d listed histogram files into %d unique words.\n", total_files, merged.count);
+        write_word_histogram(&merged, opts, "word_frequencies", rank, size);
+        printf("Master: Output written to word_frequencies.csv%s\n", opts->binary_output ? " and word_frequencies.bin" : "");
+    } else {
+        write_word_histogram(NULL, opts, NULL, rank, size);
+    }
+    free_histogram_content(&merged);
+}
+
+// Conta (o carica, con --merge) un file del corpus e lo fonde, ordinato, nell'istogramma locale
+void diff_load_file(const char* filename, void* ctx) {
+    DiffPass* pass = (DiffPass*)ctx;
+    Histogram* file_hist;
+    Histogram loaded;
+    if (pass->opts->merge_saved) {
+        if (load_saved_histogram(filename, &loaded) != 0) {
+            fprintf(stderr, "Could not load saved histogram %s\n", filename);
+            return;
+        }
+        for (int i = 0; i < loaded.count; ++i) {
+            loaded.items[i].group = pass->corpus;
+        }
+        file_hist = &loaded;
+    } else {
+        file_hist = count_words_in_file(filename, pass->corpus, pass->opts, NULL, NULL, NULL, &pass->scratch);
+        if (!file_hist) {
+            fprintf(stderr, "Could not process file %s\n", filename);
+            arena_reset(&pass->scratch);
+            return;
+        }
+        sort_histogram_by_word(file_hist);
+    }
+    merge_sorted_histograms(pass->hist, file_hist);
+    if (file_hist == &loaded) {
+        free_histogram_content(&loaded);
+    } else {
+        arena_reset(&pass->scratch);
+    }
+}
+
+/*
+ * Collettiva: invia ogni elemento (di item_size byte) al rank owner[i] con un MPI_Alltoallv.
+ * Restituisce un buffer allocato con gli elementi ricevuti, raggruppati per rank di provenienza.
+ */
+void* alltoall_by_owner(const void* items, int count, size_t item_size, const int* owner, int size, int* out_count) {
+    int* send_counts = (int*)calloc(size, sizeof(int));
+    int* recv_counts = (int*)malloc(size * sizeof(int));
+    int* send_displs = (int*)malloc(size * sizeof(int));
+    int* recv_displs = (int*)malloc(size * sizeof(int));
+    int* fill = (int*)malloc(size * sizeof(int));
+    if (!send_counts || !recv_counts || !send_displs || !recv_displs || !fill) {
+        perror("Failed to allocate exchange counts");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < count; ++i) {
+        send_counts[owner[i]]++;
+    }
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    int total_send = 0, total_recv = 0;
+    for (int r = 0; r < size; ++r) {
+        send_displs[r] = total_send;
+        recv_displs[r] = total_recv;
+        fill[r] = total_send;
+        total_send += send_counts[r];
+        total_recv += recv_counts[r];
+    }
+    // Il buffer ricevuto passa al chiamante, quello d'invio torna al pool
+    char* send_buf = comm_buffer_acquire((size_t)total_send * item_size);
+    char* recv_buf = (char*)malloc((total_recv > 0 ? total_recv : 1) * item_size);
+    if (!recv_buf) {
+        perror("Failed to allocate exchange buffers");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < count; ++i) {
+        memcpy(send_buf + (size_t)fill[owner[i]]++ * item_size, (const char*)items + (size_t)i * item_size, item_size);
+    }
+
+    MPI_Datatype item_type;
+    MPI_Type_contiguous((int)item_size, MPI_BYTE, &item_type);
+    MPI_Type_commit(&item_type);
+    MPI_Alltoallv(send_buf, send_counts, send_displs, item_type,
+                  recv_buf, recv_counts, recv_displs, item_type, MPI_COMM_WORLD);
+    MPI_Type_free(&item_type);
+
+    comm_buffer_release(send_buf);
+    free(send_counts);
+    free(recv_counts);
+    free(send_displs);
+    free(recv_displs);
+    free(fill);
+    *out_count = total_recv;
+    return recv_buf;
+}
+
+// Partizione per hash della parola: ogni rank riceve tutte le voci (di entrambi i corpora) delle parole che possiede
+void exchange_by_word_owner(const Histogram* local, Histogram* owned, int size) {
+    int* owner = (int*)malloc((local->count > 0 ? local->count : 1) * sizeof(int));
+    if (!owner) {
+        perror("Failed to allocate word owners");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < local->count; ++i) {
+        owner[i] = (int)(hash_word(local->items[i].word) % size);
+    }
+    int received;
+    WordFreq* items = (WordFreq*)alltoall_by_owner(local->items, local->count, sizeof(WordFreq), owner, size, &received);
+    free(owner);
+
+    // Il buffer ricevuto diventa direttamente l'array dell'istogramma
+    owned->items = items;
+    owned->count = received;
+    owned->capacity = received > 0 ? received : 1;
+    owned->slots = NULL;
+    owned->slot_mask = 0;
+    owned->indexed = 0;
+    owned->salt = 0;
+    owned->arena = NULL;
+    mem_track_alloc(MEM_HISTOGRAM, (size_t)owned->capacity * sizeof(WordFreq));
+}
+
+// G2 di Dunning per una parola vista a volte in A (su total_a token) e b volte in B (su total_b token)
+double log_likelihood(uint64_t a, uint64_t b, uint64_t total_a, uint64_t total_b) {
+    double total = (double)total_a + (double)total_b;
+    double expected_a = (double)total_a * (double)(a + b) / total;
+    double expected_b = (double)total_b * (double)(a + b) / total;
+    double g2 = 0.0;
+    if (a > 0) {
+        g2 += (double)a * log((double)a / expected_a);
+    }
+    if (b > 0) {
+        g2 += (double)b * log((double)b / expected_b);
+    }
+    return 2.0 * g2;
+}
+
+// Significatività decrescente, a parità in ordine alfabetico
+int compare_diff_entries(const void* a, const void* b) {
+    const DiffEntry* da = (const DiffEntry*)a;
+    const DiffEntry* db = (const DiffEntry*)b;
+    if (da->log_likelihood != db->log_likelihood) {
+        return da->log_likelihood > db->log_likelihood ? -1 : 1;
+    }
+    return strncmp(da->word, db->word, MAX_WORD_LEN);
+}
+
+/*
+ * Join locale sulle parole possedute: dopo l'ordinamento per (corpus, parola) le voci di A precedono
+ * quelle di B, quindi basta un merge a due puntatori tra i due tratti. Il risultato è ordinato per significatività.
+ */
+DiffEntry* join_corpus_counts(const Histogram* owned, const uint64_t* totals, int min_count, int* out_count) {
+    int split = 0;
+    while (split < owned->count && owned->items[split].group == 0) {
+        split++;
+    }
+    DiffEntry* entries = (DiffEntry*)malloc((owned->count > 0 ? owned->count : 1) * sizeof(DiffEntry));
+    if (!entries) {
+        perror("Failed to allocate diff entries");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    double smoothed_a = (double)totals[0] + DIFF_SMOOTHING;
+    double smoothed_b = (double)totals[1] + DIFF_SMOOTHING;
+    int n = 0, i = 0, j = split;
+    while (i < split || j < owned->count) {
+        int cmp;
+        if (i == split) {
+            cmp = 1;
+        } else if (j == owned->count) {
+            cmp = -1;
+        } else {
+            cmp = strncmp(owned->items[i].word, owned->items[j].word, MAX_WORD_LEN);
+        }
+        DiffEntry* e = &entries[n];
+        e->count_a = 0;
+        e->count_b = 0;
+        if (cmp <= 0) {
+            strcpy(e->word, owned->items[i].word);
+            e->count_a = owned->items[i++].frequency;
+        }
+        if (cmp >= 0) {
+            strcpy(e->word, owned->items[j].word);
+            e->count_b = owned->items[j++].frequency;
+        }
+        if (e->count_a + e->count_b < (uint64_t)min_count) {
+            continue;
+        }
+        double rel_a = ((double)e->count_a + DIFF_SMOOTHING) / smoothed_a;
+        double rel_b = ((double)e->count_b + DIFF_SMOOTHING) / smoothed_b;
+        e->log2_ratio = log2(rel_b / rel_a);
+        e->log_likelihood = log_likelihood(e->count_a, e->count_b, totals[0], totals[1]);
+        n++;
+    }
+    qsort(entries, n, sizeof(DiffEntry), compare_diff_entries);
+    *out_count = n;
+    return entries;
+}
+
+// Fusione bottom-up delle run già ordinate raccolte dai rank: log2(runs) passate lineari
+void merge_sorted_diff_runs(DiffEntry* items, const int* displs, int runs, int total) {
+    DiffEntry* tmp = (DiffEntry*)malloc((total > 0 ? total : 1) * sizeof(DiffEntry));
+    if (!tmp) {
+        perror("Failed to allocate diff merge buffer");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int width = 1; width < runs; width *= 2) {
+        for (int r = 0; r < runs; r += 2 * width) {
+            int lo = displs[r];
+            int mid = r + width < runs ? displs[r + width] : total;
+            int hi = r + 2 * width < runs ? displs[r + 2 * width] : total;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                tmp[k++] = compare_diff_entries(&items[i], &items[j]) <= 0 ? items[i++] : items[j++];
+            }
+            while (i < mid) {
+                tmp[k++] = items[i++];
+            }
+            while (j < hi) {
+                tmp[k++] = items[j++];
+            }
+        }
+        memcpy(items, tmp, total * sizeof(DiffEntry));
+    }
+    free(tmp);
+}
+
+void write_diff_csv(const DiffEntry* entries, int count, const char* path) {
+    FILE* fp = fopen(output_path(path), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+        return;
+    }
+    fprintf(fp, "word,count_a,count_b,delta,log2_ratio,log_likelihood\n");
+    for (int i = 0; i < count; ++i) {
+        fprintf(fp, "%s,%" PRIu64 ",%" PRIu64 ",%" PRId64 ",%.4f,%.4f\n", entries[i].word, entries[i].count_a,
+                entries[i].count_b, (int64_t)(entries[i].count_b - entries[i].count_a),
+                entries[i].log2_ratio, entries[i].log_likelihood);
+    }
+    fclose(fp);
+}
+
+/*
+ * Modalità diff: confronta il corpus di filelist.txt (A) con quello di --diff (B). Entrambi vengono contati
+ * (o caricati con --merge) in un istogramma locale con chiave (corpus, parola), partizionato per hash tra i rank;
+ * ogni rank calcola delta, rapporto e log-likelihood delle proprie parole e le run ordinate si fondono sul master.
+ */
+void run_corpus_diff(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size) {
+    char other_list[MAX_FILES][MAX_FILENAME_LEN];
+    int other_files = 0;
+    if (rank == 0) {
+        CorpusGroups ignored_groups;
+        other_files = read_file_list(opts->diff_filelist, other_list, &ignored_groups);
+        printf("Master: Comparing %d files (A) against %d files (B) from %s\n", total_files, other_files, opts->diff_filelist);
+    }
+
+    Histogram local;
+    init_histogram(&local);
+    DiffPass pass = { &local, 0, opts, { NULL, 0 } };
+    arena_init(&pass.scratch);
+    run_file_tasks(file_list, total_files, rank, size, diff_load_file, &pass);
+    pass.corpus = 1;
+    run_file_tasks(other_list, other_files, rank, size, diff_load_file, &pass);
+    arena_destroy(&pass.scratch);
+
+    uint64_t totals[2] = { 0, 0 };
+    for (int i = 0; i < local.count; ++i) {
+        totals[local.items[i].group] += local.items[i].frequency;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, totals, 2, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+    Histogram owned;
+    exchange_by_word_owner(&local, &owned, size);
+    free_histogram_content(&local);
+    // Stessa parola dello stesso corpus arriva da più rank: si ordina e si somma
+    sort_histogram_by_word(&owned);
+    int unique = 0;
+    for (int i = 0; i < owned.count; ++i) {
+        if (unique > 0 && compare_wordfreq(&owned.items[unique - 1], &owned.items[i]) == 0) {
+            owned.items[unique - 1].frequency += owned.items[i].frequency;
+        } else {
+            owned.items[unique++] = owned.items[i];
+        }
+    }
+    owned.count = unique;
+
+    int local_count;
+    DiffEntry* entries = join_corpus_counts(&owned, totals, opts->min_count, &local_count);
+    free_histogram_content(&owned);
+
+    MPI_Datatype diff_type;
+    MPI_Type_contiguous(sizeof(DiffEntry), MPI_BYTE, &diff_type);
+    MPI_Type_commit(&diff_type);
+    int* counts = NULL;
+    int* displs = NULL;
+    DiffEntry* all = NULL;
+    int total = 0;
+    if (rank == 0) {
+        counts = (int*)malloc(size * sizeof(int));
+        displs = (int*)malloc(size * sizeof(int));
+        if (!counts || !displs) {
+            perror("Failed to allocate diff gather counts");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Gather(&local_count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < size; ++r) {
+            displs[r] = total;
+            total += counts[r];
+        }
+        all = (DiffEntry*)malloc((total > 0 ? total : 1) * sizeof(DiffEntry));
+        if (!all) {
+            perror("Failed to allocate diff results");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_MPI_BUFFER, (size_t)total * sizeof(DiffEntry));
+    }
+    MPI_Gatherv(entries, local_count, diff_type, all, counts, displs, diff_type, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&diff_type);
+    free(entries);
+
+    if (rank == 0) {
+        merge_sorted_diff_runs(all, displs, size, total);
+        write_diff_csv(all, total, "word_diff.csv");
+        printf("Master: Corpus A has %" PRIu64 " words, corpus B has %" PRIu64 " words.\n", totals[0], totals[1]);
+        printf("Master: %d words compared, output written to word_diff.csv\n", total);
+        mem_track_free(MEM_MPI_BUFFER, (size_t)total * sizeof(DiffEntry));
+        free(all);
+        free(counts);
+        free(displs);
+    }
+}
+
+uint64_t mphf_level_hash(uint64_t key_hash, int level, uint64_t level_bits) {
+    return wc_mix64(key_hash ^ ((uint64_t)(level + 1) * 0x9e3779b97f4a7c15ULL)) % level_bits;
+}
+
+/*
+ * Operazione di riduzione MPI su coppie (visto una volta, collisione) di parole da 64 bit:
+ * un bit collide se collideva in una delle due parti o se entrambe lo avevano visto.
+ */
+void mphf_bits_union(void* in, void* inout, int* len, MPI_Datatype* datatype) {
+    (void)datatype;
+    const uint64_t* a = (const uint64_t*)in;
+    uint64_t* b = (uint64_t*)inout;
+    for (int i = 0; i < *len; ++i) {
+        uint64_t seen_a = a[2 * i], seen_b = b[2 * i];
+        b[2 * i + 1] |= a[2 * i + 1] | (seen_a & seen_b);
+        b[2 * i] = seen_a | seen_b;
+    }
+}
+
+// Numero di bit a 1 prima della posizione bit
+uint64_t mphf_rank(const uint64_t* bits, const uint64_t* rank_samples, uint64_t bit) {
+    uint64_t word = bit / 64;
+    uint64_t block = word / MPHF_RANK_STRIDE;
+    uint64_t rank = rank_samples[block];
+    for (uint64_t w = block * MPHF_RANK_STRIDE; w < word; ++w) {
+        rank += __builtin_popcountll(bits[w]);
+    }
+    uint64_t below = bit % 64;
+    if (below > 0) {
+        rank += __builtin_popcountll(bits[word] & ((1ULL << below) - 1));
+    }
+    return rank;
+}
+
+/*
+ * Collettiva: a ogni livello ogni rank marca le proprie chiavi ancora libere e una sola MPI_Allreduce con
+ * mphf_bits_union fornisce a tutti i bit del livello; key_bit riceve la posizione del bit di ogni chiave.
+ * Due parole con lo stesso hash collidono a ogni livello: dopo MPHF_MAX_LEVELS restituisce -1 e azzera i livelli.
+ */
+int mphf_build_levels(Mphf* mphf, const uint64_t* hashes, int local_n, uint64_t n, uint64_t* key_bit) {
+    int* pending = (int*)malloc((local_n > 0 ? local_n : 1) * sizeof(int));
+    if (!pending) {
+        perror("Failed to allocate index keys");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Datatype pair_type;
+    MPI_Type_contiguous(2, MPI_UINT64_T, &pair_type);
+    MPI_Type_commit(&pair_type);
+    MPI_Op bits_union;
+    MPI_Op_create(mphf_bits_union, 1, &bits_union);
+
+    int num_pending = local_n;
+    for (int i = 0; i < local_n; ++i) {
+        pending[i] = i;
+    }
+    uint64_t global_pending = n;
+    while (global_pending > 0 && mphf->num_levels < MPHF_MAX_LEVELS) {
+        int level = mphf->num_levels;
+        uint64_t words = (uint64_t)(global_pending * MPHF_GAMMA + 63) / 64;
+        uint64_t level_bits = words * 64;
+        uint64_t* pairs = (uint64_t*)calloc(2 * words, sizeof(uint64_t));
+        if (!pairs) {
+            perror("Failed to allocate index level");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_alloc(MEM_MPI_BUFFER, 2 * words * sizeof(uint64_t));
+        for (int k = 0; k < num_pending; ++k) {
+            uint64_t pos = mphf_level_hash(hashes[pending[k]], level, level_bits);
+            uint64_t mask = 1ULL << (pos % 64);
+            if (pairs[2 * (pos / 64)] & mask) {
+                pairs[2 * (pos / 64) + 1] |= mask;
+            } else {
+                pairs[2 * (pos / 64)] |= mask;
+            }
+        }
+        MPI_Allreduce(MPI_IN_PLACE, pairs, (int)words, pair_type, bits_union, MPI_COMM_WORLD);
+
+        uint64_t* grown = (uint64_t*)realloc(mphf->bits, (mphf->total_words + words) * sizeof(uint64_t));
+        if (!grown) {
+            perror("Failed to grow index bits");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mphf->bits = grown;
+        uint64_t* level_bits_out = mphf->bits + mphf->total_words;
+        for (uint64_t w = 0; w < words; ++w) {
+            level_bits_out[w] = pairs[2 * w] & ~pairs[2 * w + 1];
+        }
+        mem_track_free(MEM_MPI_BUFFER, 2 * words * sizeof(uint64_t));
+        free(pairs);
+
+        int still_pending = 0;
+        for (int k = 0; k < num_pending; ++k) {
+            uint64_t pos = mphf_level_hash(hashes[pending[k]], level, level_bits);
+            if (level_bits_out[pos / 64] & (1ULL << (pos % 64))) {
+                key_bit[pending[k]] = mphf->total_words * 64 + pos;
+            } else {
+                pending[still_pending++] = pending[k];
+            }
+        }
+        num_pending = still_pending;
+        mphf->level_words[level] = words;
+        mphf->total_words += words;
+        mphf->num_levels++;
+        uint64_t local_pending = (uint64_t)num_pending;
+        MPI_Allreduce(&local_pending, &global_pending, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    }
+    MPI_Op_free(&bits_union);
+    MPI_Type_free(&pair_type);
+    free(pending);
+
+    // global_pending è lo stesso su tutti i rank, quindi anche l'esito
+    if (global_pending > 0) {
+        free(mphf->bits);
+        mphf->bits = NULL;
+        mphf->total_words = 0;
+        mphf->num_levels = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Collettiva. Il master distribuisce gli hash delle parole, calcolati con la chiave del seme dell'indice
+ * (all'inizio quello della run), e i livelli si costruiscono con mphf_build_levels. Se non convergono si
+ * riprova con un seme derivato dal precedente, uguale su tutti i rank; dopo MPHF_MAX_ATTEMPTS semi
+ * restituisce -1 senza indice. Alla fine ogni rank calcola lo slot delle proprie chiavi e il master li
+ * raccoglie nell'ordine dell'istogramma.
+ */
+int build_mphf(const Histogram* hist, int rank, int size, Mphf* mphf) {
+    memset(mphf, 0, sizeof(*mphf));
+    int n = rank == 0 ? hist->count : 0;
+    MPI_Bcast(&n, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    mphf->num_keys = (uint64_t)n;
+    mphf->hash_seed = hash_seed;
+
+    int* counts = (int*)malloc(size * sizeof(int));
+    int* displs = (int*)malloc(size * sizeof(int));
+    if (!counts || !displs) {
+        perror("Failed to allocate index partition");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int offset = 0;
+    for (int r = 0; r < size; ++r) {
+        counts[r] = n / size + (r < n % size ? 1 : 0);
+        displs[r] = offset;
+        offset += counts[r];
+    }
+    int local_n = counts[rank];
+    uint64_t* all_hashes = NULL;
+    if (rank == 0) {
+        all_hashes = (uint64_t*)malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+        if (!all_hashes) {
+            perror("Failed to allocate key hashes");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    uint64_t* hashes = (uint64_t*)malloc((local_n > 0 ? local_n : 1) * sizeof(uint64_t));
+    uint64_t* key_bit = (uint64_t*)malloc((local_n > 0 ? local_n : 1) * sizeof(uint64_t));
+    if (!hashes || !key_bit) {
+        perror("Failed to allocate index keys");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    int attempt = 0;
+    while (1) {
+        if (rank == 0) {
+            uint64_t key[2];
+            wc_derive_key(mphf->hash_seed, key);
+            for (int i = 0; i < n; ++i) {
+                all_hashes[i] = hash_word_keyed(hist->items[i].word, key);
+            }
+        }
+        MPI_Scatterv(all_hashes, counts, displs, MPI_UINT64_T, hashes, local_n, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+        if (mphf_build_levels(mphf, hashes, local_n, (uint64_t)n, key_bit) == 0) {
+            break;
+        }
+        if (++attempt == MPHF_MAX_ATTEMPTS) {
+            if (rank == 0) {
+                fprintf(stderr, "Perfect hash construction did not converge with %d seeds (duplicate word hashes?), "
+                        "writing the output without the index\n", MPHF_MAX_ATTEMPTS);
+            }
+            free(all_hashes);
+            free(hashes);
+            free(key_bit);
+            free(counts);
+            free(displs);
+            return -1;
+        }
+        mphf->hash_seed = wc_mix64(mphf->hash_seed + 0x9e3779b97f4a7c15ULL);
+        if (rank == 0) {
+            fprintf(stderr, "Perfect hash construction did not converge, retrying with a new seed\n");
+        }
+    }
+    free(all_hashes);
+
+    uint64_t num_samples = (mphf->total_words + MPHF_RANK_STRIDE - 1) / MPHF_RANK_STRIDE;
+    mphf->rank_samples = (uint64_t*)malloc((num_samples > 0 ? num_samples : 1) * sizeof(uint64_t));
+    if (!mphf->rank_samples) {
+        perror("Failed to allocate rank samples");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    uint64_t running = 0;
+    for (uint64_t w = 0; w < mphf->total_words; ++w) {
+        if (w % MPHF_RANK_STRIDE == 0) {
+            mphf->rank_samples[w / MPHF_RANK_STRIDE] = running;
+        }
+        running += __builtin_popcountll(mphf->bits[w]);
+    }
+
+    uint32_t* local_slots = (uint32_t*)malloc((local_n > 0 ? local_n : 1) * sizeof(uint32_t));
+    if (!local_slots) {
+        perror("Failed to allocate index slots");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < local_n; ++i) {
+        local_slots[i] = (uint32_t)mphf_rank(mphf->bits, mphf->rank_samples, key_bit[i]);
+    }
+    if (rank == 0) {
+        mphf->slots = (uint32_t*)malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+        if (!mphf->slots) {
+            perror("Failed to allocate index slots");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Gatherv(local_slots, local_n, MPI_UINT32_T, mphf->slots, counts, displs, MPI_UINT32_T, 0, MPI_COMM_WORLD);
+
+    free(local_slots);
+    free(hashes);
+    free(key_bit);
+    free(counts);
+    free(displs);
+    return 0;
+}
+
+void free_mphf(Mphf* mphf) {
+    free(mphf->bits);
+    free(mphf->rank_samples);
+    free(mphf->slots);
+    memset(mphf, 0, sizeof(*mphf));
+}
+
+uint64_t read_u64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * Ricerca nell'indice di un file binario mappato in memoria: nessuna struttura viene costruita al caricamento,
+ * bit e campioni di rank si leggono direttamente dalla mappa (l'indice è allineato a 8 byte) e ogni parola
+ * costa un hash per livello visitato, un rank e un confronto con la voce nel payload. Tutte le lunghezze
+ * lette dal file si confrontano con la sua dimensione prima di usarle.
+ */
+void run_index_lookup(const char* index_path, const char* words) {
+    int fd = open(index_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open index %s: %s\n", index_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    size_t file_len = (size_t)st.st_size;
+    const char* map = file_len > 0 ? (const char*)mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map index %s\n", index_path);
+        return;
+    }
+
+    size_t header_len = WC_FILE_MAGIC_LEN + sizeof(uint64_t);
+    size_t index_header_len = 8 + 4 * sizeof(uint64_t);
+    uint64_t payload_len = file_len >= header_len ? read_u64(map + WC_FILE_MAGIC_LEN) : 0;
+    size_t index_start = 0;
+    if (file_len >= header_len && payload_len <= file_len - header_len) {
+        index_start = (header_len + (size_t)payload_len + 7) & ~(size_t)7;
+    }
+    if (file_len < header_len || memcmp(map, WC_FILE_MAGIC, WC_FILE_MAGIC_LEN) != 0 ||
+        index_start == 0 || index_start > file_len || file_len - index_start < index_header_len ||
+        memcmp(map + index_start, MPHF_INDEX_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s has no perfect hash index (write it with --binary-output --mphf)\n", index_path);
+        munmap((void*)map, file_len);
+        return;
+    }
+    const char* payload = map + header_len;
+    const uint64_t* header = (const uint64_t*)(map + index_start + 8);
+    uint64_t num_keys = header[0];
+    uint64_t num_levels = header[1];
+    uint64_t offset_width = header[2];
+    uint64_t seed = header[3];
+    const uint64_t* level_words = header + 4;
+    // Byte del file dopo l'intestazione dell'indice, che ogni sezione consuma dopo averla verificata
+    uint64_t remaining = file_len - index_start - index_header_len;
+
+    int32_t num_entries, has_groups;
+    int valid = wc_serial_get_header(payload, payload_len, &num_entries, &has_groups) == WC_OK &&
+                (num_levels >= 1 || num_keys == 0) && num_levels <= MPHF_MAX_LEVELS && (offset_width == 4 || offset_width == 8) &&
+                num_levels <= remaining / sizeof(uint64_t);
+    uint64_t total_words = 0;
+    if (valid) {
+        remaining -= num_levels * sizeof(uint64_t);
+        for (uint64_t l = 0; valid && l < num_levels; ++l) {
+            valid = level_words[l] > 0 && level_words[l] <= remaining / sizeof(uint64_t) - total_words;
+            total_words += valid ? level_words[l] : 0;
+        }
+    }
+    uint64_t num_samples = (total_words + MPHF_RANK_STRIDE - 1) / MPHF_RANK_STRIDE;
+    valid = valid && num_samples <= remaining / sizeof(uint64_t) - total_words;
+    if (valid) {
+        remaining -= (total_words + num_samples) * sizeof(uint64_t);
+        valid = num_keys <= remaining / offset_width;
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: corrupt perfect hash index\n", index_path);
+        munmap((void*)map, file_len);
+        return;
+    }
+    const uint64_t* bits = level_words + num_levels;
+    const uint64_t* rank_samples = bits + total_words;
+    const char* offsets = (const char*)(rank_samples + num_samples);
+
+    // L'indice è stato costruito con la chiave di un'altra run
+    uint64_t key[2];
+    wc_derive_key(seed, key);
+    printf("Index of %" PRIu64 " words in %s (%d levels)\n", num_keys, index_path, (int)num_levels);
+
+    char* list = strdup(words);
+    if (!list) {
+        perror("Failed to copy lookup words");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int corrupt = 0;
+    for (char* word = strtok(list, ","); word && !corrupt; word = strtok(NULL, ",")) {
+        for (char* c = word; *c; ++c) {
+            *c = wc_fold((unsigned char)*c);
+        }
+        uint64_t h = hash_word_keyed(word, key);
+        uint64_t level_start = 0;
+        int found = 0;
+        for (uint64_t l = 0; l < num_levels; ++l) {
+            uint64_t pos = mphf_level_hash(h, (int)l, level_words[l] * 64);
+            uint64_t bit = level_start * 64 + pos;
+            if (bits[bit / 64] & (1ULL << (bit % 64))) {
+                // Le parole assenti finiscono comunque in uno slot: si verifica la voce
+                uint64_t slot = mphf_rank(bits, rank_samples, bit);
+                uint64_t entry_off = 0;
+                if (slot >= num_keys) {
+                    corrupt = 1;
+                } else if (offset_width == 4) {
+                    uint32_t off32;
+                    memcpy(&off32, offsets + slot * 4, 4);
+                    entry_off = off32;
+                } else {
+                    entry_off = read_u64(offsets + slot * 8);
+                }
+                int32_t freq, group;
+                const char* entry_word;
+                size_t entry_len;
+                if (corrupt || entry_off > payload_len ||
+                    !wc_serial_get_record(payload + entry_off, payload + payload_len, has_groups, &freq, &group,
+                                          &entry_word, &entry_len)) {
+                    corrupt = 1;
+                    break;
+                }
+                if (strcmp(entry_word, word) == 0) {
+                    printf("%s,%d\n", word, freq);
+                    found = 1;
+                }
+                break;
+            }
+            level_start += level_words[l];
+        }
+        if (corrupt) {
+            fprintf(stderr, "%s: corrupt perfect hash index\n", index_path);
+        } else if (!found) {
+            printf("%s,not found\n", word);
+        }
+    }
+    free(list);
+    munmap((void*)map, file_len);
+}
+
+// Generatore splitmix64
+uint64_t sample_next_random(uint64_t* state) {
+    *state += 0x9e3779b97f4a7c15ULL;
+    return wc_mix64(*state);
+}
+
+int compare_sample_entries(const void* a, const void* b) {
+    const SampleEntry* ea = (const SampleEntry*)a;
+    const SampleEntry* eb = (const SampleEntry*)b;
+    int cmp = strncmp(ea->word, eb->word, MAX_WORD_LEN);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (ea->stratum > eb->stratum) - (ea->stratum < eb->stratum);
+}
+
+void init_sample_accumulator(SampleAccumulator* acc) {
+    acc->items = NULL;
+    acc->count = 0;
+    acc->capacity = 0;
+    acc->sorted = 0;
+}
+
+// Le voci si accodano; quando la coda supera la parte ordinata si riordina tutto (costo ammortizzato)
+void sample_accumulator_push(SampleAccumulator* acc, const SampleEntry* entry) {
+    if (acc->count == acc->capacity) {
+        int new_capacity = acc->capacity > 0 ? acc->capacity * 2 : INITIAL_HIST_CAPACITY;
+        SampleEntry* items = (SampleEntry*)realloc(acc->items, (size_t)new_capacity * sizeof(SampleEntry));
+        if (!items) {
+            perror("Failed to grow sample accumulator");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        mem_track_free(MEM_HISTOGRAM, (size_t)acc->capacity * sizeof(SampleEntry));
+        mem_track_alloc(MEM_HISTOGRAM, (size_t)new_capacity * sizeof(SampleEntry));
+        acc->items = items;
+        acc->capacity = new_capacity;
+    }
+    acc->items[acc->count++] = *entry;
+    int pending = acc->count - acc->sorted;
+    if (pending > SAMPLE_COMPACT_MIN && pending > acc->sorted) {
+        sample_accumulator_compact(acc);
+    }
+}
+
+void sample_accumulator_compact(SampleAccumulator* acc) {
+    if (acc->count == acc->sorted) {
+        return;
+    }
+    qsort(acc->items, acc->count, sizeof(SampleEntry), compare_sample_entries);
+    int unique = 0;
+    for (int i = 0; i < acc->count; ++i) {
+        if (unique > 0 && compare_sample_entries(&acc->items[unique - 1], &acc->items[i]) == 0) {
+            acc->items[unique - 1].sum += acc->items[i].sum;
+            acc->items[unique - 1].sumsq += acc->items[i].sumsq;
+        } else {
+            acc->items[unique++] = acc->items[i];
+        }
+    }
+    acc->count = unique;
+    acc->sorted = unique;
+}
+
+void free_sample_accumulator(SampleAccumulator* acc) {
+    mem_track_free(MEM_HISTOGRAM, (size_t)acc->capacity * sizeof(SampleEntry));
+    free(acc->items);
+    init_sample_accumulator(acc);
+}
+
+// pread ripetuta fino a len byte o alla fine del file
+ssize_t pread_full(int fd, char* buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * Conta le parole di un chunk. Una parola a cavallo di due chunk appartiene a quello in cui inizia:
+ * si salta il frammento iniziale se il byte precedente è alfanumerico e si legge oltre la fine
+ * finché l'ultima parola non termina. Ogni parola del chunk diventa una voce (sum = c, sumsq = c^2).
+ */
+void sample_chunk(const SampleChunk* chunk, SamplePass* pass) {
+    const char* filename = pass->file_list[chunk->file_idx];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file %s: %s\n", filename, strerror(errno));
+        return;
+    }
+    off_t offset = (off_t)chunk->chunk_idx * SAMPLE_CHUNK_SIZE;
+    ssize_t len = pread_full(fd, pass->buffer, SAMPLE_CHUNK_SIZE, offset);
+    if (len < 0) {
+        fprintf(stderr, "Error reading file %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return;
+    }
+    size_t start = 0;
+    char prev;
+    if (offset > 0 && pread_full(fd, &prev, 1, offset - 1) == 1 && wc_is_word_char((unsigned char)prev)) {
+        while (start < (size_t)len && wc_is_word_char((unsigned char)pass->buffer[start])) {
+            start++;
+        }
+    }
+
+    Histogram chunk_hist;
+    init_histogram(&chunk_hist);
+    HistogramSink sink = { &chunk_hist, chunk->file_idx, NULL, 0 };
+    Tokenizer tok;
+    tokenizer_init(&tok, histogram_word_handler, &sink);
+    tokenize_block(&tok, pass->buffer + start, (size_t)len - start);
+    off_t tail = offset + len;
+    while (tok.base.len > 0 && len == SAMPLE_CHUNK_SIZE) {
+        char block[SAMPLE_TAIL_BLOCK];
+        ssize_t n = pread_full(fd, block, sizeof(block), tail);
+        if (n <= 0) {
+            break;
+        }
+        ssize_t word_end = 0;
+        while (word_end < n && wc_is_word_char((unsigned char)block[word_end])) {
+            word_end++;
+        }
+        tokenize_block(&tok, block, (size_t)word_end);
+        if (word_end < n) {
+            break;
+        }
+        tail += n;
+    }
+    tokenizer_finish(&tok);
+    close(fd);
+
+    for (int i = 0; i < chunk_hist.count; ++i) {
+        SampleEntry entry;
+        strcpy(entry.word, chunk_hist.items[i].word);
+        entry.stratum = chunk->file_idx;
+        entry.sum = (uint64_t)chunk_hist.items[i].frequency;
+        entry.sumsq = entry.sum * entry.sum;
+        sample_accumulator_push(pass->acc, &entry);
+    }
+    free_histogram_content(&chunk_hist);
+}
+
+// Come run_file_tasks, ma i task sono chunk: il master li distribuisce su richiesta
+void run_sample_chunks(const SampleChunk* chunks, int num_chunks, int rank, int size, SamplePass* pass) {
+    MPI_Status status;
+
+    if (rank == 0) {
+        if (size == 1) {
+            for (int i = 0; i < num_chunks; ++i) {
+                sample_chunk(&chunks[i], pass);
+            }
+            return;
+        }
+        int next_chunk = 0;
+        int active_workers = 0;
+        for (int worker_rank = 1; worker_rank < size; ++worker_rank) {
+            if (next_chunk < num_chunks) {
+                MPI_Send(&chunks[next_chunk++], sizeof(SampleChunk), MPI_BYTE, worker_rank, TAG_PASS_TASK, MPI_COMM_WORLD);
+                active_workers++;
+            } else {
+                MPI_Send(NULL, 0, MPI_BYTE, worker_rank, TAG_PASS_DONE, MPI_COMM_WORLD);
+            }
+        }
+        while (active_workers > 0) {
+            int dummy_ack;
+            MPI_Recv(&dummy_ack, 1, MPI_INT, MPI_ANY_SOURCE, TAG_PASS_ACK, MPI_COMM_WORLD, &status);
+            if (next_chunk < num_chunks) {
+                MPI_Send(&chunks[next_chunk++], sizeof(SampleChunk), MPI_BYTE, status.MPI_SOURCE, TAG_PASS_TASK, MPI_COMM_WORLD);
+            } else {
+                MPI_Send(NULL, 0, MPI_BYTE, status.MPI_SOURCE, TAG_PASS_DONE, MPI_COMM_WORLD);
+                active_workers--;
+            }
+        }
+    } else {
+        while (1) {
+            SampleChunk chunk;
+            MPI_Recv(&chunk, sizeof(SampleChunk), MPI_BYTE, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            if (status.MPI_TAG == TAG_PASS_DONE) {
+                break;
+            }
+            sample_chunk(&chunk, pass);
+            int dummy_ack = rank;
+            MPI_Send(&dummy_ack, 1, MPI_INT, 0, TAG_PASS_ACK, MPI_COMM_WORLD);
+        }
+    }
+}
+
+// Chunk campionati di un file dopo round round: ceil(fraction * chunks) per round, almeno SAMPLE_MIN_CHUNKS
+int64_t sampled_chunks_target(int64_t chunks, double fraction, int round) {
+    int64_t per_round = (int64_t)(fraction * (double)chunks);
+    if ((double)per_round < fraction * (double)chunks) {
+        per_round++;
+    }
+    if (per_round < SAMPLE_MIN_CHUNKS) {
+        per_round = SAMPLE_MIN_CHUNKS;
+    }
+    int64_t target = per_round * round;
+    return target < chunks ? target : chunks;
+}
+
+/*
+ * Stimatore stratificato del totale di ogni parola posseduta: per strato N * media, con varianza
+ * N^2 * (1 - n/N) * s^2 / n (campionamento senza reinserimento). L'intervallo al 95% non scende
+ * sotto le occorrenze effettivamente osservate.
+ */
+SampleEstimate* estimate_sampled_words(const SampleAccumulator* owned, const int64_t* file_chunks,
+                                       const int64_t* sampled, int* out_count) {
+    SampleEstimate* estimates = (SampleEstimate*)malloc((owned->count > 0 ? owned->count : 1) * sizeof(SampleEstimate));
+    if (!estimates) {
+        perror("Failed to allocate sample estimates");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int n = 0;
+    int i = 0;
+    while (i < owned->count) {
+        double total = 0.0, variance = 0.0;
+        uint64_t observed = 0;
+        int j = i;
+        for (; j < owned->count && strncmp(owned->items[j].word, owned->items[i].word, MAX_WORD_LEN) == 0; ++j) {
+            const SampleEntry* e = &owned->items[j];
+            double strata_chunks = (double)file_chunks[e->stratum];
+            double drawn = (double)sampled[e->stratum];
+            double mean = (double)e->sum / drawn;
+            total += strata_chunks * mean;
+            observed += e->sum;
+            if (drawn > 1.0 && drawn < strata_chunks) {
+                double s2 = ((double)e->sumsq - drawn * mean * mean) / (drawn - 1.0);
+                if (s2 > 0.0) {
+                    variance += strata_chunks * strata_chunks * (1.0 - drawn / strata_chunks) * s2 / drawn;
+                }
+            }
+        }
+        double half_width = SAMPLE_Z_95 * sqrt(variance);
+        SampleEstimate* est = &estimates[n++];
+        strcpy(est->word, owned->items[i].word);
+        est->estimate = total;
+        est->ci_low = total - half_width > (double)observed ? total - half_width : (double)observed;
+        est->ci_high = total + half_width;
+        i = j;
+    }
+    *out_count = n;
+    return estimates;
+}
+
+// Stima decrescente, a parità ordine alfabetico
+int compare_sample_estimates(const void* a, const void* b) {
+    const SampleEstimate* ea = (const SampleEstimate*)a;
+    const SampleEstimate* eb = (const SampleEstimate*)b;
+    if (ea->estimate != eb->estimate) {
+        return ea->estimate < eb->estimate ? 1 : -1;
+    }
+    return strncmp(ea->word, eb->word, MAX_WORD_LEN);
+}
+
+int compare_sample_estimates_by_word(const void* a, const void* b) {
+    return strncmp(((const SampleEstimate*)a)->word, ((const SampleEstimate*)b)->word, MAX_WORD_LEN);
+}
+
+void write_sample_estimates(const SampleEstimate* estimates, int count, const char* path) {
+    FILE* fp = fopen(output_path(path), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+        return;
+    }
+    fprintf(fp, "word,estimate,ci95_low,ci95_high\n");
+    for (int i = 0; i < count; ++i) {
+        fprintf(fp, "%s,%.2f,%.2f,%.2f\n", estimates[i].word, estimates[i].estimate,
+                estimates[i].ci_low, estimates[i].ci_high);
+    }
+    fclose(fp);
+}
+
+/*
+ * Modalità a campionamento: ogni file è uno strato diviso in chunk da SAMPLE_CHUNK_SIZE byte. Il master
+ * estrae i chunk in ordine casuale (permutazione per file con il seme di --sample-seed) e li distribuisce;
+ * le somme per (parola, strato) vengono partizionate per hash tra i rank, che stimano totali e intervalli
+ * di confidenza delle proprie parole. Con --stable-top-k si aggiungono round finché la classifica delle
+ * prime K parole resta invariata o il corpus è esaurito.
+ */
+void run_sampled_count(char file_list[][MAX_FILENAME_LEN], int total_files, const Options* opts, int rank, int size) {
+    MPI_Bcast(&total_files, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(file_list, total_files * MAX_FILENAME_LEN, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    int64_t* file_chunks = (int64_t*)calloc(total_files > 0 ? total_files : 1, sizeof(int64_t));
+    int64_t* sampled = (int64_t*)calloc(total_files > 0 ? total_files : 1, sizeof(int64_t));
+    int32_t** order = (int32_t**)calloc(total_files > 0 ? total_files : 1, sizeof(int32_t*));
+    char* buffer = (char*)malloc(SAMPLE_CHUNK_SIZE);
+    if (!file_chunks || !sampled || !order || !buffer) {
+        perror("Failed to allocate sampling plan");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_IO_BUFFER, SAMPLE_CHUNK_SIZE);
+
+    int64_t corpus_chunks = 0;
+    if (rank == 0) {
+        uint64_t rng = opts->sample_seed;
+        for (int f = 0; f < total_files; ++f) {
+            struct stat st;
+            if (stat(file_list[f], &st) != 0) {
+                fprintf(stderr, "Error opening file %s: %s\n", file_list[f], strerror(errno));
+                continue;
+            }
+            file_chunks[f] = ((int64_t)st.st_size + SAMPLE_CHUNK_SIZE - 1) / SAMPLE_CHUNK_SIZE;
+            if (file_chunks[f] > INT32_MAX) {
+                fprintf(stderr, "File %s is too large to sample\n", file_list[f]);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            corpus_chunks += file_chunks[f];
+            // Fisher-Yates: l'ordine di estrazione dei chunk del file
+            order[f] = (int32_t*)malloc((file_chunks[f] > 0 ? file_chunks[f] : 1) * sizeof(int32_t));
+            if (!order[f]) {
+                perror("Failed to allocate chunk order");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            for (int32_t c = 0; c < file_chunks[f]; ++c) {
+                order[f][c] = c;
+            }
+            for (int64_t c = file_chunks[f] - 1; c > 0; --c) {
+                int64_t other = (int64_t)(sample_next_random(&rng) % (uint64_t)(c + 1));
+                int32_t tmp = order[f][c];
+                order[f][c] = order[f][other];
+                order[f][other] = tmp;
+            }
+        }
+        printf("Master: Sampling %.4g of the %" PRId64 " chunks (%d bytes each) of every file, seed %" PRIu64 "\n",
+               opts->sample_fraction, corpus_chunks, SAMPLE_CHUNK_SIZE, opts->sample_seed);
+    }
+    MPI_Bcast(file_chunks, total_files, MPI_INT64_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&corpus_chunks, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+
+    SampleAccumulator local, owned;
+    init_sample_accumulator(&local);
+    init_sample_accumulator(&owned);
+    SamplePass pass = { file_list, &local, buffer };
+    int top_k = opts->stable_top_k;
+    char (*prev_top)[MAX_WORD_LEN] = NULL;
+    int prev_top_count = -1;
+    if (rank == 0 && top_k > 0) {
+        prev_top = (char (*)[MAX_WORD_LEN])malloc((size_t)top_k * MAX_WORD_LEN);
+        if (!prev_top) {
+            perror("Failed to allocate top-K ranking");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    MPI_Datatype estimate_type;
+    MPI_Type_contiguous(sizeof(SampleEstimate), MPI_BYTE, &estimate_type);
+    MPI_Type_commit(&estimate_type);
+    SampleEstimate* all = NULL;
+    int total = 0;
+    int round = 0;
+    int64_t drawn_chunks = 0;
+    int keep_sampling = 1;
+    int stable = 0;
+    while (keep_sampling) {
+        round++;
+        // Chunk del round: per ogni file i successivi della permutazione fino al nuovo obiettivo
+        SampleChunk* chunks = NULL;
+        int num_chunks = 0;
+        int64_t round_chunks = 0;
+        for (int f = 0; f < total_files; ++f) {
+            round_chunks += sampled_chunks_target(file_chunks[f], opts->sample_fraction, round) - sampled[f];
+        }
+        if (rank == 0) {
+            chunks = (SampleChunk*)malloc((round_chunks > 0 ? round_chunks : 1) * sizeof(SampleChunk));
+            if (!chunks) {
+                perror("Failed to allocate sampled chunks");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        for (int f = 0; f < total_files; ++f) {
+            int64_t target = sampled_chunks_target(file_chunks[f], opts->sample_fraction, round);
+            if (rank == 0) {
+                for (int64_t c = sampled[f]; c < target; ++c) {
+                    chunks[num_chunks].file_idx = f;
+                    chunks[num_chunks].chunk_idx = order[f][c];
+                    num_chunks++;
+                }
+            }
+            sampled[f] = target;
+        }
+        drawn_chunks += round_chunks;
+        run_sample_chunks(chunks, num_chunks, rank, size, &pass);
+        free(chunks);
+
+        // Le somme del round passano al rank che possiede la parola e si sommano a quelle dei round precedenti
+        sample_accumulator_compact(&local);
+        int* owner = (int*)malloc((local.count > 0 ? local.count : 1) * sizeof(int));
+        if (!owner) {
+            perror("Failed to allocate word owners");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        for (int i = 0; i < local.count; ++i) {
+            owner[i] = (int)(hash_word(local.items[i].word) % size);
+        }
+        int received;
+        SampleEntry* entries = (SampleEntry*)alltoall_by_owner(local.items, local.count, sizeof(SampleEntry),
+                                                               owner, size, &received);
+        free(owner);
+        local.count = 0;
+        local.sorted = 0;
+        for (int i = 0; i < received; ++i) {
+            sample_accumulator_push(&owned, &entries[i]);
+        }
+        free(entries);
+        sample_accumulator_compact(&owned);
+
+        int local_count;
+        SampleEstimate* estimates = estimate_sampled_words(&owned, file_chunks, sampled, &local_count);
+        int* counts = NULL;
+        int* displs = NULL;
+        if (rank == 0) {
+            counts = (int*)malloc(size * sizeof(int));
+            displs = (int*)malloc(size * sizeof(int));
+            if (!counts || !displs) {
+                perror("Failed to allocate estimate gather counts");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        MPI_Gather(&local_count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            if (all) {
+                mem_track_free(MEM_MPI_BUFFER, (size_t)total * sizeof(SampleEstimate));
+                free(all);
+            }
+            total = 0;
+            for (int r = 0; r < size; ++r) {
+                displs[r] = total;
+                total += counts[r];
+            }
+            all = (SampleEstimate*)malloc((total > 0 ? total : 1) * sizeof(SampleEstimate));
+            if (!all) {
+                perror("Failed to allocate sample estimates");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            mem_track_alloc(MEM_MPI_BUFFER, (size_t)total * sizeof(SampleEstimate));
+        }
+        MPI_Gatherv(estimates, local_count, estimate_type, all, counts, displs, estimate_type, 0, MPI_COMM_WORLD);
+        free(estimates);
+
+        if (rank == 0) {
+            free(counts);
+            free(displs);
+            qsort(all, total, sizeof(SampleEstimate), compare_sample_estimates);
+            printf("Master: Round %d: %" PRId64 " of %" PRId64 " chunks sampled, %d distinct words\n",
+                   round, drawn_chunks, corpus_chunks, total);
+            keep_sampling = 0;
+            if (top_k > 0) {
+                int top_count = total < top_k ? total : top_k;
+                stable = top_count == prev_top_count;
+                for (int i = 0; stable && i < top_count; ++i) {
+                    stable = strcmp(prev_top[i], all[i].word) == 0;
+                }
+                for (int i = 0; i < top_count; ++i) {
+                    strcpy(prev_top[i], all[i].word);
+                }
+                prev_top_count = top_count;
+                keep_sampling = !stable && drawn_chunks < corpus_chunks;
+            }
+        }
+        MPI_Bcast(&keep_sampling, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    MPI_Type_free(&estimate_type);
+
+    if (rank == 0) {
+        if (top_k > 0) {
+            if (stable) {
+                printf("Master: Top-%d ranking stable after %d rounds\n", top_k, round);
+            } else if (round == 1) {
+                // Il primo round ha già letto tutti i chunk: non c'era nulla da stimare né da confrontare
+                printf("Master: The first round sampled the whole corpus, the counts are exact\n");
+            } else {
+                printf("Master: Corpus exhausted before the top-%d ranking stabilized\n", top_k);
+            }
+        }
+        if (opts->sort_order == SORT_BY_WORD) {
+            qsort(all, total, sizeof(SampleEstimate), compare_sample_estimates_by_word);
+        }
+        write_sample_estimates(all, total, "word_estimates.csv");
+        printf("Master: Estimated counts of %d words written to word_estimates.csv\n", total);
+        mem_track_free(MEM_MPI_BUFFER, (size_t)total * sizeof(SampleEstimate));
+        free(all);
+        free(prev_top);
+        for (int f = 0; f < total_files; ++f) {
+            free(order[f]);
+        }
+    }
+    free_sample_accumulator(&local);
+    free_sample_accumulator(&owned);
+    mem_track_free(MEM_IO_BUFFER, SAMPLE_CHUNK_SIZE);
+    free(buffer);
+    free(order);
+    free(sampled);
+    free(file_chunks);
+}
+
+// Le funzioni hash della firma derivano dalla chiave della run, uguale su tutti i rank
+uint64_t minhash_function_seed(int i) {
+    return wc_mix64(hash_key[0] + (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+void minhash_add_shingle(MinHashScanner* scanner) {
+    uint64_t shingle = 0;
+    int n = scanner->recent_count < DEDUP_SHINGLE_WORDS ? scanner->recent_count : DEDUP_SHINGLE_WORDS;
+    // Le parole si combinano in ordine, dalla più vecchia alla più recente
+    for (int k = n; k > 0; --k) {
+        shingle = wc_mix64(shingle ^ scanner->recent[(scanner->recent_count - k) % DEDUP_SHINGLE_WORDS]);
+    }
+    for (int i = 0; i < MINHASH_NUM_HASHES; ++i) {
+        uint64_t h = wc_mix64(shingle ^ minhash_function_seed(i));
+        if (h < scanner->signature[i]) {
+            scanner->signature[i] = h;
+        }
+    }
+}
+
+void minhash_word_handler(void* ctx, const char* word) {
+    MinHashScanner* scanner = (MinHashScanner*)ctx;
+    scanner->recent[scanner->recent_count % DEDUP_SHINGLE_WORDS] = hash_word(word);
+    scanner->recent_count++;
+    scanner->words++;
+    if (scanner->recent_count >= DEDUP_SHINGLE_WORDS) {
+        minhash_add_shingle(scanner);
+    }
+}
+
+void minhash_file(const char* filename, void* ctx) {
+    DedupPass* pass = (DedupPass*)ctx;
+    int file_idx = -1;
+    for (int i = 0; i < pass->total_files && file_idx < 0; ++i) {
+        if (strcmp(pass->file_list[i], filename) == 0) {
+            file_idx = i;
+        }
+    }
+    if (file_idx < 0) {
+        return;
+    }
+    MinHashScanner scanner;
+    scanner.signature = &pass->signatures[(size_t)file_idx * MINHASH_NUM_HASHES];
+    scanner.recent_count = 0;
+    scanner.words = 0;
+    Tokenizer tok;
+    tokenizer_init(&tok, minhash_word_handler, &scanner);
+    if (scan_file(filename, pass->opts->read_mode, tokenize_block, &tok) != 0) {
+        return;
+    }
+    tokenizer_finish(&tok);
+    // Un documento più corto di uno shingle ha un solo shingle con tutte le sue parole
+    if (scanner.words > 0 && scanner.recent_count < DEDUP_SHINGLE_WORDS) {
+        minhash_add_shingle(&scanner);
+    }
+}
+
+// Frazione di minimi uguali: stima della somiglianza di Jaccard tra gli insiemi di shingle
+double signature_similarity(const uint64_t* a, const uint64_t* b) {
+    int equal = 0;
+    for (int i = 0; i < MINHASH_NUM_HASHES; ++i) {
+        equal += a[i] == b[i];
+    }
+    return (double)equal / MINHASH_NUM_HASHES;
+}
+
+int compare_lsh_entries(const void* a, const void* b) {
+    const LshEntry* ea = (const LshEntry*)a;
+    const LshEntry* eb = (const LshEntry*)b;
+    if (ea->bucket != eb->bucket) {
+        return ea->bucket < eb->bucket ? -1 : 1;
+    }
+    if (ea->band != eb->band) {
+        return ea->band < eb->band ? -1 : 1;
+    }
+    return (ea->file_idx > eb->file_idx) - (ea->file_idx < eb->file_idx);
+}
+
+/*
+ * Deduplicazione prima del conteggio. Un primo passo calcola la firma MinHash di ogni file (i file si
+ * distribuiscono come negli altri passi ausiliari) e le firme si combinano con un MPI_Allreduce MIN.
+ * Ogni banda della firma finisce in un bucket LSH il cui proprietario è scelto per hash; ogni rank
+ * confronta le coppie dei propri bucket e il master scorre il filelist in ordine: un file si salta se è
+ * simile ad almeno un file già tenuto, altrimenti si tiene. Ogni file saltato supera la soglia rispetto al
+ * file indicato come suo originale, anche quando gli altri file simili sono a loro volta saltati.
+ * Restituisce (sul master) il numero di file rimasti.
+ */
+int run_dedup(char file_list[][MAX_FILENAME_LEN], int total_files, CorpusGroups* groups, const Options* opts,
+              int rank, int size) {
+    MPI_Bcast(&total_files, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(file_list, total_files * MAX_FILENAME_LEN, MPI_CHAR, 0, MPI_COMM_WORLD);
+    size_t sig_len = (size_t)total_files * MINHASH_NUM_HASHES;
+    uint64_t* signatures = (uint64_t*)malloc((sig_len > 0 ? sig_len : 1) * sizeof(uint64_t));
+    if (!signatures) {
+        perror("Failed to allocate MinHash signatures");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    mem_track_alloc(MEM_HISTOGRAM, sig_len * sizeof(uint64_t));
+    for (size_t i = 0; i < sig_len; ++i) {
+        signatures[i] = UINT64_MAX;
+    }
+    DedupPass pass = { file_list, total_files, signatures, opts };
+    run_file_tasks(file_list, total_files, rank, size, minhash_file, &pass);
+    MPI_Allreduce(MPI_IN_PLACE, signatures, (int)sig_len, MPI_UINT64_T, MPI_MIN, MPI_COMM_WORLD);
+
+    // Ogni rank calcola i bucket di una parte dei file; i file vuoti non hanno firma e non partecipano
+    int max_entries = ((total_files + size - 1) / size) * MINHASH_BANDS;
+    LshEntry* entries = (LshEntry*)malloc((max_entries > 0 ? max_entries : 1) * sizeof(LshEntry));
+    int* owner = (int*)malloc((max_entries > 0 ? max_entries : 1) * sizeof(int));
+    if (!entries || !owner) {
+        perror("Failed to allocate LSH buckets");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    int num_entries = 0;
+    for (int f = rank; f < total_files; f += size) {
+        const uint64_t* sig = &signatures[(size_t)f * MINHASH_NUM_HASHES];
+        if (sig[0] == UINT64_MAX) {
+            continue;
+        }
+        for (int b = 0; b < MINHASH_BANDS; ++b) {
+            LshEntry* e = &entries[num_entries];
+            e->band = b;
+            e->file_idx = f;
+            e->bucket = wc_siphash13(&sig[b * MINHASH_ROWS], MINHASH_ROWS * sizeof(uint64_t),
+                                  hash_key[0] + (uint64_t)b, hash_key[1]);
+            owner[num_entries++] = (int)(e->bucket % size);
+        }
+    }
+    int received;
+    LshEntry* buckets = (LshEntry*)alltoall_by_owner(entries, num_entries, sizeof(LshEntry), owner, size, &received);
+    free(entries);
+    free(owner);
+
+    // Coppie candidate: file nello stesso bucket della stessa banda, confermate dalla firma completa
+    qsort(buckets, received, sizeof(LshEntry), compare_lsh_entries);
+    int pair_capacity = INITIAL_HIST_CAPACITY;
+    int num_pairs = 0;
+    DuplicatePair* pairs = (DuplicatePair*)malloc(pair_capacity * sizeof(DuplicatePair));
+    if (!pairs) {
+        perror("Failed to allocate duplicate pairs");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < received; ) {
+        int j = i + 1;
+        while (j < received && buckets[j].bucket == buckets[i].bucket && buckets[j].band == buckets[i].band) {
+            j++;
+        }
+        for (int a = i; a < j; ++a) {
+            for (int b = a + 1; b < j; ++b) {
+                int fa = buckets[a].file_idx, fb = buckets[b].file_idx;
+                if (signature_similarity(&signatures[(size_t)fa * MINHASH_NUM_HASHES],
+                                         &signatures[(size_t)fb * MINHASH_NUM_HASHES]) < opts->dedup_threshold) {
+                    continue;
+                }
+                if (num_pairs == pair_capacity) {
+                    pair_capacity *= 2;
+                    DuplicatePair* grown = (DuplicatePair*)realloc(pairs, pair_capacity * sizeof(DuplicatePair));
+                    if (!grown) {
+                        perror("Failed to grow duplicate pairs");
+                        MPI_Abort(MPI_COMM_WORLD, 1);
+                    }
+                    pairs = grown;
+                }
+                pairs[num_pairs].file_a = fa;
+                pairs[num_pairs].file_b = fb;
+                num_pairs++;
+            }
+        }
+        i = j;
+    }
+    free(buckets);
+
+    MPI_Datatype pair_type;
+    MPI_Type_contiguous(sizeof(DuplicatePair), MPI_BYTE, &pair_type);
+    MPI_Type_commit(&pair_type);
+    int* counts = NULL;
+    int* displs = NULL;
+    DuplicatePair* all_pairs = NULL;
+    int total_pairs = 0;
+    if (rank == 0) {
+        counts = (int*)malloc(size * sizeof(int));
+        displs = (int*)malloc(size * sizeof(int));
+        if (!counts || !displs) {
+            perror("Failed to allocate duplicate gather counts");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Gather(&num_pairs, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < size; ++r) {
+            displs[r] = total_pairs;
+            total_pairs += counts[r];
+        }
+        all_pairs = (DuplicatePair*)malloc((total_pairs > 0 ? total_pairs : 1) * sizeof(DuplicatePair));
+        if (!all_pairs) {
+            perror("Failed to allocate duplicate pairs");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Gatherv(pairs, num_pairs, pair_type, all_pairs, counts, displs, pair_type, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&pair_type);
+    free(pairs);
+
+    int kept = total_files;
+    if (rank == 0) {
+        // Le coppie confermate dalla firma diventano una matrice di adiacenza tra i file
+        char similar[MAX_FILES][MAX_FILES];
+        memset(similar, 0, sizeof(similar));
+        for (int i = 0; i < total_pairs; ++i) {
+            similar[all_pairs[i].file_a][all_pairs[i].file_b] = 1;
+            similar[all_pairs[i].file_b][all_pairs[i].file_a] = 1;
+        }
+        // Lo stesso percorso elencato due volte è un duplicato esatto
+        for (int f = 0; f < total_files; ++f) {
+            for (int g = 0; g < f; ++g) {
+                if (strcmp(file_list[f], file_list[g]) == 0) {
+                    similar[f][g] = 1;
+                    memcpy(&signatures[(size_t)f * MINHASH_NUM_HASHES], &signatures[(size_t)g * MINHASH_NUM_HASHES],
+                           MINHASH_NUM_HASHES * sizeof(uint64_t));
+                    break;
+                }
+            }
+        }
+
+        // Un file saltato rimanda al file tenuto più simile; -1 se il file si tiene
+        int duplicate_of[MAX_FILES];
+        double duplicate_similarity[MAX_FILES];
+        for (int f = 0; f < total_files; ++f) {
+            duplicate_of[f] = -1;
+            for (int g = 0; g < f; ++g) {
+                if (duplicate_of[g] >= 0 || !similar[f][g]) {
+                    continue;
+                }
+                double sim = signature_similarity(&signatures[(size_t)f * MINHASH_NUM_HASHES],
+                                                  &signatures[(size_t)g * MINHASH_NUM_HASHES]);
+                if (duplicate_of[f] < 0 || sim > duplicate_similarity[f]) {
+                    duplicate_of[f] = g;
+                    duplicate_similarity[f] = sim;
+                }
+            }
+        }
+
+        FILE* fp = fopen(output_path("dedup_report.csv"), "w");
+        if (!fp) {
+            perror("Errore nell'apertura del file CSV per la scrittura");
+        } else {
+            fprintf(fp, "file,duplicate_of,similarity\n");
+            for (int f = 0; f < total_files; ++f) {
+                if (duplicate_of[f] >= 0) {
+                    fprintf(fp, "%s,%s,%.4f\n", file_list[f], file_list[duplicate_of[f]], duplicate_similarity[f]);
+                }
+            }
+            fclose(fp);
+        }
+        // Il report usa gli indici originali: il filelist si compatta solo dopo averlo scritto
+        kept = 0;
+        for (int f = 0; f < total_files; ++f) {
+            if (duplicate_of[f] >= 0) {
+                continue;
+            }
+            if (kept != f) {
+                strcpy(file_list[kept], file_list[f]);
+                groups->file_group[kept] = groups->file_group[f];
+            }
+            kept++;
+        }
+        printf("Master: Skipping %d near-duplicate files (estimated Jaccard >= %.2f), see dedup_report.csv\n",
+               total_files - kept, opts->dedup_threshold);
+        free(all_pairs);
+        free(counts);
+        free(displs);
+    }
+    mem_track_free(MEM_HISTOGRAM, sig_len * sizeof(uint64_t));
+    free(signatures);
+    return kept;
+}
+
+// Percorso di un file di output nella directory del job; il buffer viene riusato alla chiamata successiva
+const char* output_path(const char* name) {
+    static char path[2 * MAX_FILENAME_LEN];
+    if (!output_dir[0]) {
+        return name;
+    }
+    snprintf(path, sizeof(path), "%s/%s", output_dir, name);
+    return path;
+}
+
+void option_error(const char* format, ...) {
+    if (options_quiet) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int parse_int_value(const char* name, const char* value, int min_value, int* out) {
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || parsed < min_value || parsed > INT32_MAX) {
+        option_error("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+    *out = (int)parsed;
+    return 0;
+}
+
+int parse_options(int argc, char* argv[], Options* opts) {
+    opts->read_mode = READ_MODE_BUFFERED;
+    opts->sort_order = SORT_BY_WORD;
+    opts->flush_threshold = 0;
+    opts->min_count = 0;
+    opts->bloom_counters = DEFAULT_BLOOM_COUNTERS;
+    opts->dictionary_path[0] = '\0';
+    opts->cooccurrence_window = 0;
+    opts->char_histogram = CHAR_HISTOGRAM_NONE;
+    opts->binary_output = 0;
+    opts->merge_saved = 0;
+    opts->diff_filelist[0] = '\0';
+    opts->mphf_index = 0;
+    opts->lookup_words = NULL;
+    opts->sample_fraction = 0.0;
+    opts->sample_seed = (uint64_t)time(NULL);
+    opts->stable_top_k = 0;
+    opts->hash_seed = 0;
+    opts->hash_seed_set = 0;
+    opts->dedup_threshold = 0.0;
+    opts->output_dir[0] = '\0';
+    opts->jobs_path[0] = '\0';
+    strcpy(opts->filelist_path, "filelist.txt");
+    opts->spawn_workers = 0;
+    opts->spawn_after = 0.0;
+    opts->progress_thread = 0;
+    opts->program_path = argv[0];
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--read-mode=", 12) == 0) {
+            const char* mode = argv[i] + 12;
+            if (strcmp(mode, "buffered") == 0) {
+                opts->read_mode = READ_MODE_BUFFERED;
+            } else if (strcmp(mode, "direct") == 0) {
+                opts->read_mode = READ_MODE_DIRECT;
+            } else if (strcmp(mode, "nocache") == 0) {
+                opts->read_mode = READ_MODE_NOCACHE;
+            } else {
+                option_error("Unknown read mode: %s (expected buffered, direct or nocache)\n", mode);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--sort=", 7) == 0) {
+            const char* order = argv[i] + 7;
+            if (strcmp(order, "word") == 0) {
+                opts->sort_order = SORT_BY_WORD;
+            } else if (strcmp(order, "frequency") == 0) {
+                opts->sort_order = SORT_BY_FREQUENCY;
+            } else {
+                option_error("Unknown sort order: %s (expected word or frequency)\n", order);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--flush-threshold=", 18) == 0) {
+            if (parse_int_value("--flush-threshold", argv[i] + 18, 0, &opts->flush_threshold) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--min-count=", 12) == 0) {
+            if (parse_int_value("--min-count", argv[i] + 12, 0, &opts->min_count) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--bloom-counters=", 17) == 0) {
+            if (parse_int_value("--bloom-counters", argv[i] + 17, 1, &opts->bloom_counters) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--dictionary=", 13) == 0) {
+            if (strlen(argv[i] + 13) >= MAX_FILENAME_LEN) {
+                option_error("Dictionary path too long: %s\n", argv[i] + 13);
+                return -1;
+            }
+            strcpy(opts->dictionary_path, argv[i] + 13);
+        } else if (strncmp(argv[i], "--cooccurrence-window=", 22) == 0) {
+            if (parse_int_value("--cooccurrence-window", argv[i] + 22, 1, &opts->cooccurrence_window) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--char-histogram=", 17) == 0) {
+            const char* mode = argv[i] + 17;
+            if (strcmp(mode, "bytes") == 0) {
+                opts->char_histogram = CHAR_HISTOGRAM_BYTES;
+            } else if (strcmp(mode, "utf8") == 0) {
+                opts->char_histogram = CHAR_HISTOGRAM_UTF8;
+            } else {
+                option_error("Unknown character histogram: %s (expected bytes or utf8)\n", mode);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--binary-output") == 0) {
+            opts->binary_output = 1;
+        } else if (strcmp(argv[i], "--mphf") == 0) {
+            opts->mphf_index = 1;
+            opts->binary_output = 1;
+        } else if (strncmp(argv[i], "--lookup=", 9) == 0) {
+            opts->lookup_words = argv[i] + 9;
+        } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            char* end;
+            errno = 0;
+            opts->sample_fraction = strtod(argv[i] + 9, &end);
+            if (errno != 0 || end == argv[i] + 9 || *end != '\0' ||
+                !(opts->sample_fraction > 0.0 && opts->sample_fraction <= 1.0)) {
+                option_error("Invalid value for --sample: %s (expected a fraction in (0, 1])\n", argv[i] + 9);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--sample-seed=", 14) == 0) {
+            char* end;
+            errno = 0;
+            unsigned long long seed = strtoull(argv[i] + 14, &end, 10);
+            if (errno != 0 || end == argv[i] + 14 || *end != '\0') {
+                option_error("Invalid value for --sample-seed: %s\n", argv[i] + 14);
+                return -1;
+            }
+            opts->sample_seed = (uint64_t)seed;
+        } else if (strncmp(argv[i], "--stable-top-k=", 15) == 0) {
+            if (parse_int_value("--stable-top-k", argv[i] + 15, 1, &opts->stable_top_k) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--spawn-workers=", 16) == 0) {
+            if (parse_int_value("--spawn-workers", argv[i] + 16, 1, &opts->spawn_workers) != 0) {
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--spawn-after=", 14) == 0) {
+            char* end;
+            errno = 0;
+            opts->spawn_after = strtod(argv[i] + 14, &end);
+            if (errno != 0 || end == argv[i] + 14 || *end != '\0' || !(opts->spawn_after >= 0.0)) {
+                option_error("Invalid value for --spawn-after: %s\n", argv[i] + 14);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--output-dir=", 13) == 0) {
+            if (strlen(argv[i] + 13) >= MAX_FILENAME_LEN) {
+                option_error("Output directory too long: %s\n", argv[i] + 13);
+                return -1;
+            }
+            strcpy(opts->output_dir, argv[i] + 13);
+        } else if (strncmp(argv[i], "--filelist=", 11) == 0) {
+            if (strlen(argv[i] + 11) == 0 || strlen(argv[i] + 11) >= MAX_FILENAME_LEN) {
+                option_error("Invalid --filelist file: %s\n", argv[i] + 11);
+                return -1;
+            }
+            strcpy(opts->filelist_path, argv[i] + 11);
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            if (strlen(argv[i] + 7) == 0 || strlen(argv[i] + 7) >= MAX_FILENAME_LEN) {
+                option_error("Invalid --jobs file: %s\n", argv[i] + 7);
+                return -1;
+            }
+            strcpy(opts->jobs_path, argv[i] + 7);
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            opts->dedup_threshold = DEFAULT_DEDUP_THRESHOLD;
+        } else if (strncmp(argv[i], "--dedup=", 8) == 0) {
+            char* end;
+            errno = 0;
+            opts->dedup_threshold = strtod(argv[i] + 8, &end);
+            if (errno != 0 || end == argv[i] + 8 || *end != '\0' ||
+                !(opts->dedup_threshold > 0.0 && opts->dedup_threshold <= 1.0)) {
+                option_error("Invalid value for --dedup: %s (expected a similarity in (0, 1])\n", argv[i] + 8);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "--hash-seed=", 12) == 0) {
+            char* end;
+            errno = 0;
+            unsigned long long seed = strtoull(argv[i] + 12, &end, 10);
+            if (errno != 0 || end == argv[i] + 12 || *end != '\0') {
+                option_error("Invalid value for --hash-seed: %s\n", argv[i] + 12);
+                return -1;
+            }
+            opts->hash_seed = (uint64_t)seed;
+            opts->hash_seed_set = 1;
+        } else if (strcmp(argv[i], "--progress-thread") == 0) {
+            opts->progress_thread = 1;
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            opts->merge_saved = 1;
+        } else if (strncmp(argv[i], "--diff=", 7) == 0) {
+            if (strlen(argv[i] + 7) == 0 || strlen(argv[i] + 7) >= MAX_FILENAME_LEN) {
+                option_error("Invalid --diff file list: %s\n", argv[i] + 7);
+                return -1;
+            }
+            strcpy(opts->diff_filelist, argv[i] + 7);
+        } else {
+            option_error("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    // --merge si combina con --diff: i due corpora sono allora istogrammi salvati
+    int counting_modes = (opts->dictionary_path[0] != '\0') + (opts->cooccurrence_window > 0) +
+                         (opts->char_histogram != CHAR_HISTOGRAM_NONE) + (opts->merge_saved || opts->diff_filelist[0]) +
+                         (opts->sample_fraction > 0.0);
+    if (counting_modes > 1) {
+        option_error("Only one of --dictionary, --cooccurrence-window, --char-histogram, --sample and --merge/--diff can be used\n");
+        return -1;
+    }
+    // I worker aggiunti partecipano solo allo scheduling del conteggio parole, non ai passi collettivi
+    if (opts->spawn_workers > 0 && (counting_modes > 0 || opts->min_count > 1)) {
+        option_error("--spawn-workers only applies to plain word counting (without --min-count)\n");
+        return -1;
+    }
+    if (opts->dedup_threshold > 0.0 && (opts->merge_saved || opts->diff_filelist[0])) {
+        option_error("--dedup does not apply to --merge or --diff\n");
+        return -1;
+    }
+    if (opts->stable_top_k > 0 && opts->sample_fraction == 0.0) {
+        option_error("--stable-top-k requires --sample\n");
+        return -1;
+    }
+    if (opts->sample_fraction > 0.0 && (opts->min_count > 1 || opts->flush_threshold > 0 || opts->binary_output)) {
+        option_error("--min-count, --flush-threshold and --binary-output do not apply to --sample\n");
+        return -1;
+    }
+    if ((opts->merge_saved || opts->diff_filelist[0]) && opts->flush_threshold > 0) {
+        option_error("--flush-threshold does not apply to --merge or --diff\n");
+        return -1;
+    }
+    if ((opts->dictionary_path[0] || opts->char_histogram != CHAR_HISTOGRAM_NONE) &&
+        (opts->min_count > 1 || opts->flush_threshold > 0)) {
+        option_error("--min-count and --flush-threshold only apply to word counting\n");
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --filelist=FILE                      list of corpus files to count (default filelist.txt)\n");
+    fprintf(stderr, "  --read-mode=buffered|direct|nocache  how corpus files are read (default buffered)\n");
+    fprintf(stderr, "  --sort=word|frequency                output order (frequency: descending, ties by word)\n");
+    fprintf(stderr, "  --flush-threshold=N                  workers send a partial histogram every N unique words\n");
+    fprintf(stderr, "  --min-count=N                        only output words occurring at least N times\n");
+    fprintf(stderr, "  --bloom-counters=N                   counters in the min-count Bloom filter (default %d)\n", DEFAULT_BLOOM_COUNTERS);
+    fprintf(stderr, "  --dictionary=FILE                    only count the terms and phrases listed in FILE\n");
+    fprintf(stderr, "  --cooccurrence-window=N              also count word pairs at most N words apart (cooccurrence.mtx)\n");
+    fprintf(stderr, "  --char-histogram=bytes|utf8          count bytes (and UTF-8 code points) instead of words\n");
+    fprintf(stderr, "  --binary-output                      also write histograms in binary form (.bin)\n");
+    fprintf(stderr, "  --mphf                               add a minimal perfect hash index to the .bin output\n");
+    fprintf(stderr, "  --lookup=WORD[,WORD...]              look words up in the index of word_frequencies.bin\n");
+    fprintf(stderr, "  --merge                              filelist names saved histograms (CSV or .bin) to merge\n");
+    fprintf(stderr, "  --diff=FILELIST                      compare filelist.txt (A) with the corpus in FILELIST (B)\n");
+    fprintf(stderr, "  --sample=FRACTION                    estimate counts from a random FRACTION of each file's chunks\n");
+    fprintf(stderr, "  --sample-seed=N                      seed of the chunk sampler (default: current time)\n");
+    fprintf(stderr, "  --stable-top-k=K                     keep sampling until the top K words stop changing\n");
+    fprintf(stderr, "  --spawn-workers=N                    spawn N extra workers during word counting\n");
+    fprintf(stderr, "  --spawn-after=SECONDS                spawn them once counting has run this long (default 0)\n");
+    fprintf(stderr, "  --dedup[=SIMILARITY]                 skip near-duplicate files (MinHash Jaccard >= %.2f by default)\n",
+            DEFAULT_DEDUP_THRESHOLD);
+    fprintf(stderr, "  --output-dir=DIR                     write output files to DIR (created if missing)\n");
+    fprintf(stderr, "  --jobs=FILE                          run each \"FILELIST OUTPUT_DIR [options]\" line of FILE as a job\n");
+    fprintf(stderr, "  --hash-seed=N                        fixed seed for word hashing (default: random per run)\n");
+    fprintf(stderr, "  --progress-thread                    workers drive communication and prefetch tasks in a helper thread\n");
+}
+
+void write_file_stats(char file_list[][MAX_FILENAME_LEN], int total_files, const FileStats* file_stats,
+                      const TextStats* stats) {
+    FILE* fp = fopen(output_path("file_stats.csv"), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+        return;
+    }
+    fprintf(fp, "file,lines,words,bytes\n");
+    for (int i = 0; i < total_files; ++i) {
+        fprintf(fp, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", file_list[i],
+                file_stats[i].lines, file_stats[i].words, file_stats[i].bytes);
+    }
+    fprintf(fp, "total,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            stats->totals.lines, stats->totals.words, stats->totals.bytes);
+    fclose(fp);
+
+    fp = fopen(output_path("token_lengths.csv"), "w");
+    if (!fp) {
+        perror("Errore nell'apertura del file CSV per la scrittura");
+        return;
+    }
+    fprintf(fp, "length,tokens\n");
+    for (int len = 1; len < MAX_WORD_LEN; ++len) {
+        if (stats->token_lengths[len] > 0) {
+            fprintf(fp, "%d,%" PRIu64 "\n", len, stats->token_lengths[len]);
+        }
+    }
+    fclose(fp);
+    printf("Master: Per-file statistics written to file_stats.csv and token_lengths.csv\n");
+}
+
+void print_text_stats(const TextStats* stats) {
+    uint64_t total_length = 0;
+    int longest = 0;
+    for (int len = 1; len < MAX_WORD_LEN; ++len) {
+        total_length += (uint64_t)len * stats->token_lengths[len];
+        if (stats->token_lengths[len] > 0) {
+            longest = len;
+        }
+    }
+    printf("Lines: %" PRIu64 "\n", stats->totals.lines);
+    printf("Words: %" PRIu64 "\n", stats->totals.words);
+    printf("Bytes: %" PRIu64 "\n", stats->totals.bytes);
+    printf("Average word length: %.2f (longest %d%s)\n",
+           stats->totals.words > 0 ? (double)total_length / stats->totals.words : 0.0,
+           longest, longest == MAX_WORD_LEN - 1 ? ", truncated" : "");
+}
+
+/*
+ * Se vocabulary non è NULL, il master vi lascia l'istogramma globale nell'ordine di output invece di liberarlo.
+ * Sul master stats riceve le statistiche in stile wc dell'intero corpus, raccolte durante lo stesso passaggio.
+ * Con i gruppi (groups non NULL e con etichette) le chiavi sono (gruppo, parola) e ogni gruppo ha il suo CSV.
+ */
+void run_word_count(char file_list[][MAX_FILENAME_LEN], int total_files, const CorpusGroups* groups,
+                    const Options* opts, int rank, int size, Histogram* vocabulary, TextStats* stats) {
+    // I worker devono sapere quanti ordinamenti collettivi eseguire
+    int num_groups = (rank == 0 && groups) ? groups->count : 0;
+    MPI_Bcast(&num_groups, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int num_outputs = num_groups > 0 ? num_groups : 1;
+
+    // Modalità min-count: un primo passo costruisce il Bloom filter globale usato come filtro
+    CountingBloom min_count_filter = { NULL, 0 };
+    const CountingBloom* word_filter = NULL;
+    if (opts->min_count > 1) {
+        double filter_start = MPI_Wtime();
+        build_min_count_filter(&min_count_filter, file_list, total_files, opts, rank, size);
+        word_filter = &min_count_filter;
+        if (rank == 0) {
+            printf("Master: Bloom filter pass took %.4f seconds.\n", MPI_Wtime() - filter_start);
+        }
+    }
+
+    TextStats local_stats;
+    memset(&local_stats, 0, sizeof(local_stats));
+    if (rank == 0) {
         Histogram global_histogram;
         init_histogram(&global_histogram);
+        FileStats* file_stats = (FileStats*)calloc(total_files > 0 ? total_files : 1, sizeof(FileStats));
+        if (!file_stats) {
+            perror("Failed to allocate file statistics");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        run_master_word_count(file_list, total_files, num_groups > 0 ? groups : NULL, opts, word_filter, size,
+                              &global_histogram, file_stats, &local_stats);
+        MPI_Reduce(&local_stats, stats, TEXT_STATS_FIELDS, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        write_file_stats(file_list, total_files, file_stats, stats);
+        free(file_stats);
+
+        if (opts->min_count > 1) {
+            drop_rare_words(&global_histogram, opts->min_count);
+        }
+        printf("Master: Global histogram contains %d unique words.\n", global_histogram.count);
+        Histogram* outputs = &global_histogram;
+        if (num_groups > 0) {
+            outputs = split_histogram_by_group(&global_histogram, num_groups);
+        }
+        for (int g = 0; g < num_outputs; ++g) {
+            char base_name[MAX_FILENAME_LEN];
+            if (num_groups > 0) {
+                snprintf(base_name, sizeof(base_name), "word_frequencies_%s", groups->names[g]);
+            } else {
+                strcpy(base_name, "word_frequencies");
+            }
+            write_word_histogram(&outputs[g], opts, base_name, rank, size);
+            if (num_groups > 0) {
+                printf("Master: Group %s: %d unique words, output written to %s.csv\n",
+                       groups->names[g], outputs[g].count, base_name);
+            } else {
+                printf("Master: Output written to %s.csv\n", base_name);
+            }
+        }
+        if (num_groups > 0) {
+            for (int g = 0; g < num_groups; ++g) {
+                free_histogram_content(&outputs[g]);
+            }
+            free(outputs);
+        } else if (vocabulary) {
+            *vocabulary = global_histogram;
+        } else {
+            free_histogram_content(&global_histogram);
+        }
+    } else {
+        run_worker_word_count(opts, word_filter, &local_stats, MPI_COMM_WORLD);
+        MPI_Reduce(&local_stats, NULL, TEXT_STATS_FIELDS, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        for (int g = 0; g < num_outputs; ++g) {
+            write_word_histogram(NULL, opts, NULL, rank, size);
+        }
+    }
+    free_bloom(&min_count_filter);
+}
+
+void send_word_count_task(char file_list[][MAX_FILENAME_LEN], const CorpusGroups* groups, int file_idx, int dest,
+                          MPI_Comm comm) {
+    WordCountTask task;
+    task.group = groups ? groups->file_group[file_idx] : 0;
+    strcpy(task.filename, file_list[file_idx]);
+    MPI_Send(&task, sizeof(task), MPI_BYTE, dest, TAG_TASK, comm);
+}
+
+// Lancia i worker aggiunti con le opzioni che servono al conteggio e assegna loro un primo file ciascuno
+void spawn_elastic_workers(ElasticPool* pool, const Options* opts, char file_list[][MAX_FILENAME_LEN],
+                           const CorpusGroups* groups, int total_files, int* next_file_idx) {
+    static const char* read_mode_names[] = { "buffered", "direct", "nocache" };
+    char read_mode_arg[64];
+    char flush_arg[64];
+    snprintf(read_mode_arg, sizeof(read_mode_arg), "--read-mode=%s", read_mode_names[opts->read_mode]);
+    snprintf(flush_arg, sizeof(flush_arg), "--flush-threshold=%d", opts->flush_threshold);
+    char progress_arg[] = "--progress-thread";
+    char* child_argv[] = { read_mode_arg, flush_arg, progress_thread_enabled(opts) ? progress_arg : NULL, NULL };
+
+    int* errcodes = (int*)malloc(opts->spawn_workers * sizeof(int));
+    if (!errcodes) {
+        perror("Failed to allocate spawn error codes");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Comm_spawn(opts->program_path, child_argv, opts->spawn_workers, MPI_INFO_NULL, 0, MPI_COMM_SELF,
+                   &pool->intercomm, errcodes);
+    free(errcodes);
+    MPI_Comm_remote_size(pool->intercomm, &pool->num_workers);
+    pool->assigned_file = (int*)malloc(pool->num_workers * sizeof(int));
+    if (!pool->assigned_file) {
+        perror("Failed to allocate worker assignments");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    pool->pending = 0;
+    printf("Master: Spawned %d additional workers, %d files still unassigned.\n",
+           pool->num_workers, total_files - *next_file_idx);
+    for (int w = 0; w < pool->num_workers; ++w) {
+        if (*next_file_idx < total_files) {
+            send_word_count_task(file_list, groups, *next_file_idx, w, pool->intercomm);
+            pool->assigned_file[w] = (*next_file_idx)++;
+        } else {
+            MPI_Send("", 1, MPI_BYTE, w, TAG_END_OF_TASKS_SEND_HISTOGRAM, pool->intercomm);
+        }
+    }
+}
+
+// Processo lanciato con MPI_Comm_spawn: conta come un worker normale e alla fine invia anche le statistiche
+void run_elastic_worker(const Options* opts, MPI_Comm parent) {
+    TextStats local_stats;
+    memset(&local_stats, 0, sizeof(local_stats));
+    run_worker_word_count(opts, NULL, &local_stats, parent);
+    MPI_Send(&local_stats, TEXT_STATS_FIELDS, MPI_UINT64_T, 0, TAG_WORKER_STATS, parent);
+}
 
-        if (size == 1) { 
-            printf("Master: Running in single process mode.\n");
-            if (total_files == 0) {
-                printf("Master: No files to process.\n");
+void run_master_word_count(char file_list[][MAX_FILENAME_LEN], int total_files, const CorpusGroups* groups,
+                           const Options* opts, const CountingBloom* word_filter, int size, Histogram* global_histogram,
+                           FileStats* file_stats, TextStats* local_stats) {
+    if (size == 1 && opts->spawn_workers == 0) { 
+        printf("Master: Running in single process mode.\n");
+        if (total_files == 0) {
+            printf("Master: No files to process.\n");
+        }
+        Arena scratch;
+        arena_init(&scratch);
+        for (int i = 0; i < total_files; ++i) {
+            Histogram* file_hist = count_words_in_file(file_list[i], groups ? groups->file_group[i] : 0, opts,
+                                                       word_filter, &file_stats[i], local_stats->token_lengths,
+                                                       &scratch);
+            if (file_hist) {
+                local_stats->totals.lines += file_stats[i].lines;
+                local_stats->totals.words += file_stats[i].words;
+                local_stats->totals.bytes += file_stats[i].bytes;
+                merge_histograms(global_histogram, file_hist);
+            } else {
+                printf("Master: Could not process file %s\n", file_list[i]);
             }
-            for (int i = 0; i < total_files; ++i) {
-                Histogram* file_hist = count_words_in_file(file_list[i]);
-                if (file_hist) {
-                    merge_histograms(&global_histogram, file_hist);
-                    free_histogram_content(file_hist);
-                    free(file_hist);
-                } else {
-                    printf("Master: Could not process file %s\n", file_list[i]);
-                }
+            arena_reset(&scratch);
+        }
+        arena_destroy(&scratch);
+    } else { 
+        int num_workers = size - 1;
+        int next_file_idx = 0;
+        int workers_finished_and_sent_histograms = 0;
+        int partial_histograms_received = 0;
+        MPI_Status status;
+        ElasticPool pool = { MPI_COMM_NULL, 0, NULL, opts->spawn_workers > 0 };
+        double counting_start = MPI_Wtime();
+        /*
+         * File assegnati a ciascun worker in ordine di invio, per attribuire le statistiche che arrivano con
+         * l'ACK: una coda circolare di depth posizioni, perché con il progress thread ogni worker ha sempre
+         * anche il task successivo già in arrivo mentre conta quello corrente.
+         */
+        int depth = progress_thread_enabled(opts) ? TASK_PREFETCH_DEPTH : 1;
+        int* assigned_file = (int*)malloc((size_t)size * depth * sizeof(int));
+        int* assigned_head = (int*)calloc(size, sizeof(int));
+        int* assigned_count = (int*)calloc(size, sizeof(int));
+        if (!assigned_file || !assigned_head || !assigned_count) {
+            perror("Failed to allocate worker assignments");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        if (total_files == 0) {
+            printf("Master: No files to process. Signaling workers to terminate.\n");
+        }
+
+        for (int round = 0; round < depth; ++round) {
+            for (int worker_rank = 1; worker_rank <= num_workers && next_file_idx < total_files; ++worker_rank) {
+                send_word_count_task(file_list, groups, next_file_idx, worker_rank, MPI_COMM_WORLD);
+                assigned_file[worker_rank * depth + assigned_count[worker_rank]++] = next_file_idx;
+                next_file_idx++;
             }
-        } else { 
-            int num_workers = size - 1;
-            int next_file_idx = 0;
-            int workers_finished_and_sent_histograms = 0;
-            MPI_Status status;
+        }
+        for (int worker_rank = 1; worker_rank <= num_workers; ++worker_rank) {
+            if (assigned_count[worker_rank] == 0) {
+                MPI_Send("", 1, MPI_BYTE, worker_rank, TAG_END_OF_TASKS_SEND_HISTOGRAM, MPI_COMM_WORLD);
+            }
+        }
+        // Senza altri worker il master non ha nessuno a cui assegnare i file: si lancia subito
+        if (pool.pending && num_workers == 0) {
+            spawn_elastic_workers(&pool, opts, file_list, groups, total_files, &next_file_idx);
+        }
 
-            if (total_files == 0) {
-                printf("Master: No files to process. Signaling workers to terminate.\n");
+        while (workers_finished_and_sent_histograms < num_workers + pool.num_workers) {
+            // Con il pool elastico i messaggi arrivano su due comunicatori: si interrogano a turno
+            MPI_Comm comm = MPI_COMM_WORLD;
+            if (!pool.pending && pool.num_workers == 0) {
+                MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            } else {
+                int flag = 0;
+                while (!flag) {
+                    if (pool.pending && MPI_Wtime() - counting_start >= opts->spawn_after) {
+                        if (next_file_idx < total_files) {
+                            spawn_elastic_workers(&pool, opts, file_list, groups, total_files, &next_file_idx);
+                        } else {
+                            pool.pending = 0;
+                        }
+                    }
+                    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+                    if (!flag && pool.intercomm != MPI_COMM_NULL) {
+                        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, pool.intercomm, &flag, &status);
+                        comm = pool.intercomm;
+                    }
+                    if (!flag) {
+                        comm = MPI_COMM_WORLD;
+                        usleep(ELASTIC_POLL_INTERVAL_US);
+                    }
+                }
             }
+            int sender_rank = status.MPI_SOURCE;
+
+            if (status.MPI_TAG == TAG_PROCESSED_FILE_ACK) {
+                // I worker aggiunti ricevono un task alla volta
+                int in_flight = 0;
+                int done_file;
+                if (comm == MPI_COMM_WORLD) {
+                    done_file = assigned_file[sender_rank * depth + assigned_head[sender_rank]];
+                    assigned_head[sender_rank] = (assigned_head[sender_rank] + 1) % depth;
+                    in_flight = --assigned_count[sender_rank];
+                } else {
+                    done_file = pool.assigned_file[sender_rank];
+                }
+                MPI_Recv(&file_stats[done_file], FILE_STATS_FIELDS, MPI_UINT64_T, sender_rank,
+                         TAG_PROCESSED_FILE_ACK, comm, &status);
 
-            for (int worker_rank = 1; worker_rank <= num_workers; ++worker_rank) {
                 if (next_file_idx < total_files) {
-                    MPI_Send(file_list[next_file_idx], MAX_FILENAME_LEN, MPI_CHAR, worker_rank, TAG_TASK, MPI_COMM_WORLD);
+                    send_word_count_task(file_list, groups, next_file_idx, sender_rank, comm);
+                    if (comm == MPI_COMM_WORLD) {
+                        int slot = (assigned_head[sender_rank] + assigned_count[sender_rank]++) % depth;
+                        assigned_file[sender_rank * depth + slot] = next_file_idx;
+                    } else {
+                        pool.assigned_file[sender_rank] = next_file_idx;
+                    }
                     next_file_idx++;
+                } else if (in_flight == 0) {
+                    MPI_Send("", 1, MPI_BYTE, sender_rank, TAG_END_OF_TASKS_SEND_HISTOGRAM, comm);
+                }
+            } else if (status.MPI_TAG == TAG_PARTIAL_HISTOGRAM_SIZE || status.MPI_TAG == TAG_HISTOGRAM_DATA_SIZE) {
+                // I parziali arrivano durante il conteggio, quello finale dopo TAG_END_OF_TASKS_SEND_HISTOGRAM
+                int is_final = (status.MPI_TAG == TAG_HISTOGRAM_DATA_SIZE);
+                Histogram received_hist;
+                recv_histogram(&received_hist, sender_rank, status.MPI_TAG, comm);
+                merge_histograms(global_histogram, &received_hist);
+                free_histogram_content(&received_hist);
+                if (is_final) {
+                    workers_finished_and_sent_histograms++;
+                    // I worker aggiunti non partecipano alla MPI_Reduce delle statistiche: le inviano qui
+                    if (comm != MPI_COMM_WORLD) {
+                        TextStats worker_stats;
+                        MPI_Recv(&worker_stats, TEXT_STATS_FIELDS, MPI_UINT64_T, sender_rank, TAG_WORKER_STATS,
+                                 comm, MPI_STATUS_IGNORE);
+                        uint64_t* dst = (uint64_t*)local_stats;
+                        const uint64_t* src = (const uint64_t*)&worker_stats;
+                        for (size_t f = 0; f < TEXT_STATS_FIELDS; ++f) {
+                            dst[f] += src[f];
+                        }
+                    }
                 } else {
-                    MPI_Send("", 1, MPI_CHAR, worker_rank, TAG_END_OF_TASKS_SEND_HISTOGRAM, MPI_COMM_WORLD);
+                    partial_histograms_received++;
                 }
+            } else {
+                fprintf(stderr, "Master: unexpected message with tag %d from rank %d\n", status.MPI_TAG, sender_rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
             }
+        }
+        if (opts->flush_threshold > 0) {
+            printf("Master: Merged %d partial histograms during counting.\n", partial_histograms_received);
+        }
+        if (pool.intercomm != MPI_COMM_NULL) {
+            MPI_Comm_disconnect(&pool.intercomm);
+            free(pool.assigned_file);
+        }
+        free(assigned_file);
+        free(assigned_head);
+        free(assigned_count);
+    }
+}
 
-            while (workers_finished_and_sent_histograms < num_workers) {
-                int dummy_ack;
-                MPI_Recv(&dummy_ack, 1, MPI_INT, MPI_ANY_SOURCE, TAG_PROCESSED_FILE_ACK, MPI_COMM_WORLD, &status);
-                int sender_rank = status.MPI_SOURCE;
+int progress_thread_enabled(const Options* opts) {
+    return opts->progress_thread && mpi_thread_multiple;
+}
 
-                if (next_file_idx < total_files) {
-                    MPI_Send(file_list[next_file_idx], MAX_FILENAME_LEN, MPI_CHAR, sender_rank, TAG_TASK, MPI_COMM_WORLD);
-                    next_file_idx++;
-                } else {
-                    MPI_Send("", 1, MPI_CHAR, sender_rank, TAG_END_OF_TASKS_SEND_HISTOGRAM, MPI_COMM_WORLD);
+// Usa PMPI_Iprobe: il profiler non conta le chiamate del thread e i suoi contatori restano del solo thread principale
+void* progress_thread_main(void* arg) {
+    ProgressThread* progress = (ProgressThread*)arg;
+    int flag;
+    while (!__atomic_load_n(&progress->stop, __ATOMIC_ACQUIRE)) {
+        PMPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, progress->comm, &flag, MPI_STATUS_IGNORE);
+        usleep(PROGRESS_POLL_INTERVAL_US);
+    }
+    return NULL;
+}
 
-                    int num_unique_words;
-                    MPI_Recv(&num_unique_words, 1, MPI_INT, sender_rank, TAG_HISTOGRAM_DATA_COUNT, MPI_COMM_WORLD, &status);
+void progress_thread_start(ProgressThread* progress) {
+    MPI_Comm_dup(MPI_COMM_SELF, &progress->comm);
+    progress->stop = 0;
+    if (pthread_create(&progress->thread, NULL, progress_thread_main, progress) != 0) {
+        perror("Failed to start progress thread");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
 
-                    if (num_unique_words > 0) {
-                        Histogram received_hist;
-                        received_hist.items = (WordFreq*)malloc(num_unique_words * sizeof(WordFreq));
-                        if (!received_hist.items) {
-                            perror("Master failed to allocate for received histogram");
-                            MPI_Abort(MPI_COMM_WORLD, 1);
-                        }
-                        received_hist.count = num_unique_words;
-                        received_hist.capacity = num_unique_words;
+void progress_thread_stop(ProgressThread* progress) {
+    __atomic_store_n(&progress->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(progress->thread, NULL);
+    MPI_Comm_free(&progress->comm);
+}
 
-                        for (int i = 0; i < num_unique_words; ++i) {
-                            MPI_Recv(received_hist.items[i].word, MAX_WORD_LEN, MPI_CHAR, sender_rank, TAG_HISTOGRAM_DATA_WORD, MPI_COMM_WORLD, &status);
-                            MPI_Recv(&received_hist.items[i].frequency, 1, MPI_INT, sender_rank, TAG_HISTOGRAM_DATA_FREQ, MPI_COMM_WORLD, &status);
-                        }
-                        merge_histograms(&global_histogram, &received_hist);
-                        free(received_hist.items);
-                    }
-                    workers_finished_and_sent_histograms++;
-                }
+// comm è MPI_COMM_WORLD per i worker lanciati con mpirun, l'intercomunicatore verso il master per quelli aggiunti
+void run_worker_word_count(const Options* opts, const CountingBloom* word_filter, TextStats* local_stats, MPI_Comm comm) {
+    Histogram local_histogram;
+    init_histogram(&local_histogram);
+    PendingHistogramSend pending_flush = { NULL, 0, { NULL, 0 } };
+    MPI_Status status;
+    // Le tabelle di ciascun file vivono nell'arena e si rilasciano in blocco dopo l'unione
+    Arena scratch;
+    arena_init(&scratch);
+    ProgressThread progress;
+    int use_progress = progress_thread_enabled(opts);
+    if (use_progress) {
+        progress_thread_start(&progress);
+    }
+
+    // La ricezione del task successivo viene avviata prima di contare il file corrente
+    WordCountTask tasks[2];
+    int current = 0;
+    MPI_Request task_request;
+    MPI_Irecv(&tasks[current], sizeof(WordCountTask), MPI_BYTE, 0, MPI_ANY_TAG, comm, &task_request);
+
+    while (1) {
+        MPI_Wait(&task_request, &status);
+        const WordCountTask* task = &tasks[current];
+
+        if (status.MPI_TAG == TAG_END_OF_TASKS_SEND_HISTOGRAM) {
+            finish_histogram_send(&pending_flush);
+            send_histogram(&local_histogram, 0, comm);
+            break;
+        }
+        current = 1 - current;
+        MPI_Irecv(&tasks[current], sizeof(WordCountTask), MPI_BYTE, 0, MPI_ANY_TAG, comm, &task_request);
+
+        FileStats file_stats;
+        Histogram* file_hist = count_words_in_file(task->filename, task->group, opts, word_filter, &file_stats,
+                                                   local_stats->token_lengths, &scratch);
+        if (file_hist) {
+            local_stats->totals.lines += file_stats.lines;
+            local_stats->totals.words += file_stats.words;
+            local_stats->totals.bytes += file_stats.bytes;
+            merge_histograms(&local_histogram, file_hist);
+        } else {
+            fprintf(stderr, "Could not process file %s\n", task->filename);
+        }
+        arena_reset(&scratch);
+
+        // Il parziale parte in background: il worker riprende a contare mentre viaggia
+        if (opts->flush_threshold > 0 && local_histogram.count >= opts->flush_threshold) {
+            finish_histogram_send(&pending_flush);
+            start_histogram_send(&local_histogram, 0, TAG_PARTIAL_HISTOGRAM_SIZE, comm, &pending_flush);
+            free_histogram_content(&local_histogram);
+            init_histogram(&local_histogram);
+        }
+
+        // L'ACK porta le statistiche del file appena contato
+        MPI_Send(&file_stats, FILE_STATS_FIELDS, MPI_UINT64_T, 0, TAG_PROCESSED_FILE_ACK, comm);
+    }
+    if (use_progress) {
+        progress_thread_stop(&progress);
+    }
+    arena_destroy(&scratch);
+    free_histogram_content(&local_histogram);
+}
+
+#ifdef ENABLE_MPI_PROFILER
+/*
+ * Profiler di comunicazione basato su PMPI. Compilando con -DENABLE_MPI_PROFILER le funzioni
+ * MPI usate dal programma vengono intercettate: per ogni funzione e per ogni tag si contano
+ * chiamate, byte e tempo, che alla MPI_Finalize vengono ridotti su tutti i rank e stampati dal master.
+ */
+#define MAX_PROFILED_TAGS 32
+
+typedef enum {
+    PROF_SEND, PROF_RECV, PROF_ISEND, PROF_IRECV, PROF_WAIT, PROF_WAITALL,
+    PROF_PROBE, PROF_IPROBE, PROF_BCAST, PROF_REDUCE, PROF_ALLREDUCE, PROF_EXSCAN, PROF_GATHER, PROF_GATHERV,
+    PROF_SCATTER, PROF_SCATTERV, PROF_ALLGATHER, PROF_ALLTOALL, PROF_ALLTOALLV, PROF_BARRIER,
+    PROF_NUM_FUNCS
+} ProfiledFunc;
+
+static const char* profiled_func_names[PROF_NUM_FUNCS] = {
+    "MPI_Send", "MPI_Recv", "MPI_Isend", "MPI_Irecv", "MPI_Wait", "MPI_Waitall",
+    "MPI_Probe", "MPI_Iprobe", "MPI_Bcast", "MPI_Reduce", "MPI_Allreduce", "MPI_Exscan", "MPI_Gather", "MPI_Gatherv",
+    "MPI_Scatter", "MPI_Scatterv", "MPI_Allgather", "MPI_Alltoall", "MPI_Alltoallv", "MPI_Barrier"
+};
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long bytes;
+    double time;
+} ProfileCounter;
+
+static ProfileCounter prof_funcs[PROF_NUM_FUNCS];
+static ProfileCounter prof_tags_sent[MAX_PROFILED_TAGS];
+static ProfileCounter prof_tags_recv[MAX_PROFILED_TAGS];
+
+static const char* profiled_tag_name(int tag) {
+    switch (tag) {
+        case TAG_TASK: return "TAG_TASK";
+        case TAG_PROCESSED_FILE_ACK: return "TAG_PROCESSED_FILE_ACK";
+        case TAG_END_OF_TASKS_SEND_HISTOGRAM: return "TAG_END_OF_TASKS_SEND_HISTOGRAM";
+        case TAG_HISTOGRAM_DATA_SIZE: return "TAG_HISTOGRAM_DATA_SIZE";
+        case TAG_HISTOGRAM_DATA: return "TAG_HISTOGRAM_DATA";
+        case TAG_PARTIAL_HISTOGRAM_SIZE: return "TAG_PARTIAL_HISTOGRAM_SIZE";
+        case TAG_PASS_TASK: return "TAG_PASS_TASK";
+        case TAG_PASS_ACK: return "TAG_PASS_ACK";
+        case TAG_PASS_DONE: return "TAG_PASS_DONE";
+        case TAG_MERGE_HISTOGRAM_SIZE: return "TAG_MERGE_HISTOGRAM_SIZE";
+        case TAG_WORKER_STATS: return "TAG_WORKER_STATS";
+        default: return "(other)";
+    }
+}
+
+static unsigned long long profile_bytes(int count, MPI_Datatype datatype) {
+    int type_size = 0;
+    PMPI_Type_size(datatype, &type_size);
+    return (unsigned long long)count * (unsigned long long)type_size;
+}
+
+static void profile_record(ProfileCounter* counter, unsigned long long bytes, double elapsed) {
+    counter->calls++;
+    counter->bytes += bytes;
+    counter->time += elapsed;
+}
+
+static void profile_record_tag(ProfileCounter* tags, int tag, unsigned long long bytes, double elapsed) {
+    if (tag >= 0 && tag < MAX_PROFILED_TAGS) {
+        profile_record(&tags[tag], bytes, elapsed);
+    }
+}
+
+/*
+ * Ricezioni non bloccanti in corso. Con MPI_ANY_TAG il tag, e in ogni caso i byte arrivati, si conoscono
+ * solo al completamento: Wait e Waitall li leggono dallo status delle richieste che compaiono qui.
+ */
+typedef struct {
+    MPI_Request request;
+    MPI_Datatype datatype;
+} ProfiledRecv;
+
+static ProfiledRecv* prof_pending_recvs;
+static int prof_num_pending_recvs;
+static int prof_pending_capacity;
+
+static void profile_track_recv(MPI_Request request, MPI_Datatype datatype) {
+    if (prof_num_pending_recvs == prof_pending_capacity) {
+        int capacity = prof_pending_capacity ? prof_pending_capacity * 2 : 16;
+        ProfiledRecv* recvs = (ProfiledRecv*)realloc(prof_pending_recvs, capacity * sizeof(ProfiledRecv));
+        if (!recvs) {
+            perror("Failed to allocate profiler receive table");
+            PMPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        prof_pending_recvs = recvs;
+        prof_pending_capacity = capacity;
+    }
+    prof_pending_recvs[prof_num_pending_recvs].request = request;
+    prof_pending_recvs[prof_num_pending_recvs].datatype = datatype;
+    prof_num_pending_recvs++;
+}
+
+// Toglie la richiesta dalle ricezioni in corso; restituisce 0 se non era una ricezione
+static int profile_untrack_recv(MPI_Request request, MPI_Datatype* datatype) {
+    for (int i = 0; i < prof_num_pending_recvs; ++i) {
+        if (prof_pending_recvs[i].request == request) {
+            *datatype = prof_pending_recvs[i].datatype;
+            prof_pending_recvs[i] = prof_pending_recvs[--prof_num_pending_recvs];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Byte e tag effettivi di una ricezione completata; oltre INT_MAX elementi (MPI_Irecv_c) MPI_Get_count non basta
+static void profile_record_completed_recv(MPI_Datatype datatype, const MPI_Status* status, double elapsed) {
+    int received = 0;
+    unsigned long long bytes;
+    PMPI_Get_count(status, datatype, &received);
+    if (received == MPI_UNDEFINED) {
+        MPI_Count elements = 0;
+        PMPI_Get_elements_x(status, datatype, &elements);
+        bytes = profile_bytes(1, datatype) * (unsigned long long)elements;
+    } else {
+        bytes = profile_bytes(received, datatype);
+    }
+    prof_funcs[PROF_IRECV].bytes += bytes;
+    profile_record_tag(prof_tags_recv, status->MPI_TAG, bytes, elapsed);
+}
+
+int MPI_Send(const void* buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Send(buf, count, datatype, dest, tag, comm);
+    double elapsed = PMPI_Wtime() - t0;
+    unsigned long long bytes = profile_bytes(count, datatype);
+    profile_record(&prof_funcs[PROF_SEND], bytes, elapsed);
+    profile_record_tag(prof_tags_sent, tag, bytes, elapsed);
+    return err;
+}
+
+int MPI_Recv(void* buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status* status) {
+    MPI_Status local_status;
+    if (status == MPI_STATUS_IGNORE) {
+        status = &local_status;
+    }
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+    double elapsed = PMPI_Wtime() - t0;
+    int received = 0;
+    PMPI_Get_count(status, datatype, &received);
+    unsigned long long bytes = profile_bytes(received, datatype);
+    profile_record(&prof_funcs[PROF_RECV], bytes, elapsed);
+    profile_record_tag(prof_tags_recv, status->MPI_TAG, bytes, elapsed);
+    return err;
+}
+
+int MPI_Isend(const void* buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request* request) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+    double elapsed = PMPI_Wtime() - t0;
+    unsigned long long bytes = profile_bytes(count, datatype);
+    profile_record(&prof_funcs[PROF_ISEND], bytes, elapsed);
+    profile_record_tag(prof_tags_sent, tag, bytes, elapsed);
+    return err;
+}
+
+int MPI_Irecv(void* buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request* request) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+    // Tag e byte si contano al completamento (profile_record_completed_recv)
+    profile_record(&prof_funcs[PROF_IRECV], 0, PMPI_Wtime() - t0);
+    if (err == MPI_SUCCESS) {
+        profile_track_recv(*request, datatype);
+    }
+    return err;
+}
+
+#if MPI_VERSION >= 4
+int MPI_Isend_c(const void* buf, MPI_Count count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request* request) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Isend_c(buf, count, datatype, dest, tag, comm, request);
+    double elapsed = PMPI_Wtime() - t0;
+    int type_size = 0;
+    PMPI_Type_size(datatype, &type_size);
+    unsigned long long bytes = (unsigned long long)count * (unsigned long long)type_size;
+    profile_record(&prof_funcs[PROF_ISEND], bytes, elapsed);
+    profile_record_tag(prof_tags_sent, tag, bytes, elapsed);
+    return err;
+}
+
+int MPI_Irecv_c(void* buf, MPI_Count count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request* request) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Irecv_c(buf, count, datatype, source, tag, comm, request);
+    profile_record(&prof_funcs[PROF_IRECV], 0, PMPI_Wtime() - t0);
+    if (err == MPI_SUCCESS) {
+        profile_track_recv(*request, datatype);
+    }
+    return err;
+}
+#endif
+
+// Il tempo di attesa di una ricezione va al suo tag, come per MPI_Recv
+int MPI_Wait(MPI_Request* request, MPI_Status* status) {
+    MPI_Status local_status;
+    if (status == MPI_STATUS_IGNORE) {
+        status = &local_status;
+    }
+    MPI_Request posted = *request;
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Wait(request, status);
+    double elapsed = PMPI_Wtime() - t0;
+    profile_record(&prof_funcs[PROF_WAIT], 0, elapsed);
+    MPI_Datatype datatype;
+    if (err == MPI_SUCCESS && profile_untrack_recv(posted, &datatype)) {
+        profile_record_completed_recv(datatype, status, elapsed);
+    }
+    return err;
+}
+
+// L'attesa è comune a tutte le richieste: ogni ricezione completata ne riceve una quota uguale
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[]) {
+    MPI_Request* posted = (MPI_Request*)malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+    MPI_Status* local_statuses = statuses == MPI_STATUSES_IGNORE ?
+                                 (MPI_Status*)malloc((count > 0 ? count : 1) * sizeof(MPI_Status)) : NULL;
+    if (!posted || (statuses == MPI_STATUSES_IGNORE && !local_statuses)) {
+        perror("Failed to allocate profiler request buffers");
+        PMPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (local_statuses) {
+        statuses = local_statuses;
+    }
+    memcpy(posted, requests, count * sizeof(MPI_Request));
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Waitall(count, requests, statuses);
+    double elapsed = PMPI_Wtime() - t0;
+    profile_record(&prof_funcs[PROF_WAITALL], 0, elapsed);
+    for (int i = 0; i < count && err == MPI_SUCCESS; ++i) {
+        MPI_Datatype datatype;
+        if (profile_untrack_recv(posted[i], &datatype)) {
+            profile_record_completed_recv(datatype, &statuses[i], elapsed / count);
+        }
+    }
+    free(local_statuses);
+    free(posted);
+    return err;
+}
+
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status* status) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Probe(source, tag, comm, status);
+    profile_record(&prof_funcs[PROF_PROBE], 0, PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int* flag, MPI_Status* status) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Iprobe(source, tag, comm, flag, status);
+    profile_record(&prof_funcs[PROF_IPROBE], 0, PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Bcast(void* buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Bcast(buffer, count, datatype, root, comm);
+    profile_record(&prof_funcs[PROF_BCAST], profile_bytes(count, datatype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Reduce(const void* sendbuf, void* recvbuf, int count, MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+    profile_record(&prof_funcs[PROF_REDUCE], profile_bytes(count, datatype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Allreduce(const void* sendbuf, void* recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    profile_record(&prof_funcs[PROF_ALLREDUCE], profile_bytes(count, datatype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Exscan(const void* sendbuf, void* recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Exscan(sendbuf, recvbuf, count, datatype, op, comm);
+    profile_record(&prof_funcs[PROF_EXSCAN], profile_bytes(count, datatype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Gather(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, int recvcount,
+               MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+    profile_record(&prof_funcs[PROF_GATHER], profile_bytes(sendcount, sendtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Gatherv(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, const int recvcounts[],
+                const int displs[], MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Gatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, root, comm);
+    profile_record(&prof_funcs[PROF_GATHERV], profile_bytes(sendcount, sendtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Scatter(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, int recvcount,
+                MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Scatter(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+    profile_record(&prof_funcs[PROF_SCATTER], profile_bytes(recvcount, recvtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Scatterv(const void* sendbuf, const int sendcounts[], const int displs[], MPI_Datatype sendtype,
+                 void* recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Scatterv(sendbuf, sendcounts, displs, sendtype, recvbuf, recvcount, recvtype, root, comm);
+    profile_record(&prof_funcs[PROF_SCATTERV], profile_bytes(recvcount, recvtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Allgather(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, int recvcount,
+                  MPI_Datatype recvtype, MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Allgather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+    profile_record(&prof_funcs[PROF_ALLGATHER], profile_bytes(sendcount, sendtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Alltoall(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, int recvcount,
+                 MPI_Datatype recvtype, MPI_Comm comm) {
+    int comm_size = 0;
+    PMPI_Comm_size(comm, &comm_size);
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Alltoall(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+    profile_record(&prof_funcs[PROF_ALLTOALL], profile_bytes(sendcount * comm_size, sendtype), PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Alltoallv(const void* sendbuf, const int sendcounts[], const int sdispls[], MPI_Datatype sendtype,
+                  void* recvbuf, const int recvcounts[], const int rdispls[], MPI_Datatype recvtype, MPI_Comm comm) {
+    int comm_size = 0;
+    PMPI_Comm_size(comm, &comm_size);
+    unsigned long long bytes = 0;
+    for (int i = 0; i < comm_size; ++i) {
+        bytes += profile_bytes(sendcounts[i], sendtype);
+    }
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Alltoallv(sendbuf, sendcounts, sdispls, sendtype, recvbuf, recvcounts, rdispls, recvtype, comm);
+    profile_record(&prof_funcs[PROF_ALLTOALLV], bytes, PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Barrier(MPI_Comm comm) {
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Barrier(comm);
+    profile_record(&prof_funcs[PROF_BARRIER], 0, PMPI_Wtime() - t0);
+    return err;
+}
+
+static void profile_reduce_counters(const ProfileCounter* counters, int n, unsigned long long* calls,
+                                    unsigned long long* bytes, double* time_sum, double* time_max) {
+    unsigned long long* local_u = (unsigned long long*)malloc(2 * n * sizeof(unsigned long long));
+    double* local_t = (double*)malloc(n * sizeof(double));
+    unsigned long long* global_u = (unsigned long long*)malloc(2 * n * sizeof(unsigned long long));
+    if (!local_u || !local_t || !global_u) {
+        perror("Failed to allocate profiler buffers");
+        PMPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < n; ++i) {
+        local_u[i] = counters[i].calls;
+        local_u[n + i] = counters[i].bytes;
+        local_t[i] = counters[i].time;
+    }
+    PMPI_Reduce(local_u, global_u, 2 * n, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    PMPI_Reduce(local_t, time_sum, n, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    PMPI_Reduce(local_t, time_max, n, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    memcpy(calls, global_u, n * sizeof(unsigned long long));
+    memcpy(bytes, global_u + n, n * sizeof(unsigned long long));
+    free(local_u);
+    free(local_t);
+    free(global_u);
+}
+
+int MPI_Finalize(void) {
+    int rank, size;
+    PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    PMPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    unsigned long long f_calls[PROF_NUM_FUNCS], f_bytes[PROF_NUM_FUNCS];
+    double f_time_sum[PROF_NUM_FUNCS], f_time_max[PROF_NUM_FUNCS];
+    unsigned long long s_calls[MAX_PROFILED_TAGS], s_bytes[MAX_PROFILED_TAGS];
+    unsigned long long r_calls[MAX_PROFILED_TAGS], r_bytes[MAX_PROFILED_TAGS];
+    double s_time_sum[MAX_PROFILED_TAGS], s_time_max[MAX_PROFILED_TAGS];
+    double r_time_sum[MAX_PROFILED_TAGS], r_time_max[MAX_PROFILED_TAGS];
+
+    profile_reduce_counters(prof_funcs, PROF_NUM_FUNCS, f_calls, f_bytes, f_time_sum, f_time_max);
+    profile_reduce_counters(prof_tags_sent, MAX_PROFILED_TAGS, s_calls, s_bytes, s_time_sum, s_time_max);
+    profile_reduce_counters(prof_tags_recv, MAX_PROFILED_TAGS, r_calls, r_bytes, r_time_sum, r_time_max);
+
+    if (rank == 0) {
+        printf("\nMPI COMMUNICATION PROFILE (totals over %d ranks)\n", size);
+        printf("%-16s %12s %16s %14s %14s\n", "function", "calls", "bytes", "time_sum(s)", "time_max(s)");
+        for (int i = 0; i < PROF_NUM_FUNCS; ++i) {
+            if (f_calls[i] > 0) {
+                printf("%-16s %12llu %16llu %14.6f %14.6f\n", profiled_func_names[i],
+                       f_calls[i], f_bytes[i], f_time_sum[i], f_time_max[i]);
+            }
+        }
+        // I tempi per tag sono sommati su tutti i rank; il massimo è quello del rank più lento
+        printf("%-4s %-34s %12s %16s %14s %14s %12s %16s %14s %14s\n", "tag", "name",
+               "sent_msgs", "sent_bytes", "sent_sum(s)", "sent_max(s)", "recv_msgs", "recv_bytes", "recv_sum(s)",
+               "recv_max(s)");
+        for (int t = 0; t < MAX_PROFILED_TAGS; ++t) {
+            if (s_calls[t] > 0 || r_calls[t] > 0) {
+                printf("%-4d %-34s %12llu %16llu %14.6f %14.6f %12llu %16llu %14.6f %14.6f\n", t,
+                       profiled_tag_name(t), s_calls[t], s_bytes[t], s_time_sum[t], s_time_max[t],
+                       r_calls[t], r_bytes[t], r_time_sum[t], r_time_max[t]);
+            }
+        }
+        fflush(stdout);
+    }
+    return PMPI_Finalize();
+}
+#endif
+
+/*
+ * Un job completo: lista dei file, eventuale deduplicazione, modalità di conteggio e risultati.
+ * Collettiva; i job di un batch si susseguono nella stessa sessione MPI.
+ */
+void run_job(const Options* opts, const char* filelist_path, int rank, int size) {
+    strcpy(output_dir, opts->output_dir);
+    if (rank == 0 && output_dir[0] && mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Cannot create output directory");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Il seme dell'hash cambia a ogni run ma deve coincidere tra i rank, o le partizioni per hash non combaciano
+    uint64_t seed = opts->hash_seed_set ? opts->hash_seed : (rank == 0 ? wc_random_seed() : 0);
+    MPI_Bcast(&seed, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    init_hash_key(seed);
+
+    // Le ricerche nell'indice non leggono il corpus: le esegue il master da solo
+    if (opts->lookup_words) {
+        if (rank == 0) {
+            run_index_lookup(output_path("word_frequencies.bin"), opts->lookup_words);
+        }
+        return;
+    }
+
+    double start_time, end_time, total_time;
+    start_time = MPI_Wtime();
+
+    char file_list[MAX_FILES][MAX_FILENAME_LEN];
+    CorpusGroups groups;
+    groups.count = 0;
+    int total_files = 0;
+    if (rank == 0) {
+        printf("MPI Word Count Scalability Test\n");
+        printf("Number of processes: %d\n", size);
+        total_files = read_file_list(filelist_path, file_list, &groups);
+        if (groups.count > 0) {
+            printf("File list defines %d groups.\n", groups.count);
+            if (opts->dictionary_path[0] || opts->cooccurrence_window > 0 || opts->char_histogram != CHAR_HISTOGRAM_NONE ||
+                opts->merge_saved || opts->diff_filelist[0] || opts->sample_fraction > 0.0) {
+                printf("Group labels only apply to word counting and are ignored in this mode.\n");
             }
-        }        printf("Master: Global histogram contains %d unique words.\n", global_histogram.count);
-        sort_histogram_by_word(&global_histogram);
-        write_histogram_to_csv(&global_histogram, "word_frequencies.csv");
-        printf("Master: Output written to word_frequencies.csv\n");
+        }
+    }
 
+    if (opts->dedup_threshold > 0.0) {
+        total_files = run_dedup(file_list, total_files, &groups, opts, rank, size);
+    }
+
+    // Le statistiche in stile wc sono disponibili solo nelle modalità che tokenizzano il corpus
+    TextStats corpus_stats;
+    int have_corpus_stats = 0;
+    if (opts->dictionary_path[0]) {
+        run_dictionary_count(file_list, total_files, opts, rank, size);
+    } else if (opts->cooccurrence_window > 0) {
+        run_cooccurrence_count(file_list, total_files, opts, rank, size, &corpus_stats);
+        have_corpus_stats = 1;
+    } else if (opts->char_histogram != CHAR_HISTOGRAM_NONE) {
+        run_char_histogram(file_list, total_files, opts, rank, size);
+    } else if (opts->diff_filelist[0]) {
+        run_corpus_diff(file_list, total_files, opts, rank, size);
+    } else if (opts->merge_saved) {
+        run_merge_saved(file_list, total_files, opts, rank, size);
+    } else if (opts->sample_fraction > 0.0) {
+        run_sampled_count(file_list, total_files, opts, rank, size);
+    } else {
+        run_word_count(file_list, total_files, &groups, opts, rank, size, NULL, &corpus_stats);
+        have_corpus_stats = 1;
+    }
 
+    if (rank == 0) {
         end_time = MPI_Wtime();
         total_time = end_time - start_time;
         
@@ -293,40 +5506,152 @@ int main(int argc, char *argv[]) {
         printf("Processes used: %d\n", size);
         printf("Files processed: %d\n", total_files);
         printf("Total execution time: %.4f seconds\n", total_time);
+        if (have_corpus_stats) {
+            print_text_stats(&corpus_stats);
+        }
+    }
+    report_memory_usage(rank, size);
+}
 
-        free_histogram_content(&global_histogram);
-
-    } else { 
-        Histogram local_histogram;
-        init_histogram(&local_histogram);
-        MPI_Status status;
-
-        while (1) {
-            char task_filename[MAX_FILENAME_LEN];
-            MPI_Recv(task_filename, MAX_FILENAME_LEN, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+/*
+ * Modalità batch: ogni riga del file dei job è "FILELIST OUTPUT_DIR [opzioni...]". Il master legge il file
+ * e lo trasmette; ogni rank ricostruisce gli argomenti del job (opzioni della riga di comando seguite da
+ * quelle del job, che prevalgono) e li interpreta allo stesso modo, quindi tutti eseguono gli stessi job.
+ */
+void run_job_batch(const char* jobs_path, int argc, char* argv[], int rank, int size) {
+    uint64_t len = 0;
+    char* text = NULL;
+    if (rank == 0) {
+        FILE* fp = fopen(jobs_path, "rb");
+        if (!fp) {
+            perror("Errore nell'apertura del file dei job");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        fseek(fp, 0, SEEK_END);
+        len = (uint64_t)ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        text = (char*)malloc(len + 1);
+        if (!text || fread(text, 1, len, fp) != len) {
+            perror("Failed to read job list");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        fclose(fp);
+    }
+    MPI_Bcast(&len, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    if (len > INT32_MAX) {
+        if (rank == 0) {
+            fprintf(stderr, "Job list %s is too large\n", jobs_path);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (rank != 0) {
+        text = (char*)malloc(len + 1);
+        if (!text) {
+            perror("Failed to allocate job list");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    MPI_Bcast(text, (int)len, MPI_CHAR, 0, MPI_COMM_WORLD);
+    text[len] = '\0';
 
-            if (status.MPI_TAG == TAG_END_OF_TASKS_SEND_HISTOGRAM) {
-                MPI_Send(&local_histogram.count, 1, MPI_INT, 0, TAG_HISTOGRAM_DATA_COUNT, MPI_COMM_WORLD);
-                for (int i = 0; i < local_histogram.count; ++i) {
-                    MPI_Send(local_histogram.items[i].word, MAX_WORD_LEN, MPI_CHAR, 0, TAG_HISTOGRAM_DATA_WORD, MPI_COMM_WORLD);
-                    MPI_Send(&local_histogram.items[i].frequency, 1, MPI_INT, 0, TAG_HISTOGRAM_DATA_FREQ, MPI_COMM_WORLD);
-                }
+    int job_no = 0;
+    char* line_save;
+    for (char* line = strtok_r(text, "\n", &line_save); line; line = strtok_r(NULL, "\n", &line_save)) {
+        char* job_argv[MAX_JOB_ARGS];
+        int job_argc = 0;
+        job_argv[job_argc++] = argv[0];
+        for (int i = 1; i < argc && job_argc < MAX_JOB_ARGS; ++i) {
+            if (strncmp(argv[i], "--jobs=", 7) != 0) {
+                job_argv[job_argc++] = argv[i];
+            }
+        }
+        char* tok_save;
+        char* filelist_path = strtok_r(line, " \t\r", &tok_save);
+        if (!filelist_path || filelist_path[0] == '#') {
+            continue;
+        }
+        job_no++;
+        char* job_output_dir = strtok_r(NULL, " \t\r", &tok_save);
+        char output_arg[MAX_FILENAME_LEN + 16];
+        snprintf(output_arg, sizeof(output_arg), "--output-dir=%s", job_output_dir ? job_output_dir : "");
+        if (job_argc < MAX_JOB_ARGS) {
+            job_argv[job_argc++] = output_arg;
+        }
+        int too_many = 0;
+        for (char* arg = strtok_r(NULL, " \t\r", &tok_save); arg; arg = strtok_r(NULL, " \t\r", &tok_save)) {
+            if (job_argc == MAX_JOB_ARGS) {
+                too_many = 1;
                 break;
             }
+            job_argv[job_argc++] = arg;
+        }
 
-            Histogram* file_hist = count_words_in_file(task_filename);
-            if (file_hist) {
-                merge_histograms(&local_histogram, file_hist);
-                free_histogram_content(file_hist);
-                free(file_hist);
+        Options job_opts;
+        if (!job_output_dir || too_many || parse_options(job_argc, job_argv, &job_opts) != 0 || job_opts.jobs_path[0]) {
+            if (rank == 0) {
+                fprintf(stderr, "Skipping job %d: expected \"FILELIST OUTPUT_DIR [options]\" with valid options\n", job_no);
+            }
+            continue;
+        }
+        if (rank == 0) {
+            printf("\n=== Job %d: %s -> %s ===\n", job_no, filelist_path, job_output_dir);
+            // Il livello di thread si sceglie in main dalla sola riga di comando
+            if (job_opts.progress_thread && !mpi_thread_multiple) {
+                fprintf(stderr, "Job %d: --progress-thread is ignored because MPI was not initialized with "
+                        "MPI_THREAD_MULTIPLE (pass --progress-thread on the command line)\n", job_no);
             }
+        }
+        run_job(&job_opts, filelist_path, rank, size);
+    }
+    free(text);
+}
 
-            int dummy_ack = rank;
-            MPI_Send(&dummy_ack, 1, MPI_INT, 0, TAG_PROCESSED_FILE_ACK, MPI_COMM_WORLD);
+int main(int argc, char *argv[]) {
+    // Il livello di thread si sceglie prima di interpretare le opzioni, che richiedono MPI già inizializzato
+    int want_threads = 0;
+    for (int i = 1; i < argc; ++i) {
+        want_threads |= strcmp(argv[i], "--progress-thread") == 0;
+    }
+    int provided = MPI_THREAD_SINGLE;
+    MPI_Init_thread(&argc, &argv, want_threads ? MPI_THREAD_MULTIPLE : MPI_THREAD_SINGLE, &provided);
+    mpi_thread_multiple = provided >= MPI_THREAD_MULTIPLE;
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    options_quiet = rank != 0;
+    Options opts;
+    if (parse_options(argc, argv, &opts) != 0) {
+        if (rank == 0) {
+            print_usage(argv[0]);
         }
-        free_histogram_content(&local_histogram);
+        MPI_Finalize();
+        return 1;
+    }
+    if (opts.progress_thread && !mpi_thread_multiple && rank == 0) {
+        fprintf(stderr, "MPI library does not provide MPI_THREAD_MULTIPLE: --progress-thread is ignored\n");
+    }
+
+    // Processo lanciato dal master con --spawn-workers: fa solo da worker del conteggio
+    MPI_Comm parent;
+    MPI_Comm_get_parent(&parent);
+    if (parent != MPI_COMM_NULL) {
+        init_hash_key(wc_random_seed());
+        run_elastic_worker(&opts, parent);
+        MPI_Comm_disconnect(&parent);
+        comm_pool_drain();
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (opts.jobs_path[0]) {
+        run_job_batch(opts.jobs_path, argc, argv, rank, size);
+    } else {
+        run_job(&opts, opts.filelist_path, rank, size);
     }
 
+    comm_pool_drain();
     MPI_Finalize();
     return 0;
 }
\ No newline at end of file
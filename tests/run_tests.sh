@@ -0,0 +1,40 @@
+#!/bin/bash
+# Compila il programma ed esegue tutti i test tests/test_*.sh; esce con 1 se almeno uno fallisce.
+# Variabili: MPICC, CC, MPIRUN, WORDCOUNT e WC_LIBRARY_COUNT (binari già compilati, che saltano la compilazione).
+set -u
+TESTS_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$(dirname "$TESTS_DIR")"
+WORK_DIR="$(mktemp -d)"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+if [ -z "${WORDCOUNT:-}" ]; then
+    WORDCOUNT="$WORK_DIR/wordcount"
+    "${MPICC:-mpicc}" -O2 "$REPO_DIR/main.c" "$REPO_DIR/wordcount.c" -o "$WORDCOUNT" -lm || exit 1
+fi
+export WORDCOUNT
+
+if [ -z "${WC_LIBRARY_COUNT:-}" ]; then
+    WC_LIBRARY_COUNT="$WORK_DIR/wc_library_count"
+    "${CC:-cc}" -O2 -I"$REPO_DIR" "$TESTS_DIR/wc_library_count.c" "$REPO_DIR/wordcount.c" -o "$WC_LIBRARY_COUNT" || exit 1
+fi
+export WC_LIBRARY_COUNT
+
+MPIRUN_CMD="${MPIRUN:-mpirun} --oversubscribe"
+if [ "$(id -u)" = 0 ]; then
+    MPIRUN_CMD="$MPIRUN_CMD --allow-run-as-root"
+fi
+export MPIRUN_CMD
+
+failed=0
+for test in "$TESTS_DIR"/test_*.sh; do
+    name="$(basename "$test" .sh)"
+    mkdir -p "$WORK_DIR/$name"
+    if (cd "$WORK_DIR/$name" && bash "$test" > output.log 2>&1); then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        sed 's/^/    /' "$WORK_DIR/$name/output.log"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Deduplicazione non transitiva: b è simile ad a e c è simile a b, ma c e a sono sotto la soglia, quindi c resta.
+set -eu
+
+python3 - <<'PY'
+a = ["w%d" % i for i in range(1000)]
+b = a[:920] + ["b%d" % i for i in range(80)]
+c = ["c%d" % i for i in range(80)] + b[80:]
+for name, words in (("a", a), ("b", b), ("c", c)):
+    with open(name + ".txt", "w") as f:
+        f.write(" ".join(words) + "\n")
+PY
+printf 'a.txt\nb.txt\nc.txt\n' > files.txt
+
+for np in 1 3; do
+    $MPIRUN_CMD -np $np "$WORDCOUNT" --filelist=files.txt --dedup=0.8 --hash-seed=4 --output-dir=out$np > run$np.log
+    grep -q 'Files processed: 2' run$np.log
+    test "$(tail -n +2 out$np/dedup_report.csv | cut -d, -f1,2)" = "b.txt,a.txt"
+    awk -F, 'NR > 1 && $3 < 0.8 { exit 1 }' out$np/dedup_report.csv
+done
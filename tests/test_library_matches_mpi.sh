@@ -0,0 +1,27 @@
+#!/bin/bash
+# La libreria wordcount e il programma MPI devono contare le stesse parole e leggersi a vicenda i file .bin.
+set -eu
+
+# Maiuscole, cifre, punteggiatura, byte non ASCII e parole oltre WC_MAX_WORD_LEN - 1 caratteri
+awk 'BEGIN {
+    split("The quick BROWN fox jumps over the lazy dog 42 times x86_64 e-mail", w, " ")
+    for (i = 0; i < 4000; ++i) {
+        printf "%s%s", w[i % 13 + 1] (i % 97), (i % 7 == 0) ? ".\n" : " "
+    }
+}' > a.txt
+printf 'caf\xc3\xa9 na\xefve \xff\xfeword\tTAB\r\nend' > b.txt
+awk 'BEGIN { for (i = 0; i < 300; ++i) printf "%c", 97 + i % 26; printf " short "; for (i = 0; i < 99; ++i) printf "Z"; printf "\n" }' > c.txt
+printf 'a.txt\nb.txt\nc.txt\n' > filelist.txt
+
+"$WC_LIBRARY_COUNT" a.txt b.txt c.txt --save=library.bin > library.csv
+for np in 1 3; do
+    $MPIRUN_CMD -np $np "$WORDCOUNT" --filelist=filelist.txt --sort=frequency --binary-output --output-dir=mpi$np
+    diff -u library.csv mpi$np/word_frequencies.csv
+done
+
+# Un .bin della libreria fuso dal programma MPI, e un .bin del programma MPI caricato dalla libreria
+printf 'library.bin\n' > saved.txt
+$MPIRUN_CMD -np 2 "$WORDCOUNT" --merge --filelist=saved.txt --sort=frequency --output-dir=merged
+diff -u library.csv merged/word_frequencies.csv
+"$WC_LIBRARY_COUNT" --load=mpi3/word_frequencies.bin > loaded.csv
+diff -u library.csv loaded.csv
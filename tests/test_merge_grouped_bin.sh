@@ -0,0 +1,24 @@
+#!/bin/bash
+# --merge di file .bin salvati da un run con gruppi: le parole comuni ai gruppi vanno sommate in una sola riga.
+set -eu
+
+printf 'the cat sat on the mat\n' > a.txt
+printf 'the dog sat on the log\n' > b.txt
+printf 'alpha\ta.txt\nbeta\tb.txt\n' > groups.txt
+printf 'saved/word_frequencies_alpha.bin\nsaved/word_frequencies_beta.bin\n' > saved.txt
+cat > expected.csv <<'CSV'
+word,frequency
+cat,1
+dog,1
+log,1
+mat,1
+on,2
+sat,2
+the,4
+CSV
+
+$MPIRUN_CMD -np 2 "$WORDCOUNT" --filelist=groups.txt --binary-output --output-dir=saved
+for np in 1 3; do
+    $MPIRUN_CMD -np $np "$WORDCOUNT" --merge --filelist=saved.txt --output-dir=merged$np
+    diff -u expected.csv merged$np/word_frequencies.csv
+done
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Ricerca nell'indice MPHF: parole presenti e assenti, poi un indice troncato che va rifiutato senza leggerne oltre la fine.
+set -eu
+
+printf 'the cat sat on the mat\nthe dog sat on the log\n' > a.txt
+printf 'a.txt\n' > files.txt
+$MPIRUN_CMD -np 2 "$WORDCOUNT" --filelist=files.txt --mphf --output-dir=indexed
+
+$MPIRUN_CMD -np 1 "$WORDCOUNT" --filelist=files.txt --output-dir=indexed --lookup=the,Sat,log,bird > lookup.log 2>&1
+grep -qx 'the,4' lookup.log
+grep -qx 'sat,2' lookup.log
+grep -qx 'log,1' lookup.log
+grep -qx 'bird,not found' lookup.log
+
+mkdir -p truncated
+size=$(stat -c %s indexed/word_frequencies.bin)
+head -c $((size - 3)) indexed/word_frequencies.bin > truncated/word_frequencies.bin
+$MPIRUN_CMD -np 1 "$WORDCOUNT" --filelist=files.txt --output-dir=truncated --lookup=the > truncated.log 2>&1 || true
+grep -q 'corrupt perfect hash index' truncated.log
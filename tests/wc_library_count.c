@@ -0,0 +1,69 @@
+// Conta le parole con la libreria wordcount e stampa il CSV "word,frequency" in ordine di frequenza, come
+// --sort=frequency del programma MPI. Uso: wc_library_count [--load=FILE.bin] [--save=FILE.bin] [FILE...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "wordcount.h"
+
+// Blocchi piccoli e di lunghezza dispari: molte parole restano a cavallo di due chiamate a wc_counter_feed
+#define FEED_CHUNK 7
+
+static void check(int err, const char* what) {
+    if (err != WC_OK) {
+        fprintf(stderr, "%s: %s\n", what, wc_strerror(err));
+        exit(1);
+    }
+}
+
+static void count_file(WcCounter* counter, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    char buf[FEED_CHUNK];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        check(wc_counter_feed(counter, buf, n), path);
+    }
+    fclose(fp);
+    // Ogni file è un documento a sé, come nel programma MPI
+    check(wc_counter_flush(counter), path);
+}
+
+int main(int argc, char** argv) {
+    WcCounter* counter = wc_counter_create();
+    if (!counter) {
+        fprintf(stderr, "Failed to create the counter\n");
+        return 1;
+    }
+    const char* save_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--load=", 7) == 0) {
+            check(wc_counter_load(counter, argv[i] + 7), argv[i] + 7);
+        } else if (strncmp(argv[i], "--save=", 7) == 0) {
+            save_path = argv[i] + 7;
+        } else {
+            count_file(counter, argv[i]);
+        }
+    }
+    if (save_path) {
+        check(wc_counter_save(counter, save_path), save_path);
+    }
+
+    WcIterator* it = wc_iterator_create(counter, WC_ORDER_FREQUENCY);
+    if (!it) {
+        fprintf(stderr, "Failed to create the iterator\n");
+        return 1;
+    }
+    const char* word;
+    uint64_t count;
+    printf("word,frequency\n");
+    while (wc_iterator_next(it, &word, &count)) {
+        printf("%s,%" PRIu64 "\n", word, count);
+    }
+    wc_iterator_destroy(it);
+    wc_counter_destroy(counter);
+    return 0;
+}
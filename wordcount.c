@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include "wordcount.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define WC_INITIAL_ENTRIES 64
+#define WC_INITIAL_WORD_BYTES 1024
+#define WC_MIN_SLOTS 128
+#define WC_MAX_PROBE 64                 // sonda più lunga tollerata prima di ricostruire l'indice con una nuova chiave
+#define WC_EMPTY_SLOT UINT32_MAX
+
+typedef struct {
+    uint64_t count;
+    size_t word;        // offset della parola (terminata da '\0') in words
+} WcEntry;
+
+/*
+ * Le voci stanno in entries nell'ordine di inserimento e le parole, una dopo l'altra, in words; slots è un
+ * indice a indirizzamento aperto (scansione lineare) sulle posizioni in entries, con fattore di carico al più 1/2.
+ */
+struct WcCounter {
+    WcEntry* entries;
+    size_t num_entries;
+    size_t entries_capacity;
+    char* words;
+    size_t words_len;
+    size_t words_capacity;
+    uint32_t* slots;
+    size_t slot_mask;   // numero di slot - 1 (potenza di 2)
+    uint64_t key[2];    // chiave SipHash dell'indice
+    uint64_t total;
+    WcTokenizer tok;    // parola in corso tra un blocco e il successivo
+};
+
+typedef struct {
+    const char* word;
+    uint64_t count;
+} WcItem;
+
+struct WcIterator {
+    WcItem* items;
+    size_t count;
+    size_t next;
+};
+
+#define WC_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define WC_SIP_ROUND(v0, v1, v2, v3)                                        \
+    do {                                                                    \
+        v0 += v1; v1 = WC_ROTL(v1, 13); v1 ^= v0; v0 = WC_ROTL(v0, 32);     \
+        v2 += v3; v3 = WC_ROTL(v3, 16); v3 ^= v2;                           \
+        v0 += v3; v3 = WC_ROTL(v3, 21); v3 ^= v0;                           \
+        v2 += v1; v1 = WC_ROTL(v1, 17); v1 ^= v2; v2 = WC_ROTL(v2, 32);     \
+    } while (0)
+
+uint64_t wc_siphash13(const void* data, size_t len, uint64_t k0, uint64_t k1) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    size_t blocks = len / 8;
+    for (size_t i = 0; i < blocks; ++i) {
+        uint64_t m;
+        memcpy(&m, p + 8 * i, sizeof(m));
+        v3 ^= m;
+        WC_SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)len << 56;
+    for (size_t i = 0; i < (len & 7); ++i) {
+        last |= (uint64_t)p[blocks * 8 + i] << (8 * i);
+    }
+    v3 ^= last;
+    WC_SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    WC_SIP_ROUND(v0, v1, v2, v3);
+    WC_SIP_ROUND(v0, v1, v2, v3);
+    WC_SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void wc_derive_key(uint64_t seed, uint64_t key[2]) {
+    key[0] = wc_mix64(seed);
+    key[1] = wc_mix64(seed ^ 0x9e3779b97f4a7c15ULL);
+}
+
+uint64_t wc_random_seed(void) {
+    uint64_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        seed = wc_mix64(((uint64_t)tv.tv_sec << 20) ^ (uint64_t)tv.tv_usec ^ ((uint64_t)getpid() << 40));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return seed;
+}
+
+void wc_tokenizer_init(WcTokenizer* tok) {
+    tok->len = 0;
+}
+
+void wc_tokenizer_feed(WcTokenizer* tok, const char* data, size_t len, WcWordFn on_word, void* ctx) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; ++i) {
+        if (wc_is_word_char(p[i])) {
+            if (tok->len < WC_MAX_WORD_LEN - 1) {
+                tok->word[tok->len++] = wc_fold(p[i]);
+            }
+        } else if (tok->len > 0) {
+            tok->word[tok->len] = '\0';
+            size_t word_len = (size_t)tok->len;
+            tok->len = 0;
+            on_word(ctx, tok->word, word_len);
+        }
+    }
+}
+
+// La parola finale non è seguita da un separatore
+void wc_tokenizer_finish(WcTokenizer* tok, WcWordFn on_word, void* ctx) {
+    if (tok->len > 0) {
+        tok->word[tok->len] = '\0';
+        size_t word_len = (size_t)tok->len;
+        tok->len = 0;
+        on_word(ctx, tok->word, word_len);
+    }
+}
+
+char* wc_serial_put_header(char* p, int32_t count, int32_t has_groups) {
+    memcpy(p, &count, sizeof(int32_t));
+    memcpy(p + sizeof(int32_t), &has_groups, sizeof(int32_t));
+    return p + WC_SERIAL_HEADER_LEN;
+}
+
+char* wc_serial_put_record(char* p, int has_groups, int32_t frequency, int32_t group, const char* word,
+                           size_t word_len) {
+    memcpy(p, &frequency, sizeof(int32_t));
+    p += sizeof(int32_t);
+    if (has_groups) {
+        memcpy(p, &group, sizeof(int32_t));
+        p += sizeof(int32_t);
+    }
+    memcpy(p, word, word_len);
+    p[word_len] = '\0';
+    return p + word_len + 1;
+}
+
+int wc_serial_get_header(const char* buf, size_t len, int32_t* count, int32_t* has_groups) {
+    if (len < WC_SERIAL_HEADER_LEN) {
+        return WC_ERR_FORMAT;
+    }
+    memcpy(count, buf, sizeof(int32_t));
+    memcpy(has_groups, buf + sizeof(int32_t), sizeof(int32_t));
+    return *count >= 0 && (*has_groups == 0 || *has_groups == 1) ? WC_OK : WC_ERR_FORMAT;
+}
+
+const char* wc_serial_get_record(const char* p, const char* end, int has_groups, int32_t* frequency,
+                                 int32_t* group, const char** word, size_t* word_len) {
+    size_t header_len = (has_groups ? 2 : 1) * sizeof(int32_t);
+    if (end - p < (ptrdiff_t)header_len + 1) {
+        return NULL;
+    }
+    memcpy(frequency, p, sizeof(int32_t));
+    *group = 0;
+    if (has_groups) {
+        memcpy(group, p + sizeof(int32_t), sizeof(int32_t));
+    }
+    p += header_len;
+    size_t n = strnlen(p, (size_t)(end - p));
+    if (*frequency < 0 || p + n >= end || n >= WC_MAX_WORD_LEN) {
+        return NULL;
+    }
+    *word = p;
+    *word_len = n;
+    return p + n + 1;
+}
+
+static int wc_rebuild_index(WcCounter* counter, size_t num_slots) {
+    uint32_t* slots = (uint32_t*)malloc(num_slots * sizeof(uint32_t));
+    if (!slots) {
+        return WC_ERR_NOMEM;
+    }
+    memset(slots, 0xff, num_slots * sizeof(uint32_t));
+    size_t mask = num_slots - 1;
+    int longest = 0;
+    for (size_t e = 0; e < counter->num_entries; ++e) {
+        const char* word = counter->words + counter->entries[e].word;
+        size_t i = wc_siphash13(word, strlen(word), counter->key[0], counter->key[1]) & mask;
+        int probe = 0;
+        while (slots[i] != WC_EMPTY_SLOT) {
+            i = (i + 1) & mask;
+            probe++;
+        }
+        slots[i] = (uint32_t)e;
+        if (probe > longest) {
+            longest = probe;
+        }
+    }
+    free(counter->slots);
+    counter->slots = slots;
+    counter->slot_mask = mask;
+    return longest;
+}
+
+/*
+ * Sonde lunghe con una chiave segreta sono improbabili: si cambia chiave e, se non basta, si raddoppiano gli slot.
+ * Senza memoria per il nuovo indice si tengono l'indice e la chiave precedenti, che restano corretti.
+ */
+static void wc_rekey(WcCounter* counter) {
+    size_t num_slots = counter->slot_mask + 1;
+    int longest;
+    do {
+        uint64_t old_key[2] = { counter->key[0], counter->key[1] };
+        counter->key[0] = wc_mix64(counter->key[0] + 0x9e3779b97f4a7c15ULL);
+        counter->key[1] = wc_mix64(counter->key[1] ^ counter->key[0]);
+        longest = wc_rebuild_index(counter, num_slots);
+        if (longest < 0) {
+            counter->key[0] = old_key[0];
+            counter->key[1] = old_key[1];
+        }
+        num_slots *= 2;
+    } while (longest > WC_MAX_PROBE);
+}
+
+// Voce della parola (già normalizzata, lunga len); se manca viene aggiunta con frequenza 0. NULL senza memoria
+static WcEntry* wc_find_or_insert(WcCounter* counter, const char* word, size_t len) {
+    if (!counter->slots || (counter->num_entries + 1) * 2 > counter->slot_mask + 1) {
+        size_t num_slots = counter->slots ? (counter->slot_mask + 1) * 2 : WC_MIN_SLOTS;
+        if (counter->num_entries + 1 >= WC_EMPTY_SLOT || wc_rebuild_index(counter, num_slots) < 0) {
+            return NULL;
+        }
+    }
+
+    size_t mask = counter->slot_mask;
+    size_t i = wc_siphash13(word, len, counter->key[0], counter->key[1]) & mask;
+    int probe = 0;
+    while (counter->slots[i] != WC_EMPTY_SLOT) {
+        WcEntry* entry = &counter->entries[counter->slots[i]];
+        if (strcmp(counter->words + entry->word, word) == 0) {
+            return entry;
+        }
+        i = (i + 1) & mask;
+        probe++;
+    }
+
+    if (counter->num_entries == counter->entries_capacity) {
+        size_t capacity = counter->entries_capacity ? counter->entries_capacity * 2 : WC_INITIAL_ENTRIES;
+        WcEntry* entries = (WcEntry*)realloc(counter->entries, capacity * sizeof(WcEntry));
+        if (!entries) {
+            return NULL;
+        }
+        counter->entries = entries;
+        counter->entries_capacity = capacity;
+    }
+    if (counter->words_len + len + 1 > counter->words_capacity) {
+        size_t capacity = counter->words_capacity ? counter->words_capacity * 2 : WC_INITIAL_WORD_BYTES;
+        while (capacity < counter->words_len + len + 1) {
+            capacity *= 2;
+        }
+        char* words = (char*)realloc(counter->words, capacity);
+        if (!words) {
+            return NULL;
+        }
+        counter->words = words;
+        counter->words_capacity = capacity;
+    }
+
+    WcEntry* entry = &counter->entries[counter->num_entries];
+    entry->count = 0;
+    entry->word = counter->words_len;
+    memcpy(counter->words + counter->words_len, word, len + 1);
+    counter->words_len += len + 1;
+    counter->slots[i] = (uint32_t)counter->num_entries++;
+    if (probe > WC_MAX_PROBE) {
+        size_t idx = counter->num_entries - 1;
+        wc_rekey(counter);
+        entry = &counter->entries[idx];
+    }
+    return entry;
+}
+
+static int wc_add_normalized(WcCounter* counter, const char* word, size_t len, uint64_t count) {
+    WcEntry* entry = wc_find_or_insert(counter, word, len);
+    if (!entry) {
+        return WC_ERR_NOMEM;
+    }
+    entry->count += count;
+    counter->total += count;
+    return WC_OK;
+}
+
+WcCounter* wc_counter_create(void) {
+    WcCounter* counter = (WcCounter*)calloc(1, sizeof(WcCounter));
+    if (!counter) {
+        return NULL;
+    }
+    wc_derive_key(wc_random_seed(), counter->key);
+    wc_tokenizer_init(&counter->tok);
+    return counter;
+}
+
+void wc_counter_destroy(WcCounter* counter) {
+    if (!counter) {
+        return;
+    }
+    free(counter->entries);
+    free(counter->words);
+    free(counter->slots);
+    free(counter);
+}
+
+void wc_counter_reset(WcCounter* counter) {
+    counter->num_entries = 0;
+    counter->words_len = 0;
+    counter->total = 0;
+    wc_tokenizer_init(&counter->tok);
+    if (counter->slots) {
+        memset(counter->slots, 0xff, (counter->slot_mask + 1) * sizeof(uint32_t));
+    }
+}
+
+typedef struct {
+    WcCounter* counter;
+    int result;
+} WcFeed;
+
+// Una parola che non si riesce ad aggiungere va persa, ma il resto del blocco viene comunque contato
+static void wc_feed_word(void* ctx, const char* word, size_t len) {
+    WcFeed* feed = (WcFeed*)ctx;
+    int err = wc_add_normalized(feed->counter, word, len, 1);
+    if (err != WC_OK) {
+        feed->result = err;
+    }
+}
+
+int wc_counter_feed(WcCounter* counter, const char* data, size_t len) {
+    WcFeed feed = { counter, WC_OK };
+    wc_tokenizer_feed(&counter->tok, data, len, wc_feed_word, &feed);
+    return feed.result;
+}
+
+int wc_counter_flush(WcCounter* counter) {
+    WcFeed feed = { counter, WC_OK };
+    wc_tokenizer_finish(&counter->tok, wc_feed_word, &feed);
+    return feed.result;
+}
+
+int wc_counter_add(WcCounter* counter, const char* word, uint64_t count) {
+    char normalized[WC_MAX_WORD_LEN];
+    size_t len = 0;
+    while (word[len] && len < WC_MAX_WORD_LEN - 1) {
+        normalized[len] = wc_fold((unsigned char)word[len]);
+        len++;
+    }
+    normalized[len] = '\0';
+    return wc_add_normalized(counter, normalized, len, count);
+}
+
+size_t wc_counter_unique_words(const WcCounter* counter) {
+    return counter->num_entries;
+}
+
+uint64_t wc_counter_total_words(const WcCounter* counter) {
+    return counter->total;
+}
+
+uint64_t wc_counter_get(const WcCounter* counter, const char* word) {
+    if (!counter->slots) {
+        return 0;
+    }
+    char normalized[WC_MAX_WORD_LEN];
+    size_t len = 0;
+    while (word[len] && len < WC_MAX_WORD_LEN - 1) {
+        normalized[len] = wc_fold((unsigned char)word[len]);
+        len++;
+    }
+    normalized[len] = '\0';
+    size_t mask = counter->slot_mask;
+    size_t i = wc_siphash13(normalized, len, counter->key[0], counter->key[1]) & mask;
+    while (counter->slots[i] != WC_EMPTY_SLOT) {
+        const WcEntry* entry = &counter->entries[counter->slots[i]];
+        if (strcmp(counter->words + entry->word, normalized) == 0) {
+            return entry->count;
+        }
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+int wc_counter_merge(WcCounter* dest, const WcCounter* src) {
+    // Con dest == src nessuna parola è nuova, quindi words non viene riallocato durante il ciclo
+    size_t n = src->num_entries;
+    for (size_t e = 0; e < n; ++e) {
+        const char* word = src->words + src->entries[e].word;
+        int err = wc_add_normalized(dest, word, strlen(word), src->entries[e].count);
+        if (err != WC_OK) {
+            return err;
+        }
+    }
+    return WC_OK;
+}
+
+int wc_counter_serialize(const WcCounter* counter, char** out, size_t* out_len) {
+    if (counter->num_entries > INT32_MAX) {
+        return WC_ERR_RANGE;
+    }
+    // Le parole in words sono già terminate da '\0'
+    size_t len = WC_SERIAL_HEADER_LEN + counter->num_entries * sizeof(int32_t) + counter->words_len;
+    for (size_t e = 0; e < counter->num_entries; ++e) {
+        if (counter->entries[e].count > INT32_MAX) {
+            return WC_ERR_RANGE;
+        }
+    }
+    char* buf = (char*)malloc(len);
+    if (!buf) {
+        return WC_ERR_NOMEM;
+    }
+    char* p = wc_serial_put_header(buf, (int32_t)counter->num_entries, 0);
+    for (size_t e = 0; e < counter->num_entries; ++e) {
+        const char* word = counter->words + counter->entries[e].word;
+        p = wc_serial_put_record(p, 0, (int32_t)counter->entries[e].count, 0, word, strlen(word));
+    }
+    *out = buf;
+    *out_len = len;
+    return WC_OK;
+}
+
+// Prima si verifica tutto il buffer, così un buffer non valido non lascia il contatore sommato a metà
+int wc_counter_merge_serialized(WcCounter* counter, const char* buf, size_t len) {
+    int32_t count, has_groups;
+    if (wc_serial_get_header(buf, len, &count, &has_groups) != WC_OK) {
+        return WC_ERR_FORMAT;
+    }
+    const char* end = buf + len;
+    for (int pass = 0; pass < 2; ++pass) {
+        const char* p = buf + WC_SERIAL_HEADER_LEN;
+        for (int32_t i = 0; i < count; ++i) {
+            int32_t freq, group;
+            const char* word;
+            size_t word_len;
+            p = wc_serial_get_record(p, end, has_groups, &freq, &group, &word, &word_len);
+            if (!p) {
+                return WC_ERR_FORMAT;
+            }
+            if (pass == 1) {
+                int err = wc_add_normalized(counter, word, word_len, (uint64_t)freq);
+                if (err != WC_OK) {
+                    return err;
+                }
+            }
+        }
+    }
+    return WC_OK;
+}
+
+int wc_counter_save(const WcCounter* counter, const char* path) {
+    char* buf;
+    size_t len;
+    int err = wc_counter_serialize(counter, &buf, &len);
+    if (err != WC_OK) {
+        return err;
+    }
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        free(buf);
+        return WC_ERR_IO;
+    }
+    uint64_t len64 = len;
+    int failed = fwrite(WC_FILE_MAGIC, 1, WC_FILE_MAGIC_LEN, fp) != WC_FILE_MAGIC_LEN ||
+                 fwrite(&len64, sizeof(len64), 1, fp) != 1 || fwrite(buf, 1, len, fp) != len;
+    failed |= fclose(fp) != 0;
+    free(buf);
+    return failed ? WC_ERR_IO : WC_OK;
+}
+
+// Un eventuale indice MPHF dopo il payload (--mphf) viene ignorato
+int wc_counter_load(WcCounter* counter, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return WC_ERR_IO;
+    }
+    char magic[WC_FILE_MAGIC_LEN];
+    uint64_t len64;
+    if (fread(magic, 1, WC_FILE_MAGIC_LEN, fp) != WC_FILE_MAGIC_LEN ||
+        memcmp(magic, WC_FILE_MAGIC, WC_FILE_MAGIC_LEN) != 0 || fread(&len64, sizeof(len64), 1, fp) != 1 ||
+        len64 > SIZE_MAX) {
+        fclose(fp);
+        return WC_ERR_FORMAT;
+    }
+    char* buf = (char*)malloc(len64 > 0 ? (size_t)len64 : 1);
+    if (!buf) {
+        fclose(fp);
+        return WC_ERR_NOMEM;
+    }
+    int err = fread(buf, 1, (size_t)len64, fp) == (size_t)len64 ? WC_OK : WC_ERR_FORMAT;
+    fclose(fp);
+    if (err == WC_OK) {
+        err = wc_counter_merge_serialized(counter, buf, (size_t)len64);
+    }
+    free(buf);
+    return err;
+}
+
+static int wc_compare_items_by_word(const void* a, const void* b) {
+    return strcmp(((const WcItem*)a)->word, ((const WcItem*)b)->word);
+}
+
+static int wc_compare_items_by_frequency(const void* a, const void* b) {
+    const WcItem* ia = (const WcItem*)a;
+    const WcItem* ib = (const WcItem*)b;
+    if (ia->count != ib->count) {
+        return ia->count > ib->count ? -1 : 1;
+    }
+    return strcmp(ia->word, ib->word);
+}
+
+WcIterator* wc_iterator_create(const WcCounter* counter, WcOrder order) {
+    WcIterator* it = (WcIterator*)malloc(sizeof(WcIterator));
+    if (!it) {
+        return NULL;
+    }
+    it->items = (WcItem*)malloc((counter->num_entries > 0 ? counter->num_entries : 1) * sizeof(WcItem));
+    if (!it->items) {
+        free(it);
+        return NULL;
+    }
+    for (size_t e = 0; e < counter->num_entries; ++e) {
+        it->items[e].word = counter->words + counter->entries[e].word;
+        it->items[e].count = counter->entries[e].count;
+    }
+    it->count = counter->num_entries;
+    it->next = 0;
+    qsort(it->items, it->count, sizeof(WcItem),
+          order == WC_ORDER_FREQUENCY ? wc_compare_items_by_frequency : wc_compare_items_by_word);
+    return it;
+}
+
+int wc_iterator_next(WcIterator* it, const char** word, uint64_t* count) {
+    if (it->next == it->count) {
+        return 0;
+    }
+    *word = it->items[it->next].word;
+    *count = it->items[it->next].count;
+    it->next++;
+    return 1;
+}
+
+void wc_iterator_destroy(WcIterator* it) {
+    if (it) {
+        free(it->items);
+        free(it);
+    }
+}
+
+const char* wc_strerror(int err) {
+    switch (err) {
+        case WC_OK: return "success";
+        case WC_ERR_NOMEM: return "out of memory";
+        case WC_ERR_FORMAT: return "invalid or truncated serialized histogram";
+        case WC_ERR_RANGE: return "count too large for the serialized format";
+        case WC_ERR_IO: return "I/O error";
+        default: return "unknown error";
+    }
+}
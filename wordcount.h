@@ -0,0 +1,167 @@
+#ifndef WORDCOUNT_H
+#define WORDCOUNT_H
+
+/*
+ * Conteggio parole in-process, senza MPI, su dati già in memoria. Tokenizer, hash e formato serializzato sono
+ * quelli che usa anche il programma MPI (main.c li prende da qui), quindi i risultati coincidono. Si compila
+ * wordcount.c insieme al proprio programma oppure si collega libwordcount.a (make libwordcount.a).
+ *
+ *     WcCounter* counter = wc_counter_create();
+ *     while (...) {
+ *         wc_counter_feed(counter, buf, len);    // una parola può continuare nel blocco successivo
+ *     }
+ *     wc_counter_flush(counter);                 // fine del documento: chiude l'ultima parola
+ *
+ *     WcIterator* it = wc_iterator_create(counter, WC_ORDER_FREQUENCY);
+ *     const char* word;
+ *     uint64_t count;
+ *     while (wc_iterator_next(it, &word, &count)) { ... }
+ *     wc_iterator_destroy(it);
+ *     wc_counter_destroy(counter);
+ *
+ * Le parole sono le sequenze massime di caratteri ASCII alfanumerici, convertite in minuscolo e troncate a
+ * WC_MAX_WORD_LEN - 1 byte, come nel programma MPI. Un contatore non è thread-safe: contatori distinti sì,
+ * e si combinano con wc_counter_merge.
+ *
+ * Le funzioni che possono fallire restituiscono WC_OK o un codice di errore negativo (vedi wc_strerror).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WC_MAX_WORD_LEN 100
+
+#define WC_OK 0
+#define WC_ERR_NOMEM (-1)    // allocazione fallita: il contatore resta valido, senza le parole che non è riuscito ad aggiungere
+#define WC_ERR_FORMAT (-2)   // buffer serializzato o file troncato o non riconosciuto
+#define WC_ERR_RANGE (-3)    // una frequenza supera INT32_MAX e non entra nel formato serializzato
+#define WC_ERR_IO (-4)       // errore di lettura o scrittura del file (errno indica la causa)
+
+/*
+ * Caratteri di parola: alfanumerici ASCII (isalnum nella locale "C"), portati in minuscolo da wc_fold.
+ * Inline, come wc_mix64, perché stanno nei cicli più caldi (tokenizer, MinHash).
+ */
+static inline int wc_is_word_char(unsigned char c) {
+    return (unsigned)(c - '0') < 10 || (unsigned)((c | 0x20) - 'a') < 26;
+}
+
+static inline char wc_fold(unsigned char c) {
+    return (char)((unsigned)(c - 'A') < 26 ? c | 0x20 : c);
+}
+
+// Finalizzatore di splitmix64: distribuisce bene anche chiavi composte da due ID piccoli
+static inline uint64_t wc_mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+ * SipHash-1-3 (un round per blocco, tre finali): senza la chiave non si possono costruire in anticipo
+ * parole che collidono, quindi un input ostile non riesce a degradare le tabelle hash.
+ */
+uint64_t wc_siphash13(const void* data, size_t len, uint64_t k0, uint64_t k1);
+// Chiave SipHash di un seme: lo stesso seme (--hash-seed, indice MPHF) dà la stessa chiave
+void wc_derive_key(uint64_t seed, uint64_t key[2]);
+// Seme casuale da /dev/urandom; in sua assenza orologio e PID
+uint64_t wc_random_seed(void);
+
+/*
+ * Tokenizer a blocchi: una parola può continuare nel blocco successivo e viene consegnata a on_word
+ * (già in minuscolo, terminata da '\0' e troncata a WC_MAX_WORD_LEN - 1 byte) al primo separatore o
+ * a wc_tokenizer_finish. len > 0 finché c'è una parola in corso.
+ */
+typedef void (*WcWordFn)(void* ctx, const char* word, size_t len);
+
+typedef struct {
+    char word[WC_MAX_WORD_LEN];
+    int len;
+} WcTokenizer;
+
+void wc_tokenizer_init(WcTokenizer* tok);
+void wc_tokenizer_feed(WcTokenizer* tok, const char* data, size_t len, WcWordFn on_word, void* ctx);
+void wc_tokenizer_finish(WcTokenizer* tok, WcWordFn on_word, void* ctx);
+
+/*
+ * Formato serializzato: conteggio delle voci (int32) e flag di gruppo (int32) seguiti, per ogni voce,
+ * dalla frequenza (int32), dal gruppo (int32, solo se il flag è attivo) e dalla parola terminata da '\0'.
+ * Un file salvato (--binary-output) è WC_FILE_MAGIC, la lunghezza del payload (uint64) e il payload.
+ */
+#define WC_FILE_MAGIC "WCHIST01"
+#define WC_FILE_MAGIC_LEN 8
+#define WC_SERIAL_HEADER_LEN (2 * sizeof(int32_t))
+
+static inline size_t wc_serial_record_len(size_t word_len, int has_groups) {
+    return (has_groups ? 2 : 1) * sizeof(int32_t) + word_len + 1;
+}
+
+// Scrivono l'intestazione e una voce in p e restituiscono il puntatore al byte successivo
+char* wc_serial_put_header(char* p, int32_t count, int32_t has_groups);
+char* wc_serial_put_record(char* p, int has_groups, int32_t frequency, int32_t group, const char* word,
+                           size_t word_len);
+// WC_ERR_FORMAT se il buffer è più corto dell'intestazione o questa non è valida
+int wc_serial_get_header(const char* buf, size_t len, int32_t* count, int32_t* has_groups);
+// Legge la voce in p (senza superare end): puntatore alla voce successiva, NULL se è troncata o non valida
+const char* wc_serial_get_record(const char* p, const char* end, int has_groups, int32_t* frequency,
+                                 int32_t* group, const char** word, size_t* word_len);
+
+typedef enum {
+    WC_ORDER_WORD,       // ordine dei byte delle parole
+    WC_ORDER_FREQUENCY   // frequenza decrescente, a parità di frequenza ordine alfabetico
+} WcOrder;
+
+typedef struct WcCounter WcCounter;
+typedef struct WcIterator WcIterator;
+
+// NULL se l'allocazione fallisce. La chiave dell'hash è casuale per contatore, come nel programma MPI
+WcCounter* wc_counter_create(void);
+void wc_counter_destroy(WcCounter* counter);
+// Svuota il contatore mantenendone la memoria
+void wc_counter_reset(WcCounter* counter);
+
+int wc_counter_feed(WcCounter* counter, const char* data, size_t len);
+int wc_counter_flush(WcCounter* counter);
+// Aggiunge count occorrenze di una parola già tokenizzata (viene comunque portata in minuscolo e troncata)
+int wc_counter_add(WcCounter* counter, const char* word, uint64_t count);
+
+size_t wc_counter_unique_words(const WcCounter* counter);
+uint64_t wc_counter_total_words(const WcCounter* counter);
+// 0 se la parola non c'è
+uint64_t wc_counter_get(const WcCounter* counter, const char* word);
+
+int wc_counter_merge(WcCounter* dest, const WcCounter* src);
+
+/*
+ * Formato serializzato descritto sopra: *out va liberato con free(). wc_counter_merge_serialized somma
+ * al contatore un buffer in quel formato; gli istogrammi con gruppi vengono sommati ignorando il gruppo.
+ */
+int wc_counter_serialize(const WcCounter* counter, char** out, size_t* out_len);
+int wc_counter_merge_serialized(WcCounter* counter, const char* buf, size_t len);
+
+// File binario come quelli di --binary-output, che il programma MPI fonde con --merge; load lo somma al contatore
+int wc_counter_save(const WcCounter* counter, const char* path);
+int wc_counter_load(WcCounter* counter, const char* path);
+
+/*
+ * Istantanea ordinata delle parole: le stringhe restano valide finché il contatore non viene modificato
+ * o distrutto. NULL se l'allocazione fallisce.
+ */
+WcIterator* wc_iterator_create(const WcCounter* counter, WcOrder order);
+// 1 e la parola successiva finché ce ne sono, poi 0
+int wc_iterator_next(WcIterator* it, const char** word, uint64_t* count);
+void wc_iterator_destroy(WcIterator* it);
+
+const char* wc_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif